@@ -2,10 +2,47 @@
 /* Author: Ronald L. Rivest                        */
 /* Date: May 29, 1995                              */
 
+#define _GNU_SOURCE              /* for copy_file_range */
 #include <stdio.h>
 #include <ctype.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/file.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <ftw.h>
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+#include <zlib.h>
+#endif
+#if defined(HAVE_ZSTD_H) && defined(HAVE_LIBZSTD)
+#include <zstd.h>
+#endif
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#include <poll.h>
+#include <time.h>
+#endif
+#ifndef IOV_MAX
+#define IOV_MAX 1024             /* max number of buffers given to writev */
+#endif
+
+/* The globals that describe the database being worked on, and the tag
+   options that change as the command line is carried out, are per
+   thread, so that with --batch each worker has its own (see BATCH MODE).
+ */
+#define PERWORKER __thread
 
 #define TRUE  1
 #define FALSE 0
@@ -13,80 +50,208 @@
 #define BIGSTRINGSIZE 10000      /* for text before entries or attr/values */
 #define MAXATTRIBUTES 100        /* max number of attributes in an entry */
 #define MAXAUTHORS 40            /* max number authors on a paper */
-#define MAXSTRINGS 1000          /* max number of string definitions */
-#define MAXENTRIES 10000         /* max number of entries in a database file */
+#define MAXTITLEWORDS 100        /* max number of title words looked at */
 
 /* *** INPUT/OUTPUT DEFINITIONS *** */
-int  InputChar;                  /* input char or EOF for end of file seen */
-int  InputCol = 0;               /* column that input char was read from */
-char InputFileName[STRINGSIZE];  /* File name for Bibtex database file */
-FILE *InputFile;                 /* Bibtex database file */
-char OutputFileName[STRINGSIZE]; /* File name for output Bibtex database file*/
-FILE *OutputFile;                /* Bibtex output database file */
+PERWORKER int  InputChar;        /* input char or EOF for end of file seen */
+PERWORKER int  InputCol = 0;     /* column that input char was read from */
+PERWORKER char InputFileName[STRINGSIZE]; /* File name for Bibtex database file */
+PERWORKER FILE *InputFile;       /* Bibtex database file */
+PERWORKER char OutputFileName[STRINGSIZE]; /* File name for output Bibtex database file*/
+PERWORKER FILE *OutputFile;      /* Bibtex output database file */
 FILE *MessageFile;               /* Error and diagnostic messages */
-int  EOFSeen;                    /* True if EOF seen on this file */
+PERWORKER int  EOFSeen;          /* True if EOF seen on this file */
+PERWORKER off_t InputPosition;   /* offset of input char in the file */
+PERWORKER int  InputSourceIndex = -1; /* SourceFiles index of file being read */
+#define MAXSOURCEFILES 1000      /* max number of input files read */
+PERWORKER struct SourceFile
+{
+  char   *Name;                  /* File name as given on command line */
+  off_t  Size;                   /* Size in bytes when it was read */
+  struct timespec MTime;         /* Modification time when it was read */
+} SourceFiles[MAXSOURCEFILES];   /* input files the database came from */
+PERWORKER int  NumberOfSourceFiles = 0; /* number of such files */
 
 /* *** REPRESENTATION OF AN ENTRY *** */
+struct Attribute
+{
+  char *Name;                    /* Bibtex attribute name eg "year" */
+  char *Value;                   /* Bibtex value for attribute eg "1992" */
+};
+/* The fields used when sorting and computing tags come first, so that
+   they share a cache line; the attribute/value pairs are kept in an
+   array of just the right size, allocated with the entry.
+ */
 struct Entry 
 {
-  char *InitialComments;         /* Text occurring before the entry type */
-  char *EntryType;               /* type of Bibtex entry e.g. "@article" */
-  char *StringDef;               /* definition, if a string constant */
   char *EntryTag;                /* Bibtex Tag e.g. "Rivest92" */
   char *NewEntryTag;             /* New bibtex entry tag */
-  int  EntrySize;                /* Number of attribute/value pairs */
-  char *EntryAttribute[MAXATTRIBUTES]; 
-                                 /* Bibtex attribute name eg "year" */
-  char *EntryValue[MAXATTRIBUTES];
-                                 /* Bibtex value for attribute eg "1992" */
   int  IsCrossRef;               /* True if this is cross-reference target */
+  int  EntrySize;                /* Number of attribute/value pairs */
   struct Entry *CrossRef;        /* points to cross-reference target, if any */
+  struct Attribute *Attributes;  /* the pairs; [0] is reserved for oldtag */
+  char *InitialComments;         /* Text occurring before the entry type */
+  char *EntryType;               /* type of Bibtex entry e.g. "@article" */
+  char *StringDef;               /* definition, if a string constant */
+  char **EntryExpansion;         /* values with @string macros expanded,
+				    computed when first needed */
+  int  SourceIndex;              /* SourceFiles index of file it came from,
+				    or -1 if not from a named file */
+  int  Modified;                 /* MODIFIEDTAG, MODIFIEDFIELDS: what has
+				    changed since it was read */
+  off_t SourceStart;             /* offset of its '@' in that file */
+  off_t SourceEnd;               /* offset just past its closing brace */
+  off_t TagStart;                /* offset of its tag in that file */
+  int  Selection;                /* SELECTED, UNDECIDED, TARGETONLY */
+  long Sequence;                 /* position in the input, with
+				    --memory-budget */
+  uint64_t Fingerprint;          /* hash of its values (see FINGERPRINTS) */
+  int  Diagnosed;                /* kinds of DIAGNOSTICS noted for it, as
+				    bits */
+  char *BaseTag;                 /* with --watch, the new tag as computed
+				    by the options before the first -u */
+  struct FormattedText *Formatted; /* with --watch, its text as last
+				    printed, or NULL */
 } ;
-char   *InitialText;               /* First text in the file */
-struct Entry *Preamble;            /* pointer to preable entry */
-struct Entry *StringArray[MAXSTRINGS];  /* pointers to string entries */
-int    NumberOfStrings;                 /* total number of strings defined */
-struct Entry *EntryArray[MAXENTRIES];   /* pointers to regular entries */
-int    NumberOfEntries;                 /* total number of entries defined */
+#define MODIFIEDTAG    1         /* tag has been replaced */
+#define MODIFIEDFIELDS 2         /* attributes or values have changed */
+#define SELECTED       0         /* entry matches the select options */
+#define UNDECIDED      1         /* depends on fields of its crossref */
+#define TARGETONLY     2         /* kept only as a selected crossref target */
+PERWORKER char   *InitialText;     /* First text in the file */
+PERWORKER struct Entry *Preamble;  /* pointer to preable entry */
+PERWORKER struct Entry **StringArray = NULL; /* pointers to string entries */
+PERWORKER int    NumberOfStrings;  /* total number of strings defined */
+PERWORKER int    StringArraySize = 0; /* allocated size of StringArray */
+PERWORKER struct Entry **EntryArray = NULL; /* pointers to regular entries */
+PERWORKER int    NumberOfEntries;  /* total number of entries defined */
+PERWORKER int    EntryArraySize = 0; /* allocated size of EntryArray */
 
 /* *** VARIABLES USED IN RECOMPUTING TAG *** */
-char NewEntryTag[STRINGSIZE];    /* Temporary variable for new entry tag */
-int  UseHyphens = TRUE;          /* Use hyphens in tag ? */            
-int  CommaSeen;                  /* Comma seen in this name */
-int  CommaJustSeen;              /* Comma just seen after this token */
-int  FirstAuthorNameLengthBound = 12; 
+PERWORKER char NewEntryTag[BIGSTRINGSIZE+STRINGSIZE];
+				 /* Temporary variable for new entry tag
+				    (room for an old tag, which may be as
+				    long as any token, and more) */
+PERWORKER int  UseHyphens = TRUE; /* Use hyphens in tag ? */            
+PERWORKER int  CommaSeen;        /* Comma seen in this name */
+PERWORKER int  CommaJustSeen;    /* Comma just seen after this token */
+PERWORKER int  FirstAuthorNameLengthBound = 12; 
                                  /* Max number of characters from (first)
 			            author's name allowed in new tag */
-int  SecondAuthorNameLengthBound = 2; /* Same for second and later authors */
-int  AuthorBound = 6;            /* Bound on number of authors allowed */
+PERWORKER int  SecondAuthorNameLengthBound = 2; /* Same for second and later authors */
+PERWORKER int  AuthorBound = 6;  /* Bound on number of authors allowed */
 char *NamePrefix[10] =           /* Prefixes that count as part of last name */
     {"De", "Di", "La", "El", "Von", "Van"};
 int  NamePrefixCount = 6;        /* number of such prefixes */
-int  FirstTitleWordLengthBound = 1; 
+PERWORKER int  FirstTitleWordLengthBound = 1; 
                                  /* Max number of characters from (first)
 			            title word allowed in new tag */
-int  SecondTitleWordLengthBound = 1;  /* Same for second and later title words */
-int  TitleWordCountBound = 5;    /* Max number of title words allowed in tag */
+PERWORKER int  SecondTitleWordLengthBound = 1; /* Same for second and later title words */
+PERWORKER int  TitleWordCountBound = 5; /* Max number of title words allowed in tag */
 char *CommonWords[30] =
     {"A","An","And","Are","But","By","For","From","In","Is",
        "Of","On","Over","The","To","Was","Were","With"};
 int  NumberOfCommonWords = 18;
-int  CheckDigitsWanted = 0;      /* Number of check digits wanted in tag */
-int  YearDigitsWanted = 2;       /* Number of digits of year wanted in tag */
-#define HASHTABLESIZE   19661    /* Size of hash table */
-
-char HashTable[HASHTABLESIZE];   /* Hash table for detecting collisions */
+PERWORKER int  CheckDigitsWanted = 0; /* Number of check digits wanted in tag */
+PERWORKER int  LegacyCheckDigits = FALSE; /* compute them as bibtag always
+				    did, not from the fingerprint? */
+PERWORKER int  YearDigitsWanted = 2; /* Number of digits of year wanted in tag */
 
 /* *** VARIABLES CONTROLLING OUTPUT FORMAT *** */
 int  SaveOldTags = FALSE;        /* If replacing tags, then save old tag
 				    as attribute "oldtag" when changed */
 int  SortSwitch = TRUE;          /* sort output into order by tag? */
+#define MAXSORTKEYS 10           /* max number of --sort-by keys */
+int  SortKeys[MAXSORTKEYS];      /* --sort-by keys: SORTBYTAG, ... */
+int  NumberOfSortKeys = 0;       /* how many; if none, sort by tag */
 int  AttributeIndent = 0;        /* Indentation level for attributes */
 int  ValueIndent = 15;           /* Indentation level for values */
-char LeftValueDelimiter = '{';   /* On output, what to start off value with */
-char RightValueDelimiter = '}';  /* On output, what to end value with */
+PERWORKER char LeftValueDelimiter = '{'; /* On output, what to start off value with */
+PERWORKER char RightValueDelimiter = '}'; /* On output, what to end value with */
 int  CompactEqualsSign = FALSE;  /* On output, use attr=value instead of
                                                    attr = value */
+int  OutputThreads = 1;          /* Number of threads formatting output */
+int  PatchMode = FALSE;          /* rewrite changed entries in the input
+				    files instead of printing? */
+char *RewriteCitesDir = NULL;    /* directory of .tex files whose citations
+				    follow the tag changes, if any */
+size_t MemoryBudget = 0;         /* bytes of entries to keep in memory, or
+				    0 for no limit (see EXTERNAL SORTING) */
+int  WatchMode = FALSE;          /* keep running, and write the output
+				    again whenever an input file changes? */
+int  ReportTagChanges = TRUE;    /* print "old ==> new" for changed tags? */
+int  Quiet = FALSE;              /* leave out the notes about entries,
+				    such as missing fields (--quiet)? */
+FILE *TagMapFile = NULL;         /* where to write "old<tab>new" for each
+				    changed tag (--tag-map), or NULL */
+char *TagMapFileName = NULL;
+int  Pipeline = FALSE;           /* read and write by threads of their own
+				    (--pipeline)? */
+int  ShardBy = 0;                /* write a file per value of this key
+				    (--shard-by: SORTBYTAG, ...), or 0 */
+int  ShardIndex = FALSE;         /* and an index of each (--shard-index)? */
+int  DuplicatePolicy = 0;        /* what to do with entries whose tag was
+				    read before (--duplicates), or 0 */
+int  BatchMode = FALSE;          /* each input file a database of its own,
+				    with its own output file (--batch)? */
+
+/* *** CHARACTER CLASSIFICATION *** */
+/* The scanning and tag building loops look every character up in this
+   table instead of calling the <ctype.h> routines, so that the result
+   does not depend on the locale and bytes above 127 are never passed
+   to them as negative numbers.  Bytes above 127 belong to no class.
+ */
+#define CC_UPPER  1
+#define CC_LOWER  2
+#define CC_DIGIT  4
+#define CC_SPACE  8
+#define CC_PUNCT 16
+#define U CC_UPPER
+#define L CC_LOWER
+#define D CC_DIGIT
+#define S CC_SPACE
+#define P CC_PUNCT
+const unsigned char CharClass[256] =
+{
+  0,0,0,0,0,0,0,0,0,S,S,S,S,S,0,0,
+  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+  S,P,P,P,P,P,P,P,P,P,P,P,P,P,P,P,
+  D,D,D,D,D,D,D,D,D,D,P,P,P,P,P,P,
+  P,U,U,U,U,U,U,U,U,U,U,U,U,U,U,U,
+  U,U,U,U,U,U,U,U,U,U,U,P,P,P,P,P,
+  P,L,L,L,L,L,L,L,L,L,L,L,L,L,L,L,
+  L,L,L,L,L,L,L,L,L,L,L,P,P,P,P,0
+};
+#undef U
+#undef L
+#undef D
+#undef S
+#undef P
+#define CharClassOf(c)   (CharClass[(unsigned char)(c)])
+#define IsAlpha(c)       (CharClassOf(c) & (CC_UPPER|CC_LOWER))
+#define IsDigit(c)       (CharClassOf(c) & CC_DIGIT)
+#define IsAlnum(c)       (CharClassOf(c) & (CC_UPPER|CC_LOWER|CC_DIGIT))
+#define IsSpace(c)       (CharClassOf(c) & CC_SPACE)
+#define IsPunctOrSpace(c) (CharClassOf(c) & (CC_PUNCT|CC_SPACE))
+#define ToUpper(c)       ((CharClassOf(c) & CC_LOWER) ? (c)-'a'+'A' : (c))
+#define ToLower(c)       ((CharClassOf(c) & CC_UPPER) ? (c)-'A'+'a' : (c))
+
+/* LaTeX control words that stand for letters, with the ASCII text they
+   are folded to when tags are computed.  Accent commands (\" \' \c \v
+   etc.) are not listed: they are dropped and the letter they apply to
+   is kept.
+ */
+struct LaTeXLetter
+{
+  char *Command;                 /* control word without backslash */
+  char *Letters;                 /* ASCII replacement */
+} LaTeXLetters[] =
+  { {"ss","ss"}, {"SS","SS"}, {"ae","ae"}, {"AE","AE"},
+    {"oe","oe"}, {"OE","OE"}, {"aa","a"},  {"AA","A"},
+    {"o","o"},   {"O","O"},   {"l","l"},   {"L","L"},
+    {"i","i"},   {"j","j"},   {"dh","d"},  {"DH","D"},
+    {"dj","d"},  {"DJ","D"},  {"th","th"}, {"TH","TH"},
+    {"ng","ng"}, {"NG","NG"}, {NULL,NULL} };
 
 char *mymalloc(int n)
 {
@@ -99,15 +264,261 @@ char *mymalloc(int n)
   return(p);
 }
 
+/* *** ARENA *** */
+/* Entries and their attribute arrays live as long as the program does,
+   so they are carved out of large blocks instead of being allocated
+   one by one.
+ */
+#define ARENABLOCKSIZE (1<<20)   /* size of an arena block */
+PERWORKER char   *ArenaNext = NULL; /* next free byte in current block */
+PERWORKER size_t ArenaLeft = 0;  /* free bytes left in current block */
+
+char *ArenaAlloc(size_t n)
+{ char *p;
+  n = (n + 7) & ~(size_t)7;      /* keep everything 8-byte aligned */
+  if (n > ArenaLeft)
+    { if (n > ARENABLOCKSIZE/4)
+	return(mymalloc(n));     /* big request: give it its own block */
+      ArenaNext = mymalloc(ARENABLOCKSIZE);
+      ArenaLeft = ARENABLOCKSIZE;
+    }
+  p = ArenaNext;
+  ArenaNext += n;
+  ArenaLeft -= n;
+  return(p);
+}
+
+/* EntryAlloc(n): space for an entry or its attributes.  Under a memory
+ *                budget entries are freed once written out, with
+ *                --watch once their file is read again, and with --batch
+ *                once their file is done, so they cannot come from the
+ *                arena.
+ */
+char *EntryAlloc(size_t n)
+{ return((MemoryBudget || WatchMode || BatchMode) ?
+	 mymalloc(n) : ArenaAlloc(n));
+}
+
+/* AppendEntry(a,n,size,e): append e to the array *a of *n entries,
+ *                          which has room for *size; grow it if needed.
+ */
+void AppendEntry(struct Entry ***a, int *n, int *size, struct Entry *e)
+{ struct Entry **b;
+  if (*n >= *size)
+    { *size = *size ? 2 * *size : 1024;
+      b = (struct Entry **)realloc(*a,*size * sizeof(struct Entry *));
+      if (b == NULL)
+	{ 
+	  fprintf(MessageFile,"\nMemory allocation failure.\n");
+	  exit(0);
+	}
+      *a = b;
+    }
+  (*a)[(*n)++] = e;
+}
+
+/* *** STRING MAPS *** */
+/* Hash tables, with open addressing and linear probing, mapping strings
+   to pointers.  Keys are not copied; they must stay around as long as
+   the map does.  A map can be made to ignore case in its keys.
+ */
+struct StringMapSlot
+{
+  char     *Key;                 /* NULL if the slot is free */
+  uint64_t Hash;
+  void     *Value;
+};
+struct StringMap
+{
+  struct StringMapSlot *Slots;
+  size_t   Size;                 /* number of slots, a power of two */
+  size_t   Count;                /* number of slots in use */
+  int      IgnoreCase;           /* True if keys are compared ignoring case */
+};
+
+/* StringHash(s,n,ignorecase): 64-bit FNV-1a hash of the n characters
+ *                             starting at s.
+ */
+uint64_t StringHash(char *s, size_t n, int ignorecase)
+{ uint64_t h = 14695981039346656037ULL;
+  size_t i;
+  for (i=0;i<n;i++)
+    { h ^= (unsigned char)(ignorecase ? ToLower(s[i]) : s[i]);
+      h *= 1099511628211ULL;
+    }
+  return(h);
+}
+
+/* StringMapFind(m,key,n,h): slot holding the n-character key, or the
+ *                           free slot where it would go.
+ */
+struct StringMapSlot *StringMapFind(struct StringMap *m, char *key,
+				    size_t n, uint64_t h)
+{ struct StringMapSlot *slot;
+  size_t i = h & (m->Size-1);
+  while (TRUE)
+    { slot = &m->Slots[i];
+      if (slot->Key == NULL)
+	return(slot);
+      if (slot->Hash == h &&
+	  (m->IgnoreCase ? strncasecmp(slot->Key,key,n)
+			 : strncmp(slot->Key,key,n)) == 0 &&
+	  slot->Key[n] == 0)
+	return(slot);
+      i = (i+1) & (m->Size-1);
+    }
+}
+
+/* StringMapLookupN(m,key,n): value stored for the n-character key
+ *                            starting at key, or NULL.
+ */
+void *StringMapLookupN(struct StringMap *m, char *key, size_t n)
+{
+  if (m->Count == 0) return(NULL);
+  return(StringMapFind(m,key,n,StringHash(key,n,m->IgnoreCase))->Value);
+}
+
+void *StringMapLookup(struct StringMap *m, char *key)
+{
+  return(StringMapLookupN(m,key,strlen(key)));
+}
+
+/* StringMapInsert(m,key): address of the value stored for key, which
+ *                         is added to the map (with value NULL) if it
+ *                         is not there yet.
+ */
+void **StringMapInsert(struct StringMap *m, char *key)
+{ struct StringMapSlot *slot, *old;
+  size_t i, oldsize, n = strlen(key);
+  uint64_t h = StringHash(key,n,m->IgnoreCase);
+  if (2*(m->Count+1) > m->Size)
+    { /* keep the table at most half full */
+      old = m->Slots;
+      oldsize = m->Size;
+      m->Size = oldsize ? 2*oldsize : 64;
+      m->Slots = (struct StringMapSlot *)
+	mymalloc(m->Size*sizeof(struct StringMapSlot));
+      memset(m->Slots,0,m->Size*sizeof(struct StringMapSlot));
+      for (i=0;i<oldsize;i++)
+	if (old[i].Key != NULL)
+	  { slot = StringMapFind(m,old[i].Key,strlen(old[i].Key),old[i].Hash);
+	    *slot = old[i];
+	  }
+      free(old);
+    }
+  slot = StringMapFind(m,key,n,h);
+  if (slot->Key == NULL)
+    { slot->Key = key;
+      slot->Hash = h;
+      slot->Value = NULL;
+      m->Count++;
+    }
+  return(&slot->Value);
+}
+
+/* StringMapClear(m,freekeys): remove all keys from map m, freeing
+ *                            them if freekeys is True.
+ */
+void StringMapClear(struct StringMap *m, int freekeys)
+{ size_t i;
+  for (i=0;i<m->Size;i++)
+    { if (freekeys && m->Slots[i].Key != NULL)
+	free(m->Slots[i].Key);
+      m->Slots[i].Key = NULL;
+      m->Slots[i].Value = NULL;  /* (what a lookup of a missing key gets) */
+    }
+  m->Count = 0;
+}
+
+/* *** FINGERPRINTS *** */
+/* Each entry gets a 64-bit fingerprint of its contents: a hash of the
+   letters and digits of its values, in order, leaving out oldtag and
+   newtag, so that entries differing only in layout, delimiters or
+   tags have the same fingerprint.  It is computed by GetToken, on each
+   value token as it is read, while the text is still in the cache.
+   The check digits of -c come from it, unless --legacy-check-digits
+   is given.
+ */
+#define FINGERPRINTSEED 14695981039346656037ULL
+
+PERWORKER int  FingerprintTokens = FALSE; /* GetToken adds each token to
+				    TokenFingerprint? */
+PERWORKER uint64_t TokenFingerprint; /* of the entry being read */
+
+/* AddToFingerprint(h,s,n): hash h, with the letters and digits of the
+ *                          n characters at s added
+ */
+uint64_t AddToFingerprint(uint64_t h, char *s, size_t n)
+{ size_t i;
+  for (i=0;i<n;i++)
+    if (IsAlnum(s[i]))
+      { h ^= (unsigned char)s[i];
+	h *= 1099511628211ULL;
+      }
+  return(h);
+}
+
+/* EndFingerprintValue(h): hash h, with the end of a value added */
+uint64_t EndFingerprintValue(uint64_t h)
+{
+  return((h ^ 0x100) * 1099511628211ULL);
+}
+
+/* FinishFingerprint(h): the fingerprint from hash h, with its bits mixed */
+uint64_t FinishFingerprint(uint64_t h)
+{
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return(h);
+}
+
+/* IsFingerprinted(name): True if the value of attribute name counts */
+int IsFingerprinted(char *name)
+{
+  return(name != NULL && strcasecmp(name,"oldtag") != 0 &&
+	 strcasecmp(name,"newtag") != 0);
+}
+
+/* EntryFingerprint(e): fingerprint of entry e, from its attributes
+ *                      (for an entry changed since it was read)
+ */
+uint64_t EntryFingerprint(struct Entry *e)
+{ uint64_t h = FINGERPRINTSEED;
+  int i;
+  for (i=1;i<e->EntrySize;i++)
+    if (IsFingerprinted(e->Attributes[i].Name) &&
+	e->Attributes[i].Value != NULL)
+      h = EndFingerprintValue(AddToFingerprint(h,e->Attributes[i].Value,
+					       strlen(e->Attributes[i].Value)));
+  return(FinishFingerprint(h));
+}
+
+/* GetFingerprint(e): fingerprint of entry e, worked out now if it was
+ *                    put off when e was read (as with --lazy, where it
+ *                    is 0 until then).
+ */
+uint64_t GetFingerprint(struct Entry *e)
+{
+  if (e->Fingerprint == 0)
+    e->Fingerprint = EntryFingerprint(e);
+  return(e->Fingerprint);
+}
+
 /* GetC: Get a character from the input file 
  * Returns EOF and sets EOFSeen to TRUE if no more input.
  * Also keeps track of column input was read from in InputCol, so that
  * we can tell if an '@' came from column 1 or not.
+ * Only the thread reading a file uses its stream, so it is not locked
+ * (which costs a lot once there are other threads, as with --pipeline).
  */
 int GetC()                       
 {
    if (EOFSeen) return(0);
-   InputChar = getc(InputFile);
+   InputChar = getc_unlocked(InputFile);
+   InputPosition++;
    if (InputChar == EOF) EOFSeen = TRUE;
    if (InputChar == '\r' || InputChar == '\n') InputCol = 0;
    else InputCol++;
@@ -118,7 +529,7 @@ int GetC()
  */ 
 void SkipSpace()
 {
-   while (!EOFSeen && isspace(InputChar)) 
+   while (!EOFSeen && IsSpace(InputChar)) 
      GetC();
 }
 
@@ -177,12 +588,19 @@ char *GetToken(char c)
  top:
   SkipSpace();
   if (InputChar == EOF) return(NULL);
+  buffer[i] = 0;                 /* (for the messages below) */
+  if (i >= n-4)
+    { /* no room for more pieces of the token */
+      fprintf(MessageFile,"\nBibtag: GetToken error (too long)!");
+      fprintf(MessageFile,"\nBibtag: Skipping text: %s",buffer);
+      return(NULL);
+    }
   if (InputChar == '"')
     { /* collecting a string constant */
       /* string returned is enclosed in double quotes or delimiters */
       buffer[i++] = InputChar;
       GetC();
-      while (i<n-1 && !EOFSeen && InputChar != '"')
+      while (i<n-3 && !EOFSeen && InputChar != '"')
 	{ buffer[i++] = InputChar; 
 	  if (InputChar=='\\')
 	    { GetC();
@@ -192,6 +610,7 @@ char *GetToken(char c)
 	  else
 	      GetC();
         }
+      buffer[i] = 0;
       if (InputChar != '"')
 	{
 	  fprintf(MessageFile,"\nBibtag: GetToken error (too long)!");
@@ -211,13 +630,14 @@ char *GetToken(char c)
       int bracelevel = 1;
       buffer[i++] = InputChar;
       GetC();
-      while (i<n-1 && !EOFSeen && 
+      while (i<n-2 && !EOFSeen && 
 	     (InputChar != '}' || bracelevel > 1))
 	{ buffer[i++] = InputChar; 
           if (InputChar=='{') bracelevel++;
           if (InputChar=='}') bracelevel--;
           GetC();
         }
+      buffer[i] = 0;
       if (InputChar != '}')
 	{
 	  fprintf(MessageFile,"\nBibtag: GetToken error (too long)!");
@@ -230,11 +650,11 @@ char *GetToken(char c)
       buffer[i++] = '}';
       buffer[i] = 0;
     }
-  else if (InputChar == '@' || isalnum(InputChar))
+  else if (InputChar == '@' || IsAlnum(InputChar))
     { /* token is alphanumeric or begins with an at sign */
       while (i<n-1 && !EOFSeen && 
 	     (InputChar != ',' && InputChar != '}' && 
-	      InputChar != '{' && InputChar != '=' && !isspace(InputChar)))
+	      InputChar != '{' && InputChar != '=' && !IsSpace(InputChar)))
 	{ buffer[i++] = InputChar; 
           GetC();
         };
@@ -262,86 +682,333 @@ char *GetToken(char c)
   if (c!=0) SkipSpace();
   if (c!=0 && InputChar != c && InputChar != '}') goto top;
   if (c!=0) SkipChar(c);
+  if (FingerprintTokens)
+    TokenFingerprint = AddToFingerprint(TokenFingerprint,buffer,i);
   return(strdup(buffer));
 }
 
-/* PrintEntry: Output entry.
+/* *** LAZY PARSING *** */
+/* With --lazy, a plain input file is read into memory in one go (see
+   OpenLazyInputFile), and the values of the fields that making tags
+   does not look at are not copied out character by character: each is
+   found with a quick scan and left where it is in that text, which is
+   kept for as long as the database.  It is cut off with a 0 once the
+   scanner has got past its end.  Such values are formatted like any
+   other, as the output always re-flows values.  The fingerprints of
+   the entries are not worked out as they are read, but only if they
+   are needed (see GetFingerprint).
+ */
+int  LazyParsing = FALSE;        /* --lazy given? */
+PERWORKER char  *LazyText = NULL; /* text of the file being read, or NULL */
+PERWORKER off_t LazyLength;      /* number of characters in LazyText */
+char *DecodedFields[] =          /* fields always read by GetToken */
+  { "author", "editor", "title", "year", "crossref", "crossrefonly",
+    "newtag", "oldtag", NULL };
+
+/* IsDecodedField(name): TRUE if the value of field name is to be read
+ *                       by GetToken even with --lazy.
+ */
+int IsDecodedField(char *name)
+{ int i;
+  for (i=0;DecodedFields[i]!=NULL;i++)
+    if (strcasecmp(name,DecodedFields[i])==0)
+      return(TRUE);
+  return(FALSE);
+}
+
+/* GetRawValue(): like GetToken(','), but leaving the value in place in
+ *                LazyText.  Only does a value that is a single braced
+ *                or quoted string; for any other (a macro, a '#'
+ *                concatenation, one too long or not ended) it reads
+ *                nothing and returns NULL, so that GetToken deals with
+ *                it.
+ */
+char *GetRawValue()
+{ char *p, *q, *r, *nl, *end = LazyText + LazyLength;
+  int bracelevel = 1;
+  SkipSpace();
+  if (EOFSeen || InputPosition < 0 || InputPosition >= LazyLength)
+    return(NULL);
+  p = LazyText + InputPosition;  /* (the text of InputChar) */
+  q = p+1;
+  if (*p == '"')
+    while (q < end && (q += strcspn(q,"\"\\")) < end && *q != '"')
+      q += (*q == '\\') ? 2 : 1;
+  else if (*p == '{')
+    while (q < end && (q += strcspn(q,"{}")) < end &&
+	   (*q != '}' || bracelevel > 1))
+      { if (*q == '{') bracelevel++;
+	if (*q == '}') bracelevel--;
+	q++;
+      }
+  else
+    return(NULL);
+  if (q >= end || q-p >= BIGSTRINGSIZE-8)
+    return(NULL);
+  q++;                           /* (past the closing delimiter) */
+  for (r=q;r < end && IsSpace(*r);r++) ;
+  if (r == end || (*r != ',' && *r != '}'))
+    return(NULL);
+  if (fseeko(InputFile,q-LazyText,SEEK_SET) != 0)
+    return(NULL);
+  /* Go on from *q as if GetC had read up to it */
+  nl = memrchr(p,'\n',q-p);
+  if ((r = memrchr(p,'\r',q-p)) != NULL && (nl == NULL || r > nl))
+    nl = r;
+  InputCol = (nl != NULL) ? (q-1) - nl : InputCol + (q-1-p);
+  InputPosition = (q-1) - LazyText;
+  GetC();
+  SkipSpace();
+  SkipChar(',');
+  *q = 0;                        /* (read already, so not needed) */
+  return(p);
+}
+
+/* *** OUTPUT BUFFERS *** */
+/* Entries are formatted into memory buffers, so that several of them
+   can be formatted at once by different threads and the results
+   written out with a single system call.
+ */
+struct OutputBuffer
+{
+  char   *Text;                  /* formatted text (not 0-terminated) */
+  size_t Length;                 /* number of characters in Text */
+  size_t Size;                   /* allocated size of Text */
+};
+
+/* BufferReserve(b,n): make room for n more characters in buffer b */
+void BufferReserve(struct OutputBuffer *b, size_t n)
+{ char *t;
+  if (b->Length + n <= b->Size) return;
+  b->Size = 2*b->Size + n + 256;
+  t = (char *)realloc(b->Text,b->Size);
+  if (t == NULL)
+    { 
+      fprintf(MessageFile,"\nMemory allocation failure.\n");
+      exit(0);
+    }
+  b->Text = t;
+}
+
+void BufferPutc(struct OutputBuffer *b, int c)
+{
+  if (b->Length >= b->Size) BufferReserve(b,1);
+  b->Text[b->Length++] = c;
+}
+
+/* BufferPuts(b,s): append string s; a NULL string appears as "(null)",
+ *                  just as printf would print it.
+ */
+void BufferPuts(struct OutputBuffer *b, char *s)
+{ size_t n;
+  if (s == NULL) s = "(null)";
+  n = strlen(s);
+  BufferReserve(b,n);
+  memcpy(b->Text+b->Length,s,n);
+  b->Length += n;
+}
+
+/* WriteBuffers(b,n): write the contents of buffers b[0..n-1], in order,
+ *                    to the output file.  Uses writev when the output
+ *                    file has a descriptor, so that many buffers go out
+ *                    with one system call.
+ */
+void WriteBuffers(struct OutputBuffer **b, int n)
+{ struct iovec iov[IOV_MAX];
+  int    fd, i, k;
+  ssize_t w;
+  fflush(OutputFile);
+  fd = fileno(OutputFile);
+  i = 0;
+  while (i < n)
+    { 
+      if (fd < 0)
+	{ fwrite(b[i]->Text,1,b[i]->Length,OutputFile);
+	  i++;
+	  continue;
+	}
+      for (k=0;k<IOV_MAX && i+k<n;k++)
+	{ iov[k].iov_base = b[i+k]->Text;
+	  iov[k].iov_len = b[i+k]->Length;
+	}
+      i += k;
+      while (k > 0)
+	{ w = writev(fd,iov,k);
+	  if (w < 0)
+	    { if (errno == EINTR) continue;
+	      fprintf(MessageFile,"\nBibtag: Output write error: %s\n",
+		      OutputFileName);
+	      exit(0);
+	    }
+	  /* partial write: drop what went out and retry the rest */
+	  while (k > 0 && (size_t)w >= iov[0].iov_len)
+	    { w -= iov[0].iov_len;
+	      memmove(iov,iov+1,(k-1)*sizeof(struct iovec));
+	      k--;
+	    }
+	  if (k > 0)
+	    { iov[0].iov_base = (char *)iov[0].iov_base + w;
+	      iov[0].iov_len -= w;
+	    }
+	}
+    }
+}
+
+/* With --watch the output is written again after each change, mostly
+   with the same entries, tags and all; so each entry keeps its text,
+   to be used again while it is printed with the same tag and oldtag.
+   (Entries with a newtag attribute have it changed as tags are replaced,
+   and are not kept.)
+ */
+struct FormattedText
+{
+  char   *Tag;                   /* the tag it was printed with, */
+  char   *OldTag;                /* and the oldtag value, or NULL */
+  size_t Length;
+  char   Text[1];
+};
+
+/* SameString(s,t): True if strings s and t, either of which may be
+ *                  NULL, are the same.
+ */
+int SameString(char *s, char *t)
+{
+  return(s == NULL || t == NULL ? s == t : strcmp(s,t) == 0);
+}
+
+/* KeepFormatted(e,b,start): keep the text of e, formatted into b from
+ *                           start on, in e->Formatted.
+ */
+void KeepFormatted(struct Entry *e, struct OutputBuffer *b, size_t start)
+{ struct FormattedText *f;
+  int i;
+  for (i=1;i<e->EntrySize;i++)
+    if (strcasecmp(e->Attributes[i].Name,"newtag") == 0)
+      return;
+  if ((f = e->Formatted) != NULL)
+    { free(f->Tag);
+      free(f->OldTag);
+      free(f);
+    }
+  f = (struct FormattedText *)
+    mymalloc(sizeof(struct FormattedText)+b->Length-start);
+  f->Tag = strdup(e->EntryTag);
+  f->OldTag = e->Attributes[0].Value ? strdup(e->Attributes[0].Value) : NULL;
+  f->Length = b->Length-start;
+  memcpy(f->Text,b->Text+start,f->Length);
+  e->Formatted = f;
+}
+
+/* FormatEntry: Format entry e, appending the text to buffer b.
  *             Change tag if requested.
  *             Output "oldtag" attribute/value pair if newtag is different.
  *             Honor indentation requests.
  */
-void PrintEntry(struct Entry *e)
+void FormatEntry(struct Entry *e, struct OutputBuffer *b)
 { int i,j,k;
-  fprintf(OutputFile,"%s",e->InitialComments);
-  fprintf(OutputFile,"%s",e->EntryType);
+  size_t start = b->Length;
+  if (e->Formatted != NULL && e->EntryTag != NULL &&
+      strcmp(e->Formatted->Tag,e->EntryTag) == 0 &&
+      SameString(e->Formatted->OldTag,e->Attributes[0].Value))
+    { BufferReserve(b,e->Formatted->Length);
+      memcpy(b->Text+b->Length,e->Formatted->Text,e->Formatted->Length);
+      b->Length += e->Formatted->Length;
+      return;
+    }
+  BufferPuts(b,e->InitialComments);
+  BufferPuts(b,e->EntryType);
   if (strcasecmp(e->EntryType,"@string")==0)
       { /* entry type is string */
-	fprintf(OutputFile,"%s",e->StringDef);
+	BufferPuts(b,e->StringDef);
       }
   else
     { /* entry type is not string */
-      fprintf(OutputFile,"{%s,",e->EntryTag);
+      BufferPutc(b,'{');
+      BufferPuts(b,e->EntryTag);
+      BufferPutc(b,',');
       /* Now print out each attribute/value pair */
       for (i=0;i<e->EntrySize;i++)
-	if (e->EntryAttribute[i]!=NULL)
+	if (e->Attributes[i].Name!=NULL)
 	  { int c, lastc, col;
 	    /* Indent for attribute */
-	    fprintf(OutputFile,"\n");
+	    BufferPutc(b,'\n');
 	    for (j=0;j<AttributeIndent;j++) 
-	      fprintf(OutputFile," ");
+	      BufferPutc(b,' ');
 	    /* Print out attribute, after converting to lower case */
-	    for (j=0;e->EntryAttribute[i][j];j++)
-	      e->EntryAttribute[i][j] = tolower(e->EntryAttribute[i][j]);
-	    fprintf(OutputFile,"%s",e->EntryAttribute[i]);
-	    if (CompactEqualsSign) fprintf(OutputFile,"=");
-	    else                   fprintf(OutputFile," = ");
+	    for (j=0;e->Attributes[i].Name[j];j++)
+	      e->Attributes[i].Name[j] = ToLower(e->Attributes[i].Name[j]);
+	    BufferPuts(b,e->Attributes[i].Name);
+	    if (CompactEqualsSign) BufferPutc(b,'=');
+	    else                   BufferPuts(b," = ");
 	    /* Indent for Value */
-	    for (j=strlen(e->EntryAttribute[i])+AttributeIndent+3;
+	    for (j=strlen(e->Attributes[i].Name)+AttributeIndent+3;
 		 j<ValueIndent;
 		 j++)
-	      fprintf(OutputFile," ");
+	      BufferPutc(b,' ');
 	    /* Print out value */
 	    lastc = ' ';
 	    col = ValueIndent;
-	    for (j=0;e->EntryValue[i][j];j++)
-	      { c = e->EntryValue[i][j];
-		if (isspace(c)) c = ' ';
+	    for (j=0;e->Attributes[i].Value[j];j++)
+	      { c = e->Attributes[i].Value[j];
+		if (IsSpace(c)) c = ' ';
 		if (col>65 && c==' ')
 		  { /* good place for a line break and re-indenting */
-		    fprintf(OutputFile,"\n");
-		    for (k=0;k<ValueIndent;k++) fprintf(OutputFile," ");
+		    BufferPutc(b,'\n');
+		    for (k=0;k<ValueIndent;k++) BufferPutc(b,' ');
 		    col = ValueIndent;
 		    lastc = ' ';
 		  }
 		if (lastc!=' ' || c!=' ')
 		  { /* print out this character */
-		    fprintf(OutputFile,"%c",c);
+		    BufferPutc(b,c);
 		    col++;
 		  }
 		lastc = c;
 	      }
-	    if (i<e->EntrySize-1) fprintf(OutputFile,",");
+	    if (i<e->EntrySize-1) BufferPutc(b,',');
 	  }
-      fprintf(OutputFile,"\n}");
+      BufferPuts(b,"\n}");
+      if (WatchMode)
+	KeepFormatted(e,b,start);
     }
 }
 
+/* PrintEntry: Output entry. */
+void PrintEntry(struct Entry *e)
+{ static PERWORKER struct OutputBuffer b;
+  b.Length = 0;
+  FormatEntry(e,&b);
+  fwrite(b.Text,1,b.Length,OutputFile);
+}
+
+PERWORKER struct Entry *SpareEntry = NULL; /* entry dropped as it was read, to
+				     be used again for the next one */
+
 struct Entry *NewEntry()
-{ int i;
-  struct Entry *e = (struct Entry *)mymalloc(sizeof(struct Entry));
+{
+  struct Entry *e = SpareEntry;
+  if (e != NULL)
+    SpareEntry = NULL;
+  else
+    e = (struct Entry *)EntryAlloc(sizeof(struct Entry));
   e->InitialComments = NULL;
   e->EntryType = NULL;
   e->StringDef = NULL;
   e->EntryTag = NULL;
   e->NewEntryTag = NULL;
   e->EntrySize = 0;
-  for (i=0;i<MAXATTRIBUTES;i++)
-    {
-      e->EntryAttribute[i] = NULL;
-      e->EntryValue[i] = NULL;
-    }
+  e->Attributes = NULL;
   e->IsCrossRef = FALSE;
   e->CrossRef = NULL;
+  e->EntryExpansion = NULL;
+  e->SourceIndex = InputSourceIndex;
+  e->Modified = 0;
+  e->SourceStart = e->SourceEnd = e->TagStart = -1;
+  e->Selection = SELECTED;
+  e->BaseTag = NULL;
+  e->Formatted = NULL;
+  e->Fingerprint = 0;
+  e->Diagnosed = 0;
   return(e);
 }
 
@@ -349,27 +1016,237 @@ char *GetValue(struct Entry *e, char *attribute)
 { struct Entry *ex;
   int i;
   for (i=1;i<e->EntrySize;i++)
-    if (strcasecmp(attribute,e->EntryAttribute[i])==0)
-      return(e->EntryValue[i]);
+    if (strcasecmp(attribute,e->Attributes[i].Name)==0)
+      return(e->Attributes[i].Value);
+  /* Attribute not found; look for it in cross-ref */
+  if (e->CrossRef == NULL) return(NULL);
+  ex = e->CrossRef;
+  for (i=1;i<ex->EntrySize;i++)
+    if (strcasecmp(attribute,ex->Attributes[i].Name)==0)
+      return(ex->Attributes[i].Value);
+  return(NULL);
+}
+
+/* *** @STRING MACROS *** */
+/* Every @string definition is entered into a hash table, so that the
+   values used in computing tags can have macro references and '#'
+   concatenations resolved.  A macro's expansion is computed the first
+   time it is needed and kept, so each reference costs one lookup.
+ */
+struct Macro
+{
+  char *Name;                    /* macro name, e.g. "jacm" */
+  char *Definition;              /* its value, as written in @string */
+  char *Expansion;               /* its text once expanded, or NULL */
+  int  Expanding;                /* True while expansion is in progress */
+};
+PERWORKER struct StringMap MacroTable = { NULL, 0, 0, TRUE };
+
+void ExpandText(char *p, struct OutputBuffer *b);
+
+/* DefineMacro(e): enter the @string entry e into the macro table.
+ *                 Its StringDef has the form {name = value}.
+ */
+void DefineMacro(struct Entry *e)
+{ struct Macro *m, *old;
+  void **slot;
+  char *p, *q, *name;
+  int  n;
+  p = e->StringDef;
+  if (p == NULL || *p != '{') return;
+  p++;
+  while (IsSpace(*p)) p++;
+  for (q=p;*q && *q!='=' && !IsSpace(*q);q++) ;
+  if (q == p) return;
+  name = mymalloc(q-p+1);
+  strncpy(name,p,q-p);
+  name[q-p] = 0;
+  while (IsSpace(*q)) q++;
+  if (*q != '=')
+    { free(name);
+      return;
+    }
+  q++;
+  while (IsSpace(*q)) q++;
+  n = strlen(q);
+  if (n > 0 && q[n-1] == '}') n--;             /* closing brace of entry */
+  while (n > 0 && IsSpace(q[n-1])) n--;
+  m = (struct Macro *)mymalloc(sizeof(struct Macro));
+  m->Name = name;
+  m->Definition = mymalloc(n+1);
+  strncpy(m->Definition,q,n);
+  m->Definition[n] = 0;
+  m->Expansion = NULL;
+  m->Expanding = FALSE;
+  slot = StringMapInsert(&MacroTable,name);
+  if (*slot != NULL)
+    { /* later definitions win; the table keeps the first name */
+      old = (struct Macro *)*slot;
+      free(name);
+      m->Name = old->Name;
+      free(old->Definition);
+      free(old->Expansion);
+      free(old);
+    }
+  *slot = m;
+}
+
+/* ClearMacros: remove all the macros from the macro table */
+void ClearMacros()
+{ struct Macro *m;
+  size_t i;
+  for (i=0;i<MacroTable.Size;i++)
+    if (MacroTable.Slots[i].Key != NULL)
+      { m = (struct Macro *)MacroTable.Slots[i].Value;
+	free(m->Definition);
+	free(m->Expansion);
+	free(m);
+      }
+  StringMapClear(&MacroTable,TRUE);
+}
+
+/* MacroExpansion(m): expanded text of macro m */
+char *MacroExpansion(struct Macro *m)
+{ struct OutputBuffer b;
+  if (m->Expansion != NULL) return(m->Expansion);
+  if (m->Expanding)
+    { fprintf(MessageFile,"Bibtag: @string %s is defined in terms of itself!\n",
+	      m->Name);
+      return("");
+    }
+  m->Expanding = TRUE;
+  memset(&b,0,sizeof(b));
+  ExpandText(m->Definition,&b);
+  BufferPutc(&b,0);
+  m->Expansion = b.Text;
+  m->Expanding = FALSE;
+  return(m->Expansion);
+}
+
+/* ExpandText(p,b): append to b the text of the value p, a sequence of
+ *                  quoted strings, braced strings, numbers and macro
+ *                  names joined by '#'.  Delimiters are dropped; unknown
+ *                  macro names are kept as they are.
+ */
+void ExpandText(char *p, struct OutputBuffer *b)
+{ struct Macro *m;
+  char *q;
+  int  bracelevel;
+  while (*p)
+    { 
+      if (IsSpace(*p) || *p == '#')
+	p++;
+      else if (*p == '"' || *p == '{')
+	{ /* quoted or braced string; quotes inside braces don't count */
+	  char close = (*p == '"') ? '"' : '}';
+	  bracelevel = 0;
+	  for (q=++p;*q;q++)
+	    { if (*q == '{') bracelevel++;
+	      else if (*q == '}' && bracelevel > 0) bracelevel--;
+	      else if (*q == close && bracelevel == 0) break;
+	      else if (*q == '\\' && q[1]) q++;
+	    }
+	  BufferReserve(b,q-p);
+	  memcpy(b->Text+b->Length,p,q-p);
+	  b->Length += q-p;
+	  p = (*q) ? q+1 : q;
+	}
+      else
+	{ /* number or macro name */
+	  for (q=p;*q && *q!='#' && *q!='"' && *q!='{' && !IsSpace(*q);q++) ;
+	  m = IsDigit(*p) ? NULL : StringMapLookupN(&MacroTable,p,q-p);
+	  if (m != NULL)
+	    BufferPuts(b,MacroExpansion(m));
+	  else
+	    { BufferReserve(b,q-p);
+	      memcpy(b->Text+b->Length,p,q-p);
+	      b->Length += q-p;
+	    }
+	  p = q;
+	}
+    }
+}
+
+/* IsSimpleValue(v): True if value v is a single braced or quoted string,
+ *                   which needs no expansion.
+ */
+int IsSimpleValue(char *v)
+{ char *q;
+  int  bracelevel = 0;
+  if (*v != '{' && *v != '"') return(FALSE);
+  for (q=v+1;*q;q++)
+    { if (*q == '{') bracelevel++;
+      else if (*q == '}' && bracelevel > 0) bracelevel--;
+      else if (*q == (*v == '"' ? '"' : '}') && bracelevel == 0) break;
+      else if (*q == '\\' && q[1]) q++;
+    }
+  return(*q != 0 && q[1] == 0);
+}
+
+/* ExpandedValue(e,i): value of the i-th attribute of e with macros
+ *                     expanded, enclosed in braces.
+ */
+char *ExpandedValue(struct Entry *e, int i)
+{ struct OutputBuffer b;
+  char *v = e->Attributes[i].Value;
+  if (v == NULL || IsSimpleValue(v)) return(v);
+  if (e->EntryExpansion == NULL)
+    { e->EntryExpansion = (char **)mymalloc(e->EntrySize*sizeof(char *));
+      memset(e->EntryExpansion,0,e->EntrySize*sizeof(char *));
+    }
+  if (e->EntryExpansion[i] == NULL)
+    { memset(&b,0,sizeof(b));
+      BufferPutc(&b,'{');
+      ExpandText(v,&b);
+      BufferPutc(&b,'}');
+      BufferPutc(&b,0);
+      e->EntryExpansion[i] = b.Text;
+    }
+  return(e->EntryExpansion[i]);
+}
+
+/* GetExpandedValue(e,attribute): Like GetValue, but with @string macros
+ *                   and '#' concatenations resolved (see ExpandedValue).
+ */
+char *GetExpandedValue(struct Entry *e, char *attribute)
+{ struct Entry *ex;
+  int i;
+  for (i=1;i<e->EntrySize;i++)
+    if (strcasecmp(attribute,e->Attributes[i].Name)==0)
+      return(ExpandedValue(e,i));
   /* Attribute not found; look for it in cross-ref */
   if (e->CrossRef == NULL) return(NULL);
   ex = e->CrossRef;
   for (i=1;i<ex->EntrySize;i++)
-    if (strcasecmp(attribute,ex->EntryAttribute[i])==0)
-      return(ex->EntryValue[i]);
+    if (strcasecmp(attribute,ex->Attributes[i].Name)==0)
+      return(ExpandedValue(ex,i));
   return(NULL);
 }
 
+int  FilterEntry(struct Entry *e);
+void FreeEntryStrings(struct Entry *e);
+void FreeEntry(struct Entry *e);
+size_t EntryBytes(struct Entry *e);
+void SpillEntries(int early);
+extern size_t ResidentBytes, SpillThreshold;
+extern long EntriesRead;
+
 /* GetEntry: Read an entire bibtex reference from the input stream.
  *           Skip over white space and other text first, printing it out.
  *           results --> EntryType, EntryTag, EntryAttribute, EntryValue
  *                       (or StringDef if it defines a string).
  */
+PERWORKER struct Attribute EntryAttributes[MAXATTRIBUTES];
+				 /* attributes of the entry being read */
 struct Entry *GetEntry()
 {
   struct Entry *e = NewEntry();
+  e->Attributes = EntryAttributes;
  GoToAtSign:
   e->EntrySize = 1; /* accounts for oldtag, if necessary to output */
+  TokenFingerprint = FINGERPRINTSEED;
+  EntryAttributes[0].Name = NULL;
+  EntryAttributes[0].Value = NULL;
   e->InitialComments = SkipToAtSign();
   /* Append CRs if necessary to ensure that @ will end up in first column */
   if (e->InitialComments == NULL)
@@ -385,8 +1262,13 @@ struct Entry *GetEntry()
       strcpy(com,e->InitialComments);
       free(e->InitialComments);
       strcat(com,"\n");
+      e->InitialComments = com;
     }
-  if (EOFSeen) return(e);
+  if (EOFSeen)
+    { e->Attributes = NULL;
+      return(e);
+    }
+  e->SourceStart = InputPosition;
   e->EntryType = GetToken(0);
   if (strcasecmp(e->EntryType,"@string")==0)
     { /* entry type is String */
@@ -395,11 +1277,32 @@ struct Entry *GetEntry()
   else
     { /* entry type is not String */
       SkipChar('{'); 
+      SkipSpace();
+      e->TagStart = InputPosition;
       e->EntryTag = GetToken(',');
       while (InputChar != '}')
 	{ 
-	  e->EntryAttribute[e->EntrySize] = GetToken('=');
-	  e->EntryValue[e->EntrySize] = GetToken(',');
+	  e->Attributes[e->EntrySize].Name = GetToken('=');
+	  FingerprintTokens = LazyText == NULL &&
+	    IsFingerprinted(e->Attributes[e->EntrySize].Name);
+	  e->Attributes[e->EntrySize].Value = NULL;
+	  if (LazyText != NULL && e->Attributes[e->EntrySize].Name != NULL &&
+	      !IsDecodedField(e->Attributes[e->EntrySize].Name))
+	    e->Attributes[e->EntrySize].Value = GetRawValue();
+	  if (e->Attributes[e->EntrySize].Value == NULL)
+	    e->Attributes[e->EntrySize].Value = GetToken(',');
+	  if (FingerprintTokens)
+	    { TokenFingerprint = EndFingerprintValue(TokenFingerprint);
+	      FingerprintTokens = FALSE;
+	    }
+	  if (e->Attributes[e->EntrySize].Name == NULL ||
+	      e->Attributes[e->EntrySize].Value == NULL)
+	    { /* (GetToken has said what is wrong) */
+	      free(e->Attributes[e->EntrySize].Name);
+	      free(e->Attributes[e->EntrySize].Value);
+	      fprintf(MessageFile,"\nBibtag: Skipping to next at-sign!!!\n");
+	      goto GoToAtSign;
+	    }
 	  if (++(e->EntrySize) >= MAXATTRIBUTES-1) 
 	    { 
 	      fprintf(MessageFile,"Bibtag: %s has too many attributes!\n",
@@ -412,7 +1315,20 @@ struct Entry *GetEntry()
 	}
       SkipChar('}');
       /* SkipSpace(); */
+      e->Fingerprint = (LazyText == NULL) ?
+	FinishFingerprint(TokenFingerprint) : 0; /* (see GetFingerprint) */
     }
+  e->SourceEnd = InputPosition;
+  if (!FilterEntry(e))
+    { /* not selected: free its strings before anything else is kept */
+      FreeEntryStrings(e);
+      SpareEntry = e;
+      return(NULL);
+    }
+  /* Move attributes into an array of their own */
+  e->Attributes = (struct Attribute *)
+    EntryAlloc(e->EntrySize*sizeof(struct Attribute));
+  memcpy(e->Attributes,EntryAttributes,e->EntrySize*sizeof(struct Attribute));
   if (GetValue(e,"crossrefonly")!=NULL) 
     e->IsCrossRef = TRUE;
   return(e);
@@ -423,10 +1339,39 @@ struct Entry *GetEntry()
  *                   Similar to p = strtok(p," }\"\t\n\r~")
  *                     in that repeated calls get next token, etc.
  *                   Used to parse author name list into tokens.
+ *                   LaTeX commands in the string are folded to ASCII
+ *                     letters on the fly (see FoldLaTeXCommand).
  *                   Side effect of setting CommaJustSeen TRUE if token
  *                     returned was followed by a comma.
  */
-char *ScanTokenPtr = NULL;
+PERWORKER char *ScanTokenPtr = NULL;
+
+/* FoldLaTeXCommand(p,ans): p points just past a backslash in a value.
+ *                   Letter commands listed in LaTeXLetters are replaced
+ *                     by their ASCII letters, appended at *ans; all other
+ *                     commands (accents such as \" or \c, and font
+ *                     changes) are dropped, so that their argument is
+ *                     scanned as ordinary text.
+ *                   Returns pointer to the text after the command.
+ */
+char *FoldLaTeXCommand(char *p, char **ans)
+{ struct LaTeXLetter *l;
+  char *q;
+  int  n;
+  if (!IsAlpha(*p))              /* control symbol, e.g. \" or \' */
+    return(*p ? p+1 : p);
+  for (q=p;IsAlpha(*q);q++) ;    /* control word */
+  n = q-p;
+  for (l=LaTeXLetters;l->Command!=NULL;l++)
+    if (strncmp(l->Command,p,n)==0 && l->Command[n]==0)
+      { strcpy(*ans,l->Letters);
+	*ans += strlen(l->Letters);
+	break;
+      }
+  while (*q==' ') q++;           /* TeX skips spaces after a control word */
+  return(q);
+}
+
 char ScanToken(char *p, char *ans)
 { 
   char *q = ans;
@@ -435,7 +1380,7 @@ char ScanToken(char *p, char *ans)
   CommaJustSeen = FALSE;
   while (*p)
     { 
-      if (isalnum(*p)
+      if (IsAlnum(*p)
 	  || (UseHyphens && *p=='-') /* keep alphanums and optional hyphens */
 	  || (*p=='\''))             /* keep single quotes */
 	*ans++ = *p++;
@@ -447,11 +1392,9 @@ char ScanToken(char *p, char *ans)
 	{ bracelevel--;
 	  p++;
 	}
-      else if (*p=='\\')         /* backslash: skip this quoted char */
-        { p++;
-	  if (*p) p++;
-	}
-      else if ((ispunct(*p) || isspace(*p)) && bracelevel == 0)
+      else if (*p=='\\')         /* backslash: fold LaTeX command */
+	p = FoldLaTeXCommand(p+1,&ans);
+      else if (IsPunctOrSpace(*p) && bracelevel == 0)
 	                         /* stop scanning if punctuation or space
                                     outside of any braces */
 	break;
@@ -460,47 +1403,358 @@ char ScanToken(char *p, char *ans)
     }
   *ans = 0;                      /* terminate output string */
   while (*p!='{' && *p!='\\' && *p != '}' &&
-	 (ispunct(*p) || isspace(*p))) 
+	 IsPunctOrSpace(*p)) 
                                  /* skip following spaces or punctuation
                                     except for braces and quoted chars */
     { if (*p == ',') CommaJustSeen = TRUE;
       p++;
     }
   ScanTokenPtr = p;              /* save pointer so we can continue scan */
-  *q = toupper(*q);              /* force first char of output upper case */
+  *q = ToUpper(*q);              /* force first char of output upper case */
 }
 
-void AppendTitleToNewEntryTag(struct Entry *e)
-{ int  i,j,k;
-  int  TitleWordCount;
-  char TitleWord[100][STRINGSIZE];
-  char TitleToken[STRINGSIZE];
-  char Title[STRINGSIZE];
-  char *p;
-  char *title;
-  /* Find title */
-  title = GetValue(e,"title");
-  if (title == NULL)
-    { /* No title */
-      fprintf(MessageFile,"Bibtag: %s has no title!\n",e->EntryTag);
-      return;
+/* *** DIAGNOSTICS *** */
+/* The notes about entries that lack a field the tag needs are not
+   written as they are found, but collected: each kind of note is made
+   at most once per entry (however many options look at the field), is
+   counted, and the first few entries it was made for are kept.  After
+   the output is written, ReportDiagnostics prints a line per kind of
+   note, with its count and those entries.  With --diagnostics-report,
+   every note is also written to a file as it is made, as a line
+   "kind<TAB>tag<TAB>file".  Notes may come from several threads at
+   once (with --batch), so they are collected under DiagnosticsLock.
+ */
+#define NOTITLE    0             /* kinds of notes */
+#define NOYEAR     1
+#define NOAUTHORS  2
+#define DIAGNOSESEXAMPLES 10     /* entries listed per kind, by default */
+
+struct Diagnosis
+{
+  char *Name;                    /* as in the report file */
+  char *Lack;                    /* what the entries lack */
+  long Count;                    /* notes made since last reported */
+  char **Examples;               /* tags of the first entries noted */
+  int  NumberOfExamples;
+} Diagnoses[] =
+  { { "no-title", "title", 0, NULL, 0 },
+    { "no-year", "year", 0, NULL, 0 },
+    { "no-authors", "authors or editors", 0, NULL, 0 },
+    { NULL, NULL, 0, NULL, 0 } };
+
+int  DiagnosticExamples = DIAGNOSESEXAMPLES; /* --diagnostics=n */
+FILE *DiagnosticsReport = NULL;  /* --diagnostics-report file, or NULL */
+char *DiagnosticsReportName = NULL;
+pthread_mutex_t DiagnosticsLock = PTHREAD_MUTEX_INITIALIZER;
+
+char *EntrySourceName(struct Entry *e);
+char *OptionArgument(char *arg, char *name);
+FILE *OpenOutputFile(char *name);
+
+/* Diagnose(e,kind): note that entry e lacks the field of kind */
+void Diagnose(struct Entry *e, int kind)
+{ struct Diagnosis *d = &Diagnoses[kind];
+  char *tag = (e->EntryTag != NULL) ? e->EntryTag : "";
+  if (e->Diagnosed & (1 << kind))
+    return;
+  e->Diagnosed |= 1 << kind;
+  pthread_mutex_lock(&DiagnosticsLock);
+  d->Count++;
+  if (d->NumberOfExamples < DiagnosticExamples)
+    { if (d->Examples == NULL)
+	d->Examples = (char **)mymalloc(DiagnosticExamples*sizeof(char *));
+      d->Examples[d->NumberOfExamples++] = strdup(tag);
     }
-  strcpy(Title,title);
-  p = Title+1;
-  TitleWordCount = 0;
-  ScanToken(p,TitleToken);
-  while (TitleToken[0]!=0)
-    { 
-      strcpy(TitleWord[TitleWordCount],TitleToken);
-      TitleWordCount++;
-      /* determine if this was a common word */
-      for (i=0;
-	   i<NumberOfCommonWords 
-	   && strcasecmp(CommonWords[i],TitleToken)!=0;
-	   i++) ;
-      if (i!=NumberOfCommonWords)
-	TitleWordCount--;
-      ScanToken(NULL,TitleToken);
+  if (DiagnosticsReport != NULL)
+    fprintf(DiagnosticsReport,"%s\t%s\t%s\n",d->Name,tag,EntrySourceName(e));
+  pthread_mutex_unlock(&DiagnosticsLock);
+}
+
+/* ReportDiagnostics: print a summary of the notes made since the last
+ *                    summary, and start counting again.
+ */
+void ReportDiagnostics()
+{ struct Diagnosis *d;
+  int i;
+  for (d=Diagnoses;d->Name!=NULL;d++)
+    { if (d->Count > 0 && !Quiet)
+	{ fprintf(MessageFile,"Bibtag: %ld %s no %s",d->Count,
+		  (d->Count == 1) ? "entry has" : "entries have",d->Lack);
+	  for (i=0;i<d->NumberOfExamples;i++)
+	    fprintf(MessageFile,"%s%s",(i == 0) ? ": " : ", ",d->Examples[i]);
+	  if (d->Count > d->NumberOfExamples && d->NumberOfExamples > 0)
+	    fprintf(MessageFile,", ...");
+	  fprintf(MessageFile,"\n");
+	}
+      for (i=0;i<d->NumberOfExamples;i++)
+	free(d->Examples[i]);
+      d->NumberOfExamples = 0;
+      d->Count = 0;
+    }
+  if (DiagnosticsReport != NULL && fflush(DiagnosticsReport) != 0)
+    { fprintf(MessageFile,"\nBibtag: Diagnostics report write error: %s\n",
+	      DiagnosticsReportName);
+      exit(0);
+    }
+}
+
+/* SetDiagnostics(argc,argv): carry out the --diagnostics and
+ *                   --diagnostics-report options, before any entry
+ *                   is looked at.
+ */
+void SetDiagnostics(int argc, char *argv[])
+{ char *v;
+  int  i;
+  for (i=1;i<argc;i++)
+    if ((v = OptionArgument(argv[i],"--diagnostics")) != NULL && *v)
+      DiagnosticExamples = atoi(v);
+    else if ((v = OptionArgument(argv[i],"--diagnostics-report")) != NULL &&
+	     *v && DiagnosticsReport == NULL)
+      { DiagnosticsReportName = v;
+	DiagnosticsReport = OpenOutputFile(v);
+	if (DiagnosticsReport == NULL)
+	  { fprintf(MessageFile,
+		    "\nBibtag: Cannot write diagnostics report %s\n",v);
+	    exit(0);
+	  }
+	setvbuf(DiagnosticsReport,NULL,_IOFBF,1<<16);
+      }
+  if (DiagnosticExamples < 0)
+    DiagnosticExamples = 0;
+}
+
+/* *** STOPWORDS AND NAME PREFIXES *** */
+/* Title words that are skipped in tags (stopwords), and the name
+   prefixes that are kept with the word after them, are looked up in
+   sets built once, at startup, from the built-in lists above and any
+   --stopwords and --name-prefixes files, so a lookup costs the same
+   however many words are loaded.  Each set is a minimal perfect hash
+   (by hash and displace): a word's hash picks a bucket, the bucket's
+   seed mixed into the hash picks the word's slot, and the seeds are
+   chosen, largest buckets first, so that no two words share a slot.
+   The slot holds the word, to be compared with the one looked up.
+   Words are read from the files with ScanToken, as titles and names
+   are, so LaTeX accents in them are folded the same way.
+ */
+struct WordSet
+{
+  char     **Words;              /* words added, lower case */
+  int      Count;                /* number of words (after building,
+				    without repeats) */
+  int      Size;                 /* allocated size of Words */
+  int      Buckets;              /* number of buckets (0 if not built) */
+  uint32_t *Seeds;               /* seed of each bucket */
+  int      Slots;                /* number of slots */
+  char     **Table;              /* word in each slot, or NULL */
+  int      MaxLength;            /* length of the longest word */
+} StopWords, NamePrefixes;
+
+/* WordSlot(h,seed,n): slot, out of n, of the word with hash h */
+int WordSlot(uint64_t h, uint32_t seed, int n)
+{ h += seed * 0x9e3779b97f4a7c15ULL;
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+  return((h ^ (h >> 31)) % n);
+}
+
+/* AddWord(s,w): add the word w to set s, which is not yet built */
+void AddWord(struct WordSet *s, char *w)
+{ int i, n = strlen(w);
+  if (n == 0) return;
+  if (s->Count >= s->Size)
+    { s->Size = s->Size ? 2*s->Size : 64;
+      s->Words = (char **)realloc(s->Words,s->Size*sizeof(char *));
+      if (s->Words == NULL)
+	{ fprintf(MessageFile,"\nBibtag: Out of memory!\n");
+	  exit(0);
+	}
+    }
+  s->Words[s->Count] = strdup(w);
+  for (i=0;i<n;i++)
+    s->Words[s->Count][i] = ToLower(w[i]);
+  s->Count++;
+  if (n > s->MaxLength) s->MaxLength = n;
+}
+
+/* ReadWordList(s,name): add the words in file name to set s.  Text
+ *                       from % to the end of a line is a comment.
+ */
+void ReadWordList(struct WordSet *s, char *name)
+{ char line[STRINGSIZE], token[STRINGSIZE];
+  char *p;
+  FILE *f = fopen(name,"r");
+  if (f == NULL)
+    { fprintf(MessageFile,"\nBibtag: Cannot read word list %s\n",name);
+      exit(0);
+    }
+  while (fgets(line,sizeof(line),f) != NULL)
+    { if ((p = strchr(line,'%')) != NULL)
+	*p = 0;
+      for (p=line;*p && IsPunctOrSpace(*p) && *p!='{' && *p!='\\';p++) ;
+      if (*p == 0) continue;
+      ScanToken(p,token);
+      while (token[0] != 0)
+	{ AddWord(s,token);
+	  ScanToken(NULL,token);
+	}
+    }
+  fclose(f);
+}
+
+int StringPointerCompare(const void *a, const void *b)
+{
+  return(strcmp(*(char **)a,*(char **)b));
+}
+
+#define MAXWORDSEED (1<<20)      /* seeds tried for a bucket before the
+				    table is made larger */
+
+/* BuildWordSet(s): build the perfect hash of the words added to s */
+void BuildWordSet(struct WordSet *s)
+{ uint64_t *hash;
+  int      *first, *next, *count, *order, *slot;
+  char     *taken;
+  int      i, j, k, b, n, buckets, slots, most, nonempty;
+  uint32_t seed;
+  if (s->Count == 0) return;
+  /* drop repeated words */
+  qsort(s->Words,s->Count,sizeof(char *),StringPointerCompare);
+  for (i=1,n=1;i<s->Count;i++)
+    if (strcmp(s->Words[i],s->Words[n-1]) != 0)
+      s->Words[n++] = s->Words[i];
+    else
+      free(s->Words[i]);
+  s->Count = n;
+  /* put the words in buckets */
+  buckets = n/4 + 1;
+  hash = (uint64_t *)mymalloc(n*sizeof(uint64_t));
+  next = (int *)mymalloc(n*sizeof(int));
+  slot = (int *)mymalloc(n*sizeof(int));
+  first = (int *)mymalloc(buckets*sizeof(int));
+  count = (int *)mymalloc(buckets*sizeof(int));
+  order = (int *)mymalloc(buckets*sizeof(int));
+  for (b=0;b<buckets;b++)
+    { first[b] = -1;
+      count[b] = 0;
+    }
+  most = 0;
+  for (i=0;i<n;i++)
+    { hash[i] = StringHash(s->Words[i],strlen(s->Words[i]),TRUE);
+      b = hash[i] % buckets;
+      next[i] = first[b];
+      first[b] = i;
+      if (++count[b] > most) most = count[b];
+    }
+  nonempty = 0;                  /* largest buckets first */
+  for (k=most;k>0;k--)
+    for (b=0;b<buckets;b++)
+      if (count[b] == k)
+	order[nonempty++] = b;
+  /* find a seed for each bucket that puts its words in free slots */
+  s->Seeds = (uint32_t *)mymalloc(buckets*sizeof(uint32_t));
+  memset(s->Seeds,0,buckets*sizeof(uint32_t));
+  slots = n;
+  taken = NULL;
+  do
+    { taken = (char *)realloc(taken,slots);
+      if (taken == NULL)
+	{ fprintf(MessageFile,"\nBibtag: Out of memory!\n");
+	  exit(0);
+	}
+      memset(taken,0,slots);
+      for (j=0;j<nonempty;j++)
+	{ b = order[j];
+	  for (seed=1;seed<MAXWORDSEED;seed++)
+	    { for (i=first[b];i>=0;i=next[i])
+		{ slot[i] = WordSlot(hash[i],seed,slots);
+		  if (taken[slot[i]]) break;
+		  taken[slot[i]] = TRUE;
+		}
+	      if (i < 0) break;
+	      for (k=first[b];k!=i;k=next[k])
+		taken[slot[k]] = FALSE;
+	    }
+	  if (seed == MAXWORDSEED) break;
+	  s->Seeds[b] = seed;
+	}
+      if (j < nonempty)
+	slots += slots/8 + 1;    /* (no longer minimal, still perfect) */
+    }
+  while (j < nonempty);
+  s->Table = (char **)mymalloc(slots*sizeof(char *));
+  memset(s->Table,0,slots*sizeof(char *));
+  for (i=0;i<n;i++)
+    s->Table[slot[i]] = s->Words[i];
+  s->Buckets = buckets;
+  s->Slots = slots;
+  free(hash);
+  free(next);
+  free(slot);
+  free(first);
+  free(count);
+  free(order);
+  free(taken);
+}
+
+/* WordSetContains(s,w,n): True if the n characters at w, in any case,
+ *                         are a word of set s.
+ */
+int WordSetContains(struct WordSet *s, char *w, int n)
+{ uint64_t h;
+  char *t;
+  if (s->Buckets == 0 || n > s->MaxLength) return(FALSE);
+  h = StringHash(w,n,TRUE);
+  t = s->Table[WordSlot(h,s->Seeds[h % s->Buckets],s->Slots)];
+  return(t != NULL && strncasecmp(t,w,n) == 0 && t[n] == 0);
+}
+
+/* SetWordLists(argc,argv): build the stopword and name prefix sets,
+ *                   from the built-in lists and the files given by
+ *                   --stopwords and --name-prefixes options.
+ */
+void SetWordLists(int argc, char *argv[])
+{ char *v;
+  int  i;
+  for (i=0;i<NumberOfCommonWords;i++)
+    AddWord(&StopWords,CommonWords[i]);
+  for (i=0;i<NamePrefixCount;i++)
+    AddWord(&NamePrefixes,NamePrefix[i]);
+  for (i=1;i<argc;i++)
+    if ((v = OptionArgument(argv[i],"--stopwords")) != NULL && *v)
+      ReadWordList(&StopWords,v);
+    else if ((v = OptionArgument(argv[i],"--name-prefixes")) != NULL && *v)
+      ReadWordList(&NamePrefixes,v);
+  BuildWordSet(&StopWords);
+  BuildWordSet(&NamePrefixes);
+}
+
+void AppendTitleToNewEntryTag(struct Entry *e)
+{ int  i,j,k;
+  int  TitleWordCount;
+  char TitleWord[MAXTITLEWORDS][STRINGSIZE];
+  char TitleToken[STRINGSIZE];
+  char Title[STRINGSIZE];
+  char *p;
+  char *title;
+  /* Find title */
+  title = GetExpandedValue(e,"title");
+  if (title == NULL)
+    { /* No title */
+      Diagnose(e,NOTITLE);
+      return;
+    }
+  snprintf(Title,sizeof(Title),"%s",title); /* (enough for the tag) */
+  p = Title+1;
+  TitleWordCount = 0;
+  ScanToken(p,TitleToken);
+  while (TitleToken[0]!=0 && TitleWordCount < MAXTITLEWORDS)
+    { 
+      strcpy(TitleWord[TitleWordCount],TitleToken);
+      TitleWordCount++;
+      /* determine if this was a common word */
+      if (WordSetContains(&StopWords,TitleToken,strlen(TitleToken)))
+	TitleWordCount--;
+      ScanToken(NULL,TitleToken);
     }
   if (e->NewEntryTag != NULL)
     {
@@ -513,7 +1767,7 @@ void AppendTitleToNewEntryTag(struct Entry *e)
   /* Process first title word */
   for (j=0,k=0;TitleWord[0][j]!=0&&0<TitleWordCountBound;j++)
     if (k<FirstTitleWordLengthBound
-	&& (isalpha(TitleWord[0][j])||
+	&& (IsAlpha(TitleWord[0][j])||
 	    (UseHyphens && TitleWord[0][j]=='-')))
       { k++;
 	*p++ = TitleWord[0][j];
@@ -522,7 +1776,7 @@ void AppendTitleToNewEntryTag(struct Entry *e)
   for (i=1;i<TitleWordCount&&i<TitleWordCountBound;i++)
     for (j=0,k=0;TitleWord[i][j]!=0;j++)
       if (k<SecondTitleWordLengthBound
-	  && (isalpha(TitleWord[i][j])||
+	  && (IsAlpha(TitleWord[i][j])||
 	      (UseHyphens && TitleWord[i][j]=='-')))
 	{ k++;
 	  *p++ = TitleWord[i][j];
@@ -542,49 +1796,44 @@ AppendYearToNewEntryTag(struct Entry *e)
     NewEntryTag[0] = 0;
   p = NewEntryTag + strlen(NewEntryTag);
   /* Get digits of year */
-  yr = GetValue(e,"year");
+  yr = GetExpandedValue(e,"year");
   if (yr != NULL)
       {
 	for (j=0,k=0;yr[j]!=0;j++)
-	  if (isdigit(yr[j])||yr[j]=='?')
+	  if (IsDigit(yr[j])||yr[j]=='?')
 	    { k++;
 	      if (k>4-YearDigitsWanted) *p++ = yr[j];
 	    }
       }
   else
     { /* Year digits will be ?'s */
-      fprintf(MessageFile,"Bibtag: %s has no year!\n",e->EntryTag);
+      Diagnose(e,NOYEAR);
       for (i=0;i<YearDigitsWanted;i++) *p++ = '?';
     }
   *p = 0;
   e->NewEntryTag = strdup(NewEntryTag);
 }
 
-void AppendAuthorInfoToNewEntryTag(struct Entry *e)
-{ int i,j,k;
-  char *p;
+/* GetAuthorNames(e,AuthorName): Put the last names of the authors of
+ *                   e (or, failing that, its editors) in AuthorName, and
+ *                   return how many there are; 0 if there are none.
+ */
+int GetAuthorNames(struct Entry *e, char AuthorName[MAXAUTHORS][STRINGSIZE])
+{ char *p;
   char Authors[STRINGSIZE];
   char AuthorToken[STRINGSIZE];
   int  AuthorCount;                        /* Number of Authors for entry */
-  char AuthorName[MAXAUTHORS][STRINGSIZE]; /* Last names of authors */
   int LastTokenWasNamePrefix;
   char *author;
   /* Get the author (or, failing that, the editor) field */
-  author = GetValue(e,"author");
+  author = GetExpandedValue(e,"author");
   if (author == NULL)
     { /* No authors; search for editors instead */
-      author = GetValue(e,"editor");
+      author = GetExpandedValue(e,"editor");
       if (author == NULL)
-	{ /* Suppress error message if this is a cross ref target */
-	  if (e->IsCrossRef == FALSE)
-	    { 
-	      fprintf(MessageFile,"Bibtag: %s has no authors or editors!\n",
-		      e->EntryTag);
-	    }
-	  return;
-	}
+	return(0);
     }
-  strcpy(Authors,author);
+  snprintf(Authors,sizeof(Authors),"%s",author); /* (enough for the tag) */
   p = Authors+1;
   AuthorCount = 1;
   AuthorName[0][0] = 0;
@@ -595,6 +1844,8 @@ void AppendAuthorInfoToNewEntryTag(struct Entry *e)
     { 
       if (strcasecmp("and",AuthorToken)==0) 
 	{ /* "and" seen; get ready to scan new name */
+	  if (AuthorCount == MAXAUTHORS)
+	    break;               /* (the rest are never used) */
 	  AuthorCount++;
 	  AuthorName[AuthorCount-1][0] = 0;
 	  LastTokenWasNamePrefix = FALSE;
@@ -611,16 +1862,26 @@ void AppendAuthorInfoToNewEntryTag(struct Entry *e)
 	    }
 	  if (CommaJustSeen) CommaSeen = TRUE;
 	  /* determine if this was a prefix */
-	  for (i=0;
-	       i<NamePrefixCount && strcasecmp(NamePrefix[i],AuthorToken)!=0;
-	       i++) ;
-	  if (i==NamePrefixCount)
-	    LastTokenWasNamePrefix = FALSE;
-	  else
-	    LastTokenWasNamePrefix = TRUE;
+	  LastTokenWasNamePrefix =
+	    WordSetContains(&NamePrefixes,AuthorToken,strlen(AuthorToken));
 	}
       ScanToken(NULL,AuthorToken);
     }
+  return(AuthorCount);
+}
+
+void AppendAuthorInfoToNewEntryTag(struct Entry *e)
+{ int i,j,k;
+  char *p;
+  int  AuthorCount;                        /* Number of Authors for entry */
+  char AuthorName[MAXAUTHORS][STRINGSIZE]; /* Last names of authors */
+  AuthorCount = GetAuthorNames(e,AuthorName);
+  if (AuthorCount == 0)
+    { /* Suppress error message if this is a cross ref target */
+      if (e->IsCrossRef == FALSE)
+	Diagnose(e,NOAUTHORS);
+      return;
+    }
   if (e->NewEntryTag!=NULL)
     { strcpy(NewEntryTag,e->NewEntryTag);
       free(e->NewEntryTag);
@@ -631,7 +1892,7 @@ void AppendAuthorInfoToNewEntryTag(struct Entry *e)
   /* Process first author's name */
   for (j=0,k=0;AuthorName[0][j]!=0;j++)
     if (k<FirstAuthorNameLengthBound
-	&& (isalpha(AuthorName[0][j])||
+	&& (IsAlpha(AuthorName[0][j])||
 	    (UseHyphens && AuthorName[0][j]=='-')))
       { k++;
 	*p++ = AuthorName[0][j];
@@ -641,7 +1902,7 @@ void AppendAuthorInfoToNewEntryTag(struct Entry *e)
     if (i<AuthorBound)
       { for (j=0,k=0;AuthorName[i][j]!=0;j++)
 	  if (k<SecondAuthorNameLengthBound
-	      && (isalpha(AuthorName[i][j])||
+	      && (IsAlpha(AuthorName[i][j])||
 		  (UseHyphens && AuthorName[i][j]=='-')))
 	    { k++;
 	      *p++ = AuthorName[i][j];
@@ -651,22 +1912,31 @@ void AppendAuthorInfoToNewEntryTag(struct Entry *e)
   e->NewEntryTag = strdup(NewEntryTag);
 }
 
-AppendCheckDigitsToNewEntryTag(struct Entry *e)
+/* LegacyCheckSum(e): the checksum the check digits were once made from */
+uint64_t LegacyCheckSum(struct Entry *e)
 {
   int i,j,check;
   int c;
-  char *p;
   check = 0;
   for (i=1;i<e->EntrySize;i++)
-    if (strcasecmp(e->EntryAttribute[i],"oldtag")!=0 &&
-	strcasecmp(e->EntryAttribute[i],"newtag")!=0)
+    if (strcasecmp(e->Attributes[i].Name,"oldtag")!=0 &&
+	strcasecmp(e->Attributes[i].Name,"newtag")!=0)
       { 
-	for (j=0;e->EntryValue[i][j]!=0;j++)
-	  { c = e->EntryValue[i][j];
-	    if (isalpha(c)||isdigit(c))
+	for (j=0;e->Attributes[i].Value[j]!=0;j++)
+	  { c = e->Attributes[i].Value[j];
+	    if (IsAlnum(c))
 	      check = (check * 23 + c) % 12345;
 	  }
       }
+  return(check);
+}
+
+AppendCheckDigitsToNewEntryTag(struct Entry *e)
+{
+  int i;
+  uint64_t check;
+  char *p;
+  check = LegacyCheckDigits ? LegacyCheckSum(e) : GetFingerprint(e);
   if (e->NewEntryTag!=NULL)
     { strcpy(NewEntryTag,e->NewEntryTag);
       free(e->NewEntryTag);
@@ -702,31 +1972,295 @@ AppendOldExtensionsToNewEntryTag(struct Entry *e)
   e->NewEntryTag = strdup(NewEntryTag);
 }
 
-int HashTableIndex(char *s)
-{ /* compute hash table index for the given string.
-     Don't worry about collisions */
-  int i = 0;
-  char *p = s;
-  while (*p) 
-    { i = (i*1231 + *p) % HASHTABLESIZE;
-      p++;
+/* *** TAG REGISTRY *** */
+/* A registry is a file shared by bibtag runs on different databases,
+   holding every tag -u has handed out, so that no two databases get the
+   same tag.  It is a hash table with open addressing and linear probing,
+   mapped into memory, and locked with flock while -u runs.  Each tag is
+   stored with a hash of the database file it belongs to, so retagging
+   the same file again may reuse its own tags.
+   The file is only ever appended to: tags are never moved, and when the
+   table gets half full a table twice the size is added at the end and
+   the slots are spread into it by their stored hashes, without looking
+   at the tags again.  The space of the old table is not reused.
+ */
+#define REGISTRYMAGIC     "BIBTAGRG"
+#define REGISTRYSLOTS     1024   /* slots in a new registry */
+#define REGISTRYEXTENT    (1<<16) /* least amount the file grows by */
+
+struct RegistryHeader
+{
+  char     Magic[8];             /* REGISTRYMAGIC */
+  uint64_t Slots;                /* offset of the slot table */
+  uint64_t Size;                 /* number of slots, a power of two */
+  uint64_t Count;                /* number of slots in use */
+  uint64_t End;                  /* offset of the first unused byte */
+};
+
+struct RegistrySlot
+{
+  uint64_t Hash;                 /* StringHash of the tag */
+  uint64_t Tag;                  /* offset of the tag, 0 if slot is free */
+  uint64_t Owner;                /* hash of its database's file name */
+};
+
+char *RegistryFileName = NULL;   /* --registry file, or NULL */
+PERWORKER int    RegistryFd = -1;
+PERWORKER char   *RegistryBase = NULL; /* mapping of the registry file */
+PERWORKER size_t RegistryMapped = 0;   /* size of that mapping */
+PERWORKER int    RegistryLocked = FALSE;
+PERWORKER char   *RegistryOwnerName = NULL; /* file whose hash is */
+PERWORKER uint64_t RegistryOwnerHash = 0;   /* RegistryOwnerHash */
+
+/* RegistryError(what): report a failed registry operation and stop */
+void RegistryError(char *what)
+{
+  fprintf(MessageFile,"\nBibtag: Cannot %s tag registry %s: %s\n",
+	  what,RegistryFileName,strerror(errno));
+  exit(0);
+}
+
+/* MapRegistry(size): map the first size bytes of the registry file */
+void MapRegistry(size_t size)
+{
+  if (RegistryBase != NULL)
+    munmap(RegistryBase,RegistryMapped);
+  RegistryBase = mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED,
+		      RegistryFd,0);
+  if (RegistryBase == MAP_FAILED)
+    { RegistryBase = NULL;
+      RegistryError("map");
+    }
+  RegistryMapped = size;
+}
+
+/* LockRegistry: take the registry for this run, opening or creating it
+ *               if need be, and mapping whatever other runs have added.
+ */
+void LockRegistry()
+{ struct RegistryHeader *h;
+  struct stat st;
+  if (RegistryFileName == NULL || RegistryLocked) return;
+  if (RegistryFd < 0 &&
+      (RegistryFd = open(RegistryFileName,O_RDWR|O_CREAT,0666)) < 0)
+    RegistryError("open");
+  if (flock(RegistryFd,LOCK_EX) != 0 || fstat(RegistryFd,&st) != 0)
+    RegistryError("lock");
+  RegistryLocked = TRUE;
+  if (st.st_size == 0)
+    { /* a new registry */
+      st.st_size = sizeof(struct RegistryHeader) +
+		   REGISTRYSLOTS*sizeof(struct RegistrySlot) + REGISTRYEXTENT;
+      if (ftruncate(RegistryFd,st.st_size) != 0)
+	RegistryError("grow");
+      MapRegistry(st.st_size);
+      h = (struct RegistryHeader *)RegistryBase;
+      memcpy(h->Magic,REGISTRYMAGIC,8);
+      h->Slots = sizeof(struct RegistryHeader);
+      h->Size = REGISTRYSLOTS;
+      h->Count = 0;
+      h->End = h->Slots + REGISTRYSLOTS*sizeof(struct RegistrySlot);
+    }
+  else if ((size_t)st.st_size != RegistryMapped)
+    MapRegistry(st.st_size);
+  h = (struct RegistryHeader *)RegistryBase;
+  if (RegistryMapped < sizeof(struct RegistryHeader) ||
+      memcmp(h->Magic,REGISTRYMAGIC,8) != 0 ||
+      h->End > RegistryMapped ||
+      h->Slots + h->Size*sizeof(struct RegistrySlot) > h->End)
+    { fprintf(MessageFile,"\nBibtag: %s is not a tag registry!\n",
+	      RegistryFileName);
+      exit(0);
+    }
+}
+
+/* UnlockRegistry: let other runs have the registry again */
+void UnlockRegistry()
+{
+  if (!RegistryLocked) return;
+  if (flock(RegistryFd,LOCK_UN) != 0)
+    RegistryError("unlock");
+  RegistryLocked = FALSE;
+}
+
+/* RegistryAppend(n): offset of n new bytes at the end of the registry,
+ *                    growing the file if need be.  (The mapping may move.)
+ */
+uint64_t RegistryAppend(size_t n)
+{ struct RegistryHeader *h = (struct RegistryHeader *)RegistryBase;
+  uint64_t at = h->End;
+  size_t size;
+  if (at + n > RegistryMapped)
+    { size = RegistryMapped + (RegistryMapped > n ? RegistryMapped : n);
+      if (ftruncate(RegistryFd,size) != 0)
+	RegistryError("grow");
+      MapRegistry(size);
+      h = (struct RegistryHeader *)RegistryBase;
+    }
+  h->End = at + n;
+  return(at);
+}
+
+/* RegistryFind(tag,n,hash): the slot holding the n-character tag, or the
+ *                           free slot where it would go.
+ */
+struct RegistrySlot *RegistryFind(char *tag, size_t n, uint64_t hash)
+{ struct RegistryHeader *h = (struct RegistryHeader *)RegistryBase;
+  struct RegistrySlot *slots, *slot;
+  uint64_t i;
+  slots = (struct RegistrySlot *)(RegistryBase + h->Slots);
+  i = hash & (h->Size-1);
+  while (TRUE)
+    { slot = &slots[i];
+      if (slot->Tag == 0 ||
+	  (slot->Hash == hash &&
+	   strncmp(RegistryBase + slot->Tag,tag,n) == 0 &&
+	   RegistryBase[slot->Tag + n] == 0))
+	return(slot);
+      i = (i+1) & (h->Size-1);
     }
-  return(i);
+}
+
+/* GrowRegistry: add a slot table twice the size of the current one */
+void GrowRegistry()
+{ struct RegistryHeader *h = (struct RegistryHeader *)RegistryBase;
+  struct RegistrySlot *old, *slots;
+  uint64_t i, j, oldsize = h->Size;
+  uint64_t at = RegistryAppend(2*oldsize*sizeof(struct RegistrySlot));
+  h = (struct RegistryHeader *)RegistryBase;
+  old = (struct RegistrySlot *)(RegistryBase + h->Slots);
+  slots = (struct RegistrySlot *)(RegistryBase + at);
+  for (i=0;i<oldsize;i++)
+    if (old[i].Tag != 0)
+      { j = old[i].Hash & (2*oldsize-1);
+	while (slots[j].Tag != 0)
+	  j = (j+1) & (2*oldsize-1);
+	slots[j] = old[i];
+      }
+  h->Slots = at;
+  h->Size = 2*oldsize;
+}
+
+/* RegistryOwner(e): hash of the full name of the file entry e was read
+ *                   from, or 0 if it is not known.
+ */
+uint64_t RegistryOwner(struct Entry *e)
+{ char *name, *path;
+  if (e->SourceIndex < 0 || e->SourceIndex >= NumberOfSourceFiles)
+    return(0);
+  name = SourceFiles[e->SourceIndex].Name;
+  if (RegistryOwnerName == NULL || strcmp(RegistryOwnerName,name) != 0)
+    { free(RegistryOwnerName);
+      RegistryOwnerName = strdup(name);
+      path = realpath(name,NULL);
+      if (path == NULL) path = strdup(name);
+      RegistryOwnerHash = StringHash(path,strlen(path),FALSE) | 1;
+      free(path);
+    }
+  return(RegistryOwnerHash);
+}
+
+/* RegistryHolds(tag,e): True if the registry gives tag to an entry of
+ *                       some other database than e's.
+ */
+int RegistryHolds(char *tag, struct Entry *e)
+{ struct RegistrySlot *slot;
+  size_t n;
+  if (!RegistryLocked) return(FALSE);
+  n = strlen(tag);
+  slot = RegistryFind(tag,n,StringHash(tag,n,FALSE));
+  return(slot->Tag != 0 &&
+	 (slot->Owner == 0 || slot->Owner != RegistryOwner(e)));
+}
+
+/* RegisterTag(tag,e): record that tag is given to entry e */
+void RegisterTag(char *tag, struct Entry *e)
+{ struct RegistryHeader *h;
+  struct RegistrySlot *slot;
+  uint64_t hash, at;
+  size_t n;
+  if (!RegistryLocked) return;
+  n = strlen(tag);
+  hash = StringHash(tag,n,FALSE);
+  if (RegistryFind(tag,n,hash)->Tag != 0) return;
+  h = (struct RegistryHeader *)RegistryBase;
+  if (2*(h->Count+1) > h->Size)
+    GrowRegistry();
+  at = RegistryAppend(n+1);
+  memcpy(RegistryBase + at,tag,n+1);
+  slot = RegistryFind(tag,n,hash);
+  slot->Hash = hash;
+  slot->Owner = RegistryOwner(e);
+  slot->Tag = at;
+  ((struct RegistryHeader *)RegistryBase)->Count++;
+}
+
+/* Tags handed out so far by -u.  This used to be a fixed table of
+   19661 flags indexed by a hash of the tag, which made distinct tags
+   with the same hash look alike, and could never hold more tags than
+   it had flags; the map keeps the tags themselves.
+ */
+PERWORKER struct StringMap HashTable = { NULL, 0, 0, FALSE };
+
+/* For each tag that -u had to extend, the number of the last extension
+   it got ("a" is 1, "z" 26, "aa" 27, ...), so that the next entry with
+   that tag starts looking after it, instead of trying all of them again.
+ */
+PERWORKER struct StringMap UniqueCounters = { NULL, 0, 0, FALSE };
+
+/* ClearUniqueTags: forget the tags handed out by -u */
+void ClearUniqueTags()
+{
+  StringMapClear(&HashTable,TRUE);
+  StringMapClear(&UniqueCounters,TRUE);
+}
+
+/* With --memory-budget, the options are replayed on each chunk of
+   entries written out early (see EXTERNAL SORTING), and each -u on the
+   command line must go on from the tags it handed out to the chunks
+   before, not from those of another -u; so each keeps its own tables.
+ */
+#define MAXUNIQUEOPTIONS 16      /* most -u options with own tables */
+struct UniqueTables
+{
+  int    Option;                 /* index of the -u in argv */
+  struct StringMap Tags;         /* its HashTable ... */
+  struct StringMap Counters;     /* ... and UniqueCounters */
+} SpilledUniqueTables[MAXUNIQUEOPTIONS];
+int NumberOfSpilledUniqueTables = 0;
+
+/* UniqueTablesOf(option): tables of the -u at argv[option], or NULL if
+ *                         there are too many -u options to keep them.
+ */
+struct UniqueTables *UniqueTablesOf(int option)
+{ struct UniqueTables *t;
+  int i;
+  for (i=0;i<NumberOfSpilledUniqueTables;i++)
+    if (SpilledUniqueTables[i].Option == option)
+      return(&SpilledUniqueTables[i]);
+  if (NumberOfSpilledUniqueTables == MAXUNIQUEOPTIONS)
+    return(NULL);
+  t = &SpilledUniqueTables[NumberOfSpilledUniqueTables++];
+  memset(t,0,sizeof(*t));
+  t->Option = option;
+  return(t);
 }
 
 int GetHashEntry(char *s)
 {
-  return((int)HashTable[HashTableIndex(s)]);
+  return(StringMapLookup(&HashTable,s) != NULL);
 }
 
 void SetHashEntry(char *s)
 {
-  HashTable[HashTableIndex(s)] = 1;
+  if (!GetHashEntry(s))
+    *StringMapInsert(&HashTable,strdup(s)) = (void *)1;
 }
 
 void AppendExtensionToMakeNewEntryTagUnique(struct Entry *e)
-{ char ctr[10];
-  int i;
+{ void **counter;
+  intptr_t n, k;
+  char *p;
   int taglen;
   if (e->NewEntryTag != NULL)
     { strcpy(NewEntryTag,e->NewEntryTag);
@@ -734,25 +2268,127 @@ void AppendExtensionToMakeNewEntryTagUnique(struct Entry *e)
     }
   else
     NewEntryTag[0] = 0;
-  if (GetHashEntry(NewEntryTag)==0) 
+  if (GetHashEntry(NewEntryTag)==0 && !RegistryHolds(NewEntryTag,e))
     { 
       SetHashEntry(NewEntryTag);
+      RegisterTag(NewEntryTag,e);
       e->NewEntryTag = strdup(NewEntryTag);
       return;
     }
   taglen = strlen(NewEntryTag);
-  for (i=0;i<10;i++) 
-    ctr[i] = 0;
-  while (GetHashEntry(NewEntryTag))
-    { NewEntryTag[taglen] = 0;
-      i = 0;
-      while (ctr[i]=='z') ctr[i++] = 'a';
-      if (ctr[i]==0) ctr[i] = 'a';
-      else           ctr[i]++;
-      strcat(NewEntryTag,ctr);
+  n = (intptr_t)StringMapLookup(&UniqueCounters,NewEntryTag);
+  counter = StringMapInsert(&UniqueCounters,
+			    n ? NewEntryTag : strdup(NewEntryTag));
+  do
+    { /* the extension for n+1: its letters, least significant first */
+      p = NewEntryTag + taglen;
+      for (k=++n;k>0;k/=26)
+	*p++ = 'a' + --k%26;
+      *p = 0;
     }
+  while (GetHashEntry(NewEntryTag) || RegistryHolds(NewEntryTag,e));
+  *counter = (void *)n;
   e->NewEntryTag = strdup(NewEntryTag);
   SetHashEntry(NewEntryTag);
+  RegisterTag(NewEntryTag,e);
+}
+
+/* Entries whose tags can get in each other's way under -u have tags
+   that are the same once their trailing lower case letters are taken
+   off, since an extension is made of such letters: the extended tags
+   of "smith95" are "smith95a", "smith95b", ..., which other entries
+   may have as tags of their own.  So with many entries, -u splits
+   them into parts by a hash of that root, and a thread for each part
+   does its entries in the order read, with tables of its own.  No tag
+   of one part can be wanted by another, so every entry gets the
+   extension it would have got had they all been done one by one.
+ */
+#define UNIQUEPARALLELMIN 20000  /* fewest entries -u does with threads */
+#define MAXUNIQUEPARTS 64        /* most threads -u uses */
+
+struct UniquePart
+{
+  int    Part;                   /* number of this part */
+  int    Parts;                  /* number of parts */
+  struct Entry **Entries;        /* all the entries */
+  int    Count;                  /* number of them */
+  int    First, Last;            /* those whose parts this thread finds */
+  unsigned char *PartOf;         /* part of each entry */
+  pthread_t Thread;
+  int    Running;                /* True while Thread has to be joined */
+};
+
+/* TagRootHash(tag): hash of tag without its trailing lower case letters */
+uint64_t TagRootHash(char *tag)
+{ size_t n;
+  if (tag == NULL) return(StringHash("",0,FALSE));
+  for (n=strlen(tag);n>0 && tag[n-1]>='a' && tag[n-1]<='z';n--) ;
+  return(StringHash(tag,n,FALSE));
+}
+
+/* FindUniqueParts(u): put entries First..Last-1 into their parts */
+void *FindUniqueParts(void *arg)
+{ struct UniquePart *u = (struct UniquePart *)arg;
+  int k;
+  for (k=u->First;k<u->Last;k++)
+    u->PartOf[k] =
+      (TagRootHash(u->Entries[k]->NewEntryTag) >> 32) % u->Parts;
+  return(NULL);
+}
+
+/* MakeUniquePart(u): make the tags of the entries of part u unique */
+void *MakeUniquePart(void *arg)
+{ struct UniquePart *u = (struct UniquePart *)arg;
+  int k;
+  for (k=0;k<u->Count;k++)
+    if (u->PartOf[k] == u->Part)
+      AppendExtensionToMakeNewEntryTagUnique(u->Entries[k]);
+  ClearUniqueTags();             /* (the tables of this thread) */
+  return(NULL);
+}
+
+/* MakeNewEntryTagsUniqueInParallel: do what -u does to every entry
+ *                   with threads, as above; FALSE, having done nothing,
+ *                   if there are too few entries, or the tags have to
+ *                   be kept in the tables (with --memory-budget) or
+ *                   in a registry, or bibtag has threads already
+ *                   (with --batch).
+ */
+int MakeNewEntryTagsUniqueInParallel()
+{ struct UniquePart parts[MAXUNIQUEPARTS];
+  unsigned char *partof;
+  int n, t, round;
+  void *(*work[2])(void *) = { FindUniqueParts, MakeUniquePart };
+  n = (OutputThreads > 1) ? OutputThreads : sysconf(_SC_NPROCESSORS_ONLN);
+  if (n > MAXUNIQUEPARTS) n = MAXUNIQUEPARTS;
+  if (n < 2 || NumberOfEntries < UNIQUEPARALLELMIN || MemoryBudget ||
+      RegistryFileName != NULL || BatchMode)
+    return(FALSE);
+  partof = (unsigned char *)mymalloc(NumberOfEntries);
+  for (t=0;t<n;t++)
+    { parts[t].Part = t;
+      parts[t].Parts = n;
+      parts[t].Entries = EntryArray;
+      parts[t].Count = NumberOfEntries;
+      parts[t].First = (long)NumberOfEntries*t/n;
+      parts[t].Last = (long)NumberOfEntries*(t+1)/n;
+      parts[t].PartOf = partof;
+    }
+  for (round=0;round<2;round++)
+    { /* (all the parts must be known before any is done) */
+      for (t=0;t<n;t++)
+	if (pthread_create(&parts[t].Thread,NULL,work[round],&parts[t])==0)
+	  parts[t].Running = TRUE;
+	else
+	  { parts[t].Running = FALSE;
+	    work[round](&parts[t]);  /* no thread; do it right here */
+	  }
+      for (t=0;t<n;t++)
+	if (parts[t].Running)
+	  pthread_join(parts[t].Thread,NULL);
+    }
+  free(partof);
+  return(TRUE);
 }
 
 /* MakeDefaultNewEntryTag: Make default new entry tag for this entry.
@@ -781,28 +2417,230 @@ void PrintUsage()
   fprintf(MessageFile," -q        surrounds values with quotes\n");
   fprintf(MessageFile," -=        omits spaces around equals signs on output\n");
   fprintf(MessageFile," -oxx      (or -o xx) sets output file to xx\n");
+  fprintf(MessageFile,"           (compressed if xx ends in .gz or .zst)\n");
   fprintf(MessageFile," --        forbids hyphens in tags\n");
   fprintf(MessageFile," -af,s,n   includes author's names, with at most f letters from the first,\n");
   fprintf(MessageFile,"           s from the second (and later), and at most n authors total\n");
   fprintf(MessageFile," -tf,s,n   includes title words, with at most f letters from the first,\n");
   fprintf(MessageFile,"           s from the second (and later), and at most n words total\n");
+  fprintf(MessageFile," --stopwords=f, --name-prefixes=f  add the words in file f to the title\n");
+  fprintf(MessageFile,"           words skipped, or to the name prefixes kept\n");
   fprintf(MessageFile," -yn       includes the last n digits of the year(default n = 2)\n");
   fprintf(MessageFile," -lxxx     includes literal string xxx in the tag\n");
   fprintf(MessageFile," -p        includes the previous tag in the new tag\n");
   fprintf(MessageFile," -cn       adds n check digits to the new tag (default n=1)\n");
+  fprintf(MessageFile," --legacy-check-digits  makes later -c options give the check digits\n");
+  fprintf(MessageFile,"           of older versions of bibtag\n");
   fprintf(MessageFile," -e        keeps existing extension if newly computed tag is prefix of old tag.\n");
   fprintf(MessageFile," -u        Adds characters to make new tags unique.\n");
+  fprintf(MessageFile," --registry=f  makes -u keep new tags unique across all the databases\n");
+  fprintf(MessageFile,"           retagged with the shared tag registry file f\n");
   fprintf(MessageFile," -s        saves old tags in `oldtag' attribute\n");
   fprintf(MessageFile," -n        no sorting is done\n");
+  fprintf(MessageFile," --sort-by=k1,k2,...  sorts by keys tag, year, author, type or title\n");
+  fprintf(MessageFile," -jn       formats the output with n threads (default: one per processor)\n");
+  fprintf(MessageFile," --pipeline  reads and writes files with threads of their own\n");
+  fprintf(MessageFile," --lazy    leaves the values of fields that tags are not made from\n");
+  fprintf(MessageFile,"           in the text of the input files, which are read whole\n");
+  fprintf(MessageFile," --shard-by=k  writes one output file per first letter of the tag, year or\n");
+  fprintf(MessageFile,"           type (k = tag, year or type), each by a thread of its own\n");
+  fprintf(MessageFile," --shard-index  also writes a tag index for each of those files\n");
+  fprintf(MessageFile," --tag-map=f  writes an \"old<TAB>new\" line to file f for each changed tag\n");
+  fprintf(MessageFile," --quiet   leaves out the warnings and the \"old ==> new\" messages\n");
+  fprintf(MessageFile," --diagnostics=n  lists n entries (default 10) for each kind of warning\n");
+  fprintf(MessageFile," --diagnostics-report=f  writes every warning to file f, one per line\n");
+  fprintf(MessageFile," --save-snapshot=f  saves the database read so far in snapshot file f\n");
+  fprintf(MessageFile," --load-snapshot=f  reads the database from snapshot file f, unless its\n");
+  fprintf(MessageFile,"           source files have changed since it was saved\n");
+  fprintf(MessageFile," --patch   rewrites the changed entries in the input files instead of\n");
+  fprintf(MessageFile,"           printing the database\n");
+  fprintf(MessageFile," --rewrite-cites=d  replaces changed tags in the citations of the .tex\n");
+  fprintf(MessageFile,"           and .aux files under directory d\n");
+  fprintf(MessageFile," --select-year=y1-y2, --select-type=t1,t2,..., --select-author=n1,n2,...,\n");
+  fprintf(MessageFile," --select-tag-prefix=p, --select-has=attr\n");
+  fprintf(MessageFile,"           keep only entries matching all of these, from the input\n");
+  fprintf(MessageFile,"           files that follow them\n");
+  fprintf(MessageFile," --duplicates=p  finds entries with the same tag, and warns (p = warn),\n");
+  fprintf(MessageFile,"           keeps the first or last (keep-first, keep-last), merges\n");
+  fprintf(MessageFile,"           their fields into the first (merge), or stops (error)\n");
+  fprintf(MessageFile," --memory-budget=n  keeps about n bytes (suffix k, M, G) of entries in\n");
+  fprintf(MessageFile,"           memory, sorting the rest in temporary files; it must\n");
+  fprintf(MessageFile,"           have no options between the input files\n");
+  fprintf(MessageFile," --watch   stays running and writes the output file (-o) again whenever\n");
+  fprintf(MessageFile,"           one of the input files changes\n");
+  fprintf(MessageFile," --batch-out=d, --batch=list  retag each input file (or each one in\n");
+  fprintf(MessageFile,"           list) on its own, into directory d (or the file named\n");
+  fprintf(MessageFile,"           after it in list), with -j worker threads\n");
   fprintf(MessageFile,"A `newtag' attribute in an entry forces the tag to be the given value.");
   fprintf(MessageFile,"\n");
 }
 
+/* *** DUPLICATE TAGS *** */
+/* With --duplicates, each regular entry read is looked up by its tag
+   (ignoring case, as BibTeX does) in a hash table of those read so far,
+   so that finding all duplicates takes one pass over the entries.  What
+   is done with an entry whose tag was seen before depends on the policy:
+   DUPLICATESWARN keeps both; DUPLICATESKEEPFIRST drops the new entry;
+   DUPLICATESKEEPLAST puts it in place of the old one; DUPLICATESMERGE
+   adds to the old entry the fields it lacks from the new one, and drops
+   the new one; DUPLICATESERROR stops.
+ */
+#define DUPLICATESWARN      1
+#define DUPLICATESKEEPFIRST 2
+#define DUPLICATESKEEPLAST  3
+#define DUPLICATESMERGE     4
+#define DUPLICATESERROR     5
+
+PERWORKER struct StringMap EntryTags = {NULL,0,0,TRUE};
+				 /* tag of each entry read => 1 + its
+				    index in EntryArray */
+
+/* SetDuplicatePolicy(argc,argv): take note of any --duplicates option
+ *                   (before any file is read), and check that the
+ *                   command line can be followed with it.
+ */
+void SetDuplicatePolicy(int argc, char *argv[])
+{ static char *names[] = { "warn", "keep-first", "keep-last", "merge",
+			   "error", NULL };
+  char *v = NULL;
+  int  i;
+  for (i=1;i<argc;i++)
+    if (OptionArgument(argv[i],"--duplicates") != NULL)
+      v = OptionArgument(argv[i],"--duplicates");
+  if (v == NULL)
+    return;
+  for (i=0;names[i]!=NULL && strcasecmp(v,names[i])!=0;i++) ;
+  if (names[i] == NULL)
+    { fprintf(MessageFile,"\nBibtag: Bad --duplicates policy: %s\n",v);
+      exit(0);
+    }
+  DuplicatePolicy = i+1;
+  if (DuplicatePolicy == DUPLICATESWARN || DuplicatePolicy == DUPLICATESERROR)
+    return;
+  for (i=1;i<argc;i++)
+    if (OptionArgument(argv[i],"--patch") != NULL)
+      { fprintf(MessageFile,
+		"\nBibtag: --duplicates=%s cannot be used with --patch\n",v);
+	exit(0);
+      }
+}
+
+/* EntrySourceName(e): name of the file entry e was read from */
+char *EntrySourceName(struct Entry *e)
+{
+  if (e->SourceIndex < 0 || e->SourceIndex >= NumberOfSourceFiles)
+    return("standard input");
+  return(SourceFiles[e->SourceIndex].Name);
+}
+
+/* DropEntry(e): free an entry that is not kept after all */
+void DropEntry(struct Entry *e)
+{
+  if (BatchMode)
+    FreeEntry(e);
+  else
+    FreeEntryStrings(e);
+}
+
+/* MergeEntry(old,e): add to entry old the fields of entry e it lacks */
+void MergeEntry(struct Entry *old, struct Entry *e)
+{ struct Attribute *a;
+  int i, j, n;
+  for (n=0,j=1;j<e->EntrySize;j++)
+    { for (i=1;i<old->EntrySize &&
+	   strcasecmp(old->Attributes[i].Name,e->Attributes[j].Name)!=0;i++)
+	;
+      if (i == old->EntrySize)
+	n++;
+    }
+  if (n == 0)
+    return;
+  a = (struct Attribute *)EntryAlloc((old->EntrySize+n)*sizeof(struct Attribute));
+  memcpy(a,old->Attributes,old->EntrySize*sizeof(struct Attribute));
+  for (n=old->EntrySize,j=1;j<e->EntrySize;j++)
+    { for (i=1;i<old->EntrySize &&
+	   strcasecmp(old->Attributes[i].Name,e->Attributes[j].Name)!=0;i++)
+	;
+      if (i == old->EntrySize)
+	{ a[n++] = e->Attributes[j];
+	  e->Attributes[j].Name = NULL;    /* (now old's) */
+	  e->Attributes[j].Value = NULL;
+	}
+    }
+  if (BatchMode)
+    free(old->Attributes);       /* (from EntryAlloc) */
+  if (old->EntryExpansion != NULL)
+    { /* (computed for the old fields only) */
+      for (i=0;i<old->EntrySize;i++)
+	free(old->EntryExpansion[i]);
+      free(old->EntryExpansion);
+      old->EntryExpansion = NULL;
+    }
+  old->Attributes = a;
+  old->EntrySize = n;
+  old->Modified |= MODIFIEDFIELDS;
+  old->Fingerprint = EntryFingerprint(old);
+}
+
+/* CheckDuplicate(e): look up the tag of entry e, just read, among those
+ *                    read before; returns True if e is to be added to
+ *                    EntryArray, False if it has been dealt with.
+ */
+int CheckDuplicate(struct Entry *e)
+{ struct Entry *old;
+  char *tag = (e->EntryTag != NULL) ? e->EntryTag : "";
+  intptr_t k = (intptr_t)StringMapLookup(&EntryTags,tag);
+  if (k == 0)
+    { /* (the key is copied, since e may be dropped later) */
+      *StringMapInsert(&EntryTags,strdup(tag)) =
+	(void *)(intptr_t)(NumberOfEntries+1);
+      return(TRUE);
+    }
+  old = EntryArray[k-1];
+  switch (DuplicatePolicy)
+    { 
+    case DUPLICATESERROR:
+      fprintf(MessageFile,"\nBibtag: Duplicate tag %s in %s (first in %s)\n",
+	      tag,EntrySourceName(e),EntrySourceName(old));
+      exit(0);
+    case DUPLICATESWARN:
+      if (!Quiet)
+	fprintf(MessageFile,"Bibtag: Duplicate tag %s in %s (%s in %s)!\n",
+		tag,EntrySourceName(e),
+		(GetFingerprint(e) == GetFingerprint(old)) ?
+		"same values as" : "first",
+		EntrySourceName(old));
+      return(TRUE);
+    case DUPLICATESKEEPFIRST:
+      if (!Quiet)
+	fprintf(MessageFile,"Bibtag: Duplicate tag %s in %s dropped\n",
+		tag,EntrySourceName(e));
+      DropEntry(e);
+      return(FALSE);
+    case DUPLICATESKEEPLAST:
+      if (!Quiet)
+	fprintf(MessageFile,"Bibtag: Duplicate tag %s in %s dropped\n",
+		tag,EntrySourceName(old));
+      EntryArray[k-1] = e;
+      DropEntry(old);
+      return(FALSE);
+    case DUPLICATESMERGE:
+      if (!Quiet)
+	fprintf(MessageFile,"Bibtag: Duplicate tag %s in %s merged\n",
+		tag,EntrySourceName(e));
+      MergeEntry(old,e);
+      DropEntry(e);
+      return(FALSE);
+    }
+  return(TRUE);
+}
+
 void ReadDataBase()
 {
   struct Entry *e;
   EOFSeen = FALSE;
   InputCol = 0;
+  InputPosition = -1;
   GetC(); /* Prime the scanning routines by reading first character */
   SkipSpace();
   /* Input loop -- read the entire file */
@@ -810,7 +2648,11 @@ void ReadDataBase()
   while (!EOFSeen)
     { 
       e = GetEntry();
-      if (EOFSeen) break;
+      if (EOFSeen)
+	{ SpareEntry = e;        /* (read no further than the end) */
+	  break;
+	}
+      if (e == NULL) continue;   /* not selected */
       if (strcasecmp("@preamble",e->EntryType)==0) 
 	{ 
 	  if (Preamble != NULL)
@@ -821,407 +2663,3994 @@ void ReadDataBase()
 	  Preamble = e;
 	}
       else if (strcasecmp("@string",e->EntryType)==0) 
-	{ if (NumberOfStrings==MAXSTRINGS)
-	    { 
-	      fprintf(MessageFile,"\nBibtag: Too many string definitions!\n");
-	      exit(0);
-	    }
-	else
-	  StringArray[NumberOfStrings++] = e;
+	{ AppendEntry(&StringArray,&NumberOfStrings,&StringArraySize,e);
+	  DefineMacro(e);
 	}
+      else if (DuplicatePolicy && !CheckDuplicate(e))
+	;                        /* (a duplicate, dealt with) */
       else 
-	{ if (NumberOfEntries == MAXENTRIES)
-	    { 
-	      fprintf(MessageFile,"\nBibtag: Too many entries in file!\n");
-	      exit(0);
+	{ AppendEntry(&EntryArray,&NumberOfEntries,&EntryArraySize,e);
+	  if (MemoryBudget)
+	    { e->Sequence = EntriesRead++;
+	      ResidentBytes += EntryBytes(e);
+	      if (ResidentBytes > SpillThreshold)
+		SpillEntries(TRUE);
 	    }
-	  else
-	    EntryArray[NumberOfEntries++] = e;
 	}
     }
   fclose(InputFile);
 }
 
-void ResolveCrossReferences()
-{ int i,j,k;
+/* LinkCrossReferences(complain): point each entry with a crossref at
+ *                   its target, which must come after it; complain
+ *                   about those whose target is not there.
+ *                   The targets are found in a map from each tag to
+ *                   the first entry with it; next[k] is the entry after
+ *                   entry k with the same tag (both as index+1, or 0).
+ */
+void LinkCrossReferences(int complain)
+{ int i,j;
+  intptr_t k, *next;
   struct Entry *e, *ex;
+  struct StringMap tags = { NULL, 0, 0, TRUE };
+  void **v;
+  char *ref;
+  size_t n;
+  next = (intptr_t *)mymalloc((NumberOfEntries+1)*sizeof(intptr_t));
+  for (i=NumberOfEntries-1;i>=0;i--)
+    if (EntryArray[i]->EntryTag != NULL)
+      { v = StringMapInsert(&tags,EntryArray[i]->EntryTag);
+	next[i] = (intptr_t)*v;
+	*v = (void *)(intptr_t)(i+1);
+      }
   for (i=0;i<NumberOfEntries;i++)
     { e = EntryArray[i];
       for (j=1;j<e->EntrySize;j++)
-	if (strcasecmp("crossref",e->EntryAttribute[j])==0)
-	  {
-	    for (k=i+1;k<NumberOfEntries;k++)
-	      { ex = EntryArray[k];
-		if (strcasecmp(e->EntryValue[j],ex->EntryTag)==0 ||
-		    strncasecmp(e->EntryValue[j]+1,
-				ex->EntryTag,
-				strlen(e->EntryValue[j])-2) == 0)
-		  {
-		    ex->IsCrossRef = TRUE;
-		    e->CrossRef = ex;
-		    break;
-		  }
+	if (strcasecmp("crossref",e->Attributes[j].Name)==0)
+	  { ref = e->Attributes[j].Value;
+	    n = strlen(ref);
+	    if (n >= 2 && (ref[0] == '{' || ref[0] == '"'))
+	      k = (intptr_t)StringMapLookupN(&tags,ref+1,n-2);
+	    else
+	      k = (intptr_t)StringMapLookupN(&tags,ref,n);
+	    while (k != 0 && k-1 <= i)
+	      k = next[k-1];
+	    if (k != 0)
+	      { ex = EntryArray[k-1];
+		ex->IsCrossRef = TRUE;
+		e->CrossRef = ex;
 	      }
-	    if (e->CrossRef==NULL)
+	    if (e->CrossRef==NULL && complain)
 	      fprintf(MessageFile,
 		      "\nBibtag: Crossref %s for entry %s not found!",
-		      e->EntryValue[j],
+		      e->Attributes[j].Value,
 		      e->EntryTag);
 	  }
     }
+  free(tags.Slots);
+  free(next);
 }
 
-int EntryCompare(struct Entry *e1, struct Entry *e2)
-{ 
-  if (e1->IsCrossRef == 0 && e2->IsCrossRef == 1) return(-1);
-  if (e1->IsCrossRef == 1 && e2->IsCrossRef == 0) return(1);
-  return(strcmp(e1->EntryTag,e2->EntryTag));
+void ResolveCrossReferences()
+{
+  LinkCrossReferences(TRUE);
 }
 
-int Partition(int p, int r)
-{ struct Entry *x;
-  int i = p-1;
-  int j = r+1;
-  int k = p + (random() % (r-p+1));
-  x = EntryArray[k];
-  EntryArray[k] = EntryArray[p];
-  EntryArray[p] = x;
-  while (TRUE)
-    { struct Entry *e;
-      do j--; while (EntryCompare(EntryArray[j],x)>0);
-      do i++; while (EntryCompare(EntryArray[i],x)<0);
-      if (i<j)
-	{ e = EntryArray[i];
-	  EntryArray[i] = EntryArray[j];
-	  EntryArray[j] = e;
-	}
-      else 
-	return(j);
+/* *** SELECTING ENTRIES *** */
+/* The --select options restrict the database to the entries matching
+   all of them.  They apply to the input files that follow them, and
+   are checked as soon as each entry has been read.  By then the
+   entry's strings have been made (its fields may come in any order),
+   but an entry that does not match has them freed at once: its
+   attributes are never copied into the arena and its struct is reused
+   for the next entry, so memory does not grow with the entries
+   dropped.  When a field the options look at is missing but the entry
+   has a crossref, the field may come from the crossref target, which
+   has not been read yet: the entry is kept as UNDECIDED and checked
+   again once crossrefs are resolved.  The crossref targets of the
+   entries kept are kept too, even if they do not match themselves (as
+   TARGETONLY entries); as BibTeX requires, they must come after the
+   entries referring to them.
+ */
+#define SELECTYEAR      1        /* year in Low..High */
+#define SELECTTYPE      2        /* entry type is one of Text */
+#define SELECTAUTHOR    3        /* an author's last name is one of Text */
+#define SELECTTAGPREFIX 4        /* tag starts with Text */
+#define SELECTHAS       5        /* attribute Text is present */
+#define MAXSELECTIONS   50
+PERWORKER struct Selection
+{
+  int  Kind;                     /* SELECTYEAR, ... */
+  char *Text;                    /* comma-separated list, or a name */
+  long Low, High;                /* year range */
+} Selections[MAXSELECTIONS];
+PERWORKER int  NumberOfSelections = 0;
+PERWORKER int  SelectionPending = FALSE; /* UNDECIDED or TARGETONLY entries read? */
+PERWORKER struct StringMap WantedTargets = {NULL,0,0,TRUE};
+				 /* crossref targets of entries kept */
+
+/* AddSelection(kind,text): add a --select option with argument text */
+void AddSelection(int kind, char *text)
+{ struct Selection *s;
+  char *dash;
+  if (NumberOfSelections >= MAXSELECTIONS)
+    { fprintf(MessageFile,"\nBibtag: Too many --select options!\n");
+      exit(0);
+    }
+  s = &Selections[NumberOfSelections++];
+  s->Kind = kind;
+  s->Text = text;
+  if (kind == SELECTYEAR)
+    { /* y, y1-y2, y1-, or -y2 */
+      dash = strchr(text,'-');
+      s->Low = (dash == text) ? 0 : atol(text);
+      s->High = (dash == NULL) ? s->Low :
+	(dash[1] == 0) ? LONG_MAX : atol(dash+1);
     }
 }
 
-void QuickSortEntries(int p, int r)
-{ int q;
+/* InList(list,word): True if word is one of the comma-separated words
+ *                    in list (ignoring case).
+ */
+int InList(char *list, char *word)
+{ int n = strlen(word);
+  while (*list)
+    { if (strncasecmp(list,word,n) == 0 && (list[n] == ',' || list[n] == 0))
+	return(TRUE);
+      list = strchr(list,',');
+      if (list == NULL) break;
+      list++;
+    }
+  return(FALSE);
+}
+
+/* LettersOf(s,ans): the letters of s, in lower case, into ans */
+void LettersOf(char *s, char *ans)
+{ for (;*s;s++)
+    if (IsAlpha(*s)) *ans++ = ToLower(*s);
+  *ans = 0;
+}
+
+/* AuthorMatches(e,list): True if the last name of an author (or editor)
+ *                        of e is in list.  Name prefixes may be left
+ *                        off: "Neumann" matches "von Neumann".
+ */
+int AuthorMatches(struct Entry *e, char *list)
+{ char AuthorName[MAXAUTHORS][STRINGSIZE];
+  char name[STRINGSIZE], want[STRINGSIZE];
+  char *p, *q;
+  int  i, k, n, count;
+  count = GetAuthorNames(e,AuthorName);
+  for (i=0;i<count;i++)
+    { LettersOf(AuthorName[i],name);
+      for (p=list;p!=NULL;p=(q==NULL ? NULL : q+1))
+	{ q = strchr(p,',');
+	  n = (q == NULL) ? (int)strlen(p) : q-p;
+	  if (n >= STRINGSIZE) continue;
+	  memcpy(want,p,n);
+	  want[n] = 0;
+	  LettersOf(want,want);
+	  /* try the name as it is, then with prefixes stripped off */
+	  n = 0;
+	  while (TRUE)
+	    { if (strcmp(name+n,want) == 0)
+		return(TRUE);
+	      for (k=1;k<=NamePrefixes.MaxLength && name[n+k]!=0;k++)
+		if (WordSetContains(&NamePrefixes,name+n,k))
+		  break;
+	      if (k > NamePrefixes.MaxLength || name[n+k] == 0) break;
+	      n += k;
+	    }
+	}
+    }
+  return(FALSE);
+}
+
+/* SelectEntry(e): SELECTED if e matches all the --select options,
+ *                 UNDECIDED if that depends on its crossref, and
+ *                 otherwise -1.
+ */
+int SelectEntry(struct Entry *e)
+{ struct Selection *s;
+  char *v = NULL;
+  int  i, undecided = FALSE;
+  long year;
+  for (i=0;i<NumberOfSelections;i++)
+    { s = &Selections[i];
+      switch (s->Kind)
+	{ 
+	case SELECTTYPE:
+	  if (!InList(s->Text,e->EntryType+1)) return(-1);
+	  continue;
+	case SELECTTAGPREFIX:
+	  if (e->EntryTag == NULL ||
+	      strncasecmp(e->EntryTag,s->Text,strlen(s->Text)) != 0)
+	    return(-1);
+	  continue;
+	case SELECTYEAR:
+	  v = GetExpandedValue(e,"year");
+	  break;
+	case SELECTAUTHOR:
+	  v = GetExpandedValue(e,"author");
+	  if (v == NULL) v = GetExpandedValue(e,"editor");
+	  break;
+	case SELECTHAS:
+	  v = GetValue(e,s->Text);
+	  break;
+	}
+      if (v == NULL)
+	{ /* the field may yet come from a crossref target */
+	  if (e->CrossRef == NULL && GetValue(e,"crossref") != NULL)
+	    { undecided = TRUE;
+	      continue;
+	    }
+	  return(-1);
+	}
+      if (s->Kind == SELECTYEAR)
+	{ while (*v && !IsDigit(*v)) v++;
+	  year = atol(v);
+	  if (*v == 0 || year < s->Low || year > s->High) return(-1);
+	}
+      else if (s->Kind == SELECTAUTHOR && !AuthorMatches(e,s->Text))
+	return(-1);
+    }
+  return(undecided ? UNDECIDED : SELECTED);
+}
+
+/* WantTarget(e): note that the crossref target of e must be kept. */
+void WantTarget(struct Entry *e)
+{ char *v = GetValue(e,"crossref");
+  char *key;
+  int  n;
+  if (v == NULL) return;
+  if (v[0] == '{' || v[0] == '"')
+    { v++;
+      n = strlen(v)-1;
+    }
+  else
+    n = strlen(v);
+  if (n <= 0 || StringMapLookupN(&WantedTargets,v,n) != NULL) return;
+  key = mymalloc(n+1);
+  memcpy(key,v,n);
+  key[n] = 0;
+  *StringMapInsert(&WantedTargets,key) = (void *)1;
+}
+
+/* FilterEntry(e): decide, as e has just been read, whether to keep it.
+ *                 Returns False if it is to be dropped.
+ */
+int FilterEntry(struct Entry *e)
+{ int sel;
+  if (NumberOfSelections == 0 ||
+      strcasecmp(e->EntryType,"@string") == 0 ||
+      strcasecmp(e->EntryType,"@preamble") == 0)
+    return(TRUE);
+  sel = SelectEntry(e);
+  if (sel < 0)
+    { if (e->EntryTag == NULL ||
+	  StringMapLookup(&WantedTargets,e->EntryTag) == NULL)
+	return(FALSE);
+      sel = TARGETONLY;
+    }
+  e->Selection = sel;
+  if (sel != SELECTED)
+    SelectionPending = TRUE;
+  if (sel != TARGETONLY)
+    WantTarget(e);
+  return(TRUE);
+}
+
+/* FreeEntryStrings(e): free the strings of an entry being dropped.
+ *                     (Such an entry was read from text, never from a
+ *                     snapshot, but with --lazy its values may still
+ *                     be in the text.)
+ */
+void FreeString(char *s);
+void FreeEntryStrings(struct Entry *e)
+{ int i;
+  for (i=0;i<e->EntrySize;i++)
+    { free(e->Attributes[i].Name);
+      FreeString(e->Attributes[i].Value);
+      if (e->EntryExpansion != NULL)
+	free(e->EntryExpansion[i]);
+    }
+  free(e->EntryExpansion);
+  e->EntryExpansion = NULL;
+  free(e->InitialComments);
+  free(e->EntryType);
+  free(e->StringDef);
+  free(e->EntryTag);
+  e->EntrySize = 0;
+}
+
+/* FinishSelection: settle the UNDECIDED and TARGETONLY entries, now that
+ *                  crossrefs have been resolved, and drop those not kept.
+ */
+void FinishSelection()
+{ int i, j, k, changed;
+  struct Entry *e;
+  if (!SelectionPending) return;
+  SelectionPending = FALSE;
+  for (i=0;i<NumberOfEntries;i++)
+    { e = EntryArray[i];
+      if (e->Selection == UNDECIDED)
+	e->Selection = (SelectEntry(e) == SELECTED) ? SELECTED : -1;
+    }
+  /* Keep the crossref targets of the entries kept, even those that were
+     UNDECIDED and do not match, and then their targets in turn */
+  do
+    { changed = FALSE;
+      for (i=0;i<NumberOfEntries;i++)
+	{ e = EntryArray[i];
+	  if (e->Selection == SELECTED && e->CrossRef != NULL &&
+	      e->CrossRef->Selection != SELECTED)
+	    { e->CrossRef->Selection = SELECTED;
+	      changed = TRUE;
+	    }
+	}
+    }
+  while (changed);
+  /* Drop the rest, and recompute which entries are crossref targets */
+  for (i=0,k=0;i<NumberOfEntries;i++)
+    { e = EntryArray[i];
+      if (e->Selection != SELECTED)
+	{ if (BatchMode)
+	    FreeEntry(e);
+	  else
+	    FreeEntryStrings(e);
+	  continue;
+	}
+      e->IsCrossRef = FALSE;
+      for (j=1;j<e->EntrySize;j++)
+	if (strcasecmp(e->Attributes[j].Name,"crossrefonly") == 0)
+	  e->IsCrossRef = TRUE;
+      EntryArray[k++] = e;
+    }
+  NumberOfEntries = k;
+  for (i=0;i<NumberOfEntries;i++)
+    if (EntryArray[i]->CrossRef != NULL)
+      EntryArray[i]->CrossRef->IsCrossRef = TRUE;
+}
+
+/* *** PIPELINED INPUT AND OUTPUT *** */
+/* With --pipeline, input files are read, and the output written, by
+   threads of their own, so that waiting for the disk (or a network file
+   system) overlaps with parsing and formatting.  Between each such
+   thread and the main thread is a ring of PIPEBLOCKS blocks: one side
+   fills blocks and the other empties them, each keeping its own index
+   into the ring, and two counting semaphores hand the blocks over, so
+   the side that gets ahead sleeps until the other catches up.  The
+   main thread sees an ordinary stdio stream, made with fopencookie.
+   A reader thread also decompresses; a writer thread also compresses.
+ */
+#define PIPEBLOCKS    8          /* blocks in the ring */
+#define PIPEBLOCKSIZE (1<<18)    /* bytes in a block */
+
+struct Pipe
+{
+  FILE    *File;                 /* stream read or written by the thread */
+  char    *Block[PIPEBLOCKS];
+  ssize_t Length[PIPEBLOCKS];    /* bytes in each full block; 0 marks the
+				    end, and -1 a read error */
+  sem_t   Full;                  /* number of blocks filled, not yet emptied */
+  sem_t   Empty;                 /* number of blocks free to fill */
+  int     Head;                  /* next block to empty (emptying side) */
+  int     Tail;                  /* next block to fill (filling side) */
+  int     Taken;                 /* main thread: True while it holds the
+				    block at its index */
+  size_t  Pos;                   /* main thread: offset in that block */
+  int     Stop;                  /* reader: stream closed before the end */
+  int     Error;                 /* writer: a write has failed */
+  pthread_t Thread;
+};
+
+/* NewPipe(f,start): ring for the thread start, reading or writing f */
+struct Pipe *NewPipe(FILE *f, void *(*start)(void *))
+{ struct Pipe *p;
+  int i;
+  p = (struct Pipe *)mymalloc(sizeof(struct Pipe));
+  memset(p,0,sizeof(*p));
+  p->File = f;
+  for (i=0;i<PIPEBLOCKS;i++)
+    p->Block[i] = mymalloc(PIPEBLOCKSIZE);
+  sem_init(&p->Full,0,0);
+  sem_init(&p->Empty,0,PIPEBLOCKS);
+  if (pthread_create(&p->Thread,NULL,start,p) != 0)
+    { fprintf(MessageFile,"\nBibtag: Cannot start a thread for --pipeline\n");
+      exit(0);
+    }
+  return(p);
+}
+
+/* FreePipe(p): join the thread of p, and free p */
+int FreePipe(struct Pipe *p)
+{ int i, ok;
+  pthread_join(p->Thread,NULL);
+  ok = !p->Error;
+  if (fclose(p->File) != 0) ok = FALSE;
+  for (i=0;i<PIPEBLOCKS;i++)
+    free(p->Block[i]);
+  sem_destroy(&p->Full);
+  sem_destroy(&p->Empty);
+  free(p);
+  return(ok ? 0 : EOF);
+}
+
+void *ReaderThread(void *arg)
+{ struct Pipe *p = (struct Pipe *)arg;
+  ssize_t n;
+  do
+    { sem_wait(&p->Empty);
+      if (__atomic_load_n(&p->Stop,__ATOMIC_ACQUIRE))
+	break;
+      n = fread(p->Block[p->Tail],1,PIPEBLOCKSIZE,p->File);
+      if (n == 0 && ferror(p->File)) n = -1;
+      p->Length[p->Tail] = n;
+      p->Tail = (p->Tail+1) % PIPEBLOCKS;
+      sem_post(&p->Full);
+    }
+  while (n > 0);
+  return(NULL);
+}
+
+ssize_t PipeRead(void *cookie, char *buf, size_t size)
+{ struct Pipe *p = (struct Pipe *)cookie;
+  ssize_t len;
+  size_t n;
+  if (!p->Taken)
+    { sem_wait(&p->Full);
+      p->Taken = TRUE;
+      p->Pos = 0;
+    }
+  len = p->Length[p->Head];
+  if (len <= 0)
+    return(len);                 /* (and keep the block: it stays at end) */
+  n = (size < len-p->Pos) ? size : len-p->Pos;
+  memcpy(buf,p->Block[p->Head]+p->Pos,n);
+  p->Pos += n;
+  if (p->Pos == (size_t)len)
+    { p->Taken = FALSE;
+      p->Head = (p->Head+1) % PIPEBLOCKS;
+      sem_post(&p->Empty);
+    }
+  return(n);
+}
+
+int PipeReadClose(void *cookie)
+{ struct Pipe *p = (struct Pipe *)cookie;
+  __atomic_store_n(&p->Stop,TRUE,__ATOMIC_RELEASE);
+  sem_post(&p->Empty);           /* (wake the reader if it waits) */
+  return(FreePipe(p));
+}
+
+/* PrefetchStream(f): stream reading f ahead, by a thread of its own */
+FILE *PrefetchStream(FILE *f)
+{ cookie_io_functions_t io = { PipeRead, NULL, NULL, PipeReadClose };
+  FILE *s = fopencookie(NewPipe(f,ReaderThread),"r",io);
+  if (s != NULL)
+    setvbuf(s,NULL,_IOFBF,1<<16);
+  return(s);
+}
+
+void *WriterThread(void *arg)
+{ struct Pipe *p = (struct Pipe *)arg;
+  ssize_t n;
+  while (TRUE)
+    { sem_wait(&p->Full);
+      n = p->Length[p->Head];
+      if (n == 0) break;
+      if (fwrite(p->Block[p->Head],1,n,p->File) != (size_t)n)
+	__atomic_store_n(&p->Error,TRUE,__ATOMIC_RELEASE);
+      p->Head = (p->Head+1) % PIPEBLOCKS;
+      sem_post(&p->Empty);
+    }
+  return(NULL);
+}
+
+/* PassBlock(p): hand the block being filled, of p->Pos bytes, to the
+ *               writer thread.
+ */
+void PassBlock(struct Pipe *p)
+{ p->Length[p->Tail] = p->Pos;
+  p->Tail = (p->Tail+1) % PIPEBLOCKS;
+  p->Taken = FALSE;
+  sem_post(&p->Full);
+}
+
+ssize_t PipeWrite(void *cookie, const char *buf, size_t size)
+{ struct Pipe *p = (struct Pipe *)cookie;
+  size_t n, done = 0;
+  if (__atomic_load_n(&p->Error,__ATOMIC_ACQUIRE))
+    return(0);
+  while (done < size)
+    { if (!p->Taken)
+	{ sem_wait(&p->Empty);
+	  p->Taken = TRUE;
+	  p->Pos = 0;
+	}
+      n = size-done;
+      if (n > PIPEBLOCKSIZE-p->Pos) n = PIPEBLOCKSIZE-p->Pos;
+      memcpy(p->Block[p->Tail]+p->Pos,buf+done,n);
+      p->Pos += n;
+      done += n;
+      if (p->Pos == PIPEBLOCKSIZE)
+	PassBlock(p);
+    }
+  return(size);
+}
+
+int PipeWriteClose(void *cookie)
+{ struct Pipe *p = (struct Pipe *)cookie;
+  if (p->Taken && p->Pos > 0)
+    PassBlock(p);
+  if (!p->Taken)
+    { sem_wait(&p->Empty);
+      p->Taken = TRUE;
+    }
+  p->Pos = 0;                    /* an empty block marks the end */
+  PassBlock(p);
+  return(FreePipe(p));
+}
+
+/* WriteBehindStream(f): stream writing to f by a thread of its own */
+FILE *WriteBehindStream(FILE *f)
+{ cookie_io_functions_t io = { NULL, PipeWrite, NULL, PipeWriteClose };
+  FILE *s = fopencookie(NewPipe(f,WriterThread),"w",io);
+  if (s != NULL)
+    setvbuf(s,NULL,_IOFBF,PIPEBLOCKSIZE);
+  return(s);
+}
+
+/* *** COMPRESSED FILES *** */
+/* Input files compressed with gzip (or zstd, when bibtag is built with
+   it) are recognized by their first bytes and decompressed as they are
+   read; output is compressed when the -o file name ends in .gz (or
+   .zst).  Either way the rest of bibtag sees an ordinary stdio stream,
+   made with fopencookie, which (de)compresses one block at a time.
+ */
+#define NOTCOMPRESSED 0
+#define GZIPPED       1
+#define ZSTDCOMPRESSED 2
+#define COMPRESSBLOCKSIZE (1<<17)  /* bytes (de)compressed at a time */
+
+/* Compression(magic,n): how a file starting with the n bytes at magic
+ *                       is compressed.
+ */
+int Compression(unsigned char *magic, int n)
+{ if (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+    return(GZIPPED);
+  if (n >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 &&
+      magic[2] == 0x2f && magic[3] == 0xfd)
+    return(ZSTDCOMPRESSED);
+  return(NOTCOMPRESSED);
+}
+
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+ssize_t GzipRead(void *cookie, char *buf, size_t size)
+{ int n = gzread((gzFile)cookie,buf,size > INT_MAX ? INT_MAX : size);
+  return(n < 0 ? -1 : n);
+}
+
+ssize_t GzipWrite(void *cookie, const char *buf, size_t size)
+{ int n = 0;
+  if (size > 0)
+    n = gzwrite((gzFile)cookie,buf,size > INT_MAX ? INT_MAX : size);
+  return(n < 0 ? 0 : n);
+}
+
+int GzipClose(void *cookie)
+{ return(gzclose((gzFile)cookie) == Z_OK ? 0 : EOF);
+}
+
+/* GzipStream(fd,mode): stdio stream (de)compressing gzip data on fd */
+FILE *GzipStream(int fd, char *mode)
+{ cookie_io_functions_t io = { GzipRead, GzipWrite, NULL, GzipClose };
+  gzFile g = gzdopen(fd,mode[0] == 'r' ? "rb" : "wb");
+  if (g == NULL)
+    return(NULL);
+  gzbuffer(g,COMPRESSBLOCKSIZE);
+  return(fopencookie(g,mode,io));
+}
+#endif
+
+#if defined(HAVE_ZSTD_H) && defined(HAVE_LIBZSTD)
+struct ZstdStream
+{
+  FILE   *File;                  /* the compressed file */
+  ZSTD_DStream *Decompressor;    /* one of these two is used */
+  ZSTD_CStream *Compressor;
+  ZSTD_inBuffer In;              /* compressed input not yet used */
+  char   *Buffer;                /* compressed data read or to write */
+  size_t BufferSize;
+};
+
+ssize_t ZstdRead(void *cookie, char *buf, size_t size)
+{ struct ZstdStream *z = (struct ZstdStream *)cookie;
+  ZSTD_outBuffer out = { buf, size, 0 };
+  size_t r;
+  while (out.pos == 0)
+    { if (z->In.pos == z->In.size)
+	{ z->In.size = fread(z->Buffer,1,z->BufferSize,z->File);
+	  z->In.pos = 0;
+	  if (z->In.size == 0)
+	    break;
+	}
+      r = ZSTD_decompressStream(z->Decompressor,&out,&z->In);
+      if (ZSTD_isError(r))
+	return(-1);
+    }
+  return(out.pos);
+}
+
+/* ZstdFlush(z,in,mode): compress in with the given end directive, and
+ *                       write out what comes out.
+ */
+int ZstdFlush(struct ZstdStream *z, ZSTD_inBuffer *in, ZSTD_EndDirective mode)
+{ ZSTD_outBuffer out;
+  size_t r;
+  do
+    { out.dst = z->Buffer;
+      out.size = z->BufferSize;
+      out.pos = 0;
+      r = ZSTD_compressStream2(z->Compressor,&out,in,mode);
+      if (ZSTD_isError(r) || fwrite(z->Buffer,1,out.pos,z->File) != out.pos)
+	return(FALSE);
+    }
+  while (mode == ZSTD_e_continue ? in->pos < in->size : r != 0);
+  return(TRUE);
+}
+
+ssize_t ZstdWrite(void *cookie, const char *buf, size_t size)
+{ ZSTD_inBuffer in = { buf, size, 0 };
+  return(ZstdFlush((struct ZstdStream *)cookie,&in,ZSTD_e_continue) ?
+	 size : 0);
+}
+
+int ZstdClose(void *cookie)
+{ struct ZstdStream *z = (struct ZstdStream *)cookie;
+  ZSTD_inBuffer in = { NULL, 0, 0 };
+  int ok = TRUE;
+  if (z->Compressor != NULL)
+    { ok = ZstdFlush(z,&in,ZSTD_e_end);
+      ZSTD_freeCStream(z->Compressor);
+    }
+  if (z->Decompressor != NULL)
+    ZSTD_freeDStream(z->Decompressor);
+  if (fclose(z->File) != 0) ok = FALSE;
+  free(z->Buffer);
+  free(z);
+  return(ok ? 0 : EOF);
+}
+
+/* ZstdStream(fd,mode): stdio stream (de)compressing zstd data on fd */
+FILE *ZstdStream(int fd, char *mode)
+{ cookie_io_functions_t io = { ZstdRead, ZstdWrite, NULL, ZstdClose };
+  struct ZstdStream *z;
+  z = (struct ZstdStream *)mymalloc(sizeof(struct ZstdStream));
+  memset(z,0,sizeof(*z));
+  z->File = fdopen(fd,mode[0] == 'r' ? "rb" : "wb");
+  if (z->File == NULL)
+    { free(z);
+      return(NULL);
+    }
+  if (mode[0] == 'r')
+    { z->Decompressor = ZSTD_createDStream();
+      z->BufferSize = ZSTD_DStreamInSize();
+    }
+  else
+    { z->Compressor = ZSTD_createCStream();
+      z->BufferSize = ZSTD_CStreamOutSize();
+    }
+  z->Buffer = mymalloc(z->BufferSize);
+  return(fopencookie(z,mode,io));
+}
+#endif
+
+/* CompressedStream(fd,how,mode,name): stdio stream reading or writing
+ *                   (as mode says) fd compressed as how says; exits
+ *                   if this bibtag cannot do that compression.
+ */
+FILE *CompressedStream(int fd, int how, char *mode, char *name)
+{ FILE *f = NULL;
+  switch (how)
+    { 
+    case NOTCOMPRESSED:
+      return(fdopen(fd,mode));
+    case GZIPPED:
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+      f = GzipStream(fd,mode);
+      break;
+#else
+      fprintf(MessageFile,"\nBibtag: %s: this bibtag cannot handle gzip files!\n",
+	      name);
+      exit(0);
+#endif
+    case ZSTDCOMPRESSED:
+#if defined(HAVE_ZSTD_H) && defined(HAVE_LIBZSTD)
+      f = ZstdStream(fd,mode);
+      break;
+#else
+      fprintf(MessageFile,"\nBibtag: %s: this bibtag cannot handle zstd files!\n",
+	      name);
+      exit(0);
+#endif
+    }
+  return(f);
+}
+
+/* OpenInputFile(name): open input file name for reading, decompressing
+ *                      it if need be; NULL if it cannot be opened.
+ */
+FILE *OpenInputFile(char *name)
+{ unsigned char magic[4];
+  FILE *f;
+  int fd, n;
+  fd = open(name,O_RDONLY);
+  if (fd < 0)
+    return(NULL);
+  n = pread(fd,magic,sizeof(magic),0);
+  f = CompressedStream(fd,Compression(magic,n),"r",name);
+  return((Pipeline && f != NULL) ? PrefetchStream(f) : f);
+}
+
+/* OpenOutputFile(name): open output file name for writing, compressing
+ *                       it if name ends in .gz or .zst.
+ */
+FILE *OpenOutputFile(char *name)
+{ FILE *f;
+  int fd, n = strlen(name), how = NOTCOMPRESSED;
+  if (n > 3 && strcmp(name+n-3,".gz") == 0)
+    how = GZIPPED;
+  else if (n > 4 && strcmp(name+n-4,".zst") == 0)
+    how = ZSTDCOMPRESSED;
+  fd = open(name,O_WRONLY|O_CREAT|O_TRUNC,0666);
+  if (fd < 0)
+    return(NULL);
+  f = CompressedStream(fd,how,"w",name);
+  return((Pipeline && f != NULL) ? WriteBehindStream(f) : f);
+}
+
+/* OpenLazyInputFile(name): open input file name for reading with
+ *                   --lazy: if it is a plain file, read it all into
+ *                   LazyText and read that; otherwise, as OpenInputFile.
+ */
+void KeepMapping(char *base, size_t size);
+FILE *OpenLazyInputFile(char *name)
+{ unsigned char magic[4];
+  struct stat st;
+  char *text;
+  off_t length;
+  ssize_t n;
+  FILE *f;
+  int fd;
+  fd = open(name,O_RDONLY);
+  if (fd < 0)
+    return(NULL);
+  n = pread(fd,magic,sizeof(magic),0);
+  if (fstat(fd,&st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+      Compression(magic,n) != NOTCOMPRESSED)
+    { close(fd);
+      return(OpenInputFile(name));
+    }
+  text = mymalloc(st.st_size+1);
+  for (length=0;length<st.st_size;length+=n)
+    if ((n = read(fd,text+length,st.st_size-length)) <= 0)
+      break;
+  close(fd);
+  text[length] = 0;
+  f = fmemopen(text,length,"r");
+  if (f == NULL)
+    { free(text);
+      return(OpenInputFile(name));
+    }
+  KeepMapping(text,length+1);
+  LazyText = text;
+  LazyLength = length;
+  return(f);
+}
+
+/* ReadInputFile(name): Input the entire database file into memory,
+ *                      and remember its size and modification time
+ *                      so that a snapshot of it can be checked later.
+ */
+void ReadInputFile(char *name)
+{ struct stat st;
+  strcpy(InputFileName,name);
+  if (InputFileName[0])
+    { 
+      InputFile = LazyParsing ? OpenLazyInputFile(InputFileName)
+			      : OpenInputFile(InputFileName);
+      if (InputFile == NULL) 
+	{ fprintf(MessageFile,
+		  "\nBibtag: Input file open error: %s\n",
+		  InputFileName); 
+	  exit(0); 
+	}
+      if (NumberOfSourceFiles < MAXSOURCEFILES &&
+	  stat(InputFileName,&st) == 0)
+	{ SourceFiles[NumberOfSourceFiles].Name = strdup(InputFileName);
+	  SourceFiles[NumberOfSourceFiles].Size = st.st_size;
+	  SourceFiles[NumberOfSourceFiles].MTime = st.st_mtim;
+	  InputSourceIndex = NumberOfSourceFiles++;
+	}
+    }
+  ReadDataBase();
+  LazyText = NULL;
+  InputSourceIndex = -1;
+  ResolveCrossReferences();
+}
+
+/* *** DATABASE SNAPSHOTS *** */
+/* A snapshot is an image of the parsed database that a later run can map
+   into memory instead of parsing the Bibtex text again.  The file holds
+   a header, a table of the source files the database was read from, the
+   entries themselves (the preamble first, then the string definitions,
+   then the regular entries) as struct Entry images, each followed by the
+   images of its attribute array, and finally all the strings.  In the
+   stored images every pointer is replaced by its offset from the start
+   of the file (0 stands for NULL), so loading the file is one mmap
+   followed by adding the mapping address to these offsets.
+   A snapshot is only valid for the machine and the bibtag build that
+   wrote it, and only while its source files are unchanged.
+ */
+#define SNAPSHOTMAGIC     "BIBTAGDB"
+#define SNAPSHOTVERSION   8
+#define SNAPSHOTBYTEORDER 0x01020304
+
+struct SnapshotHeader
+{
+  char     Magic[8];             /* SNAPSHOTMAGIC */
+  uint32_t Version;              /* SNAPSHOTVERSION */
+  uint32_t ByteOrder;            /* SNAPSHOTBYTEORDER, as written */
+  uint32_t EntryImageSize;       /* sizeof(struct Entry) of the writer */
+  uint32_t AttributeImageSize;   /* sizeof(struct Attribute) of the writer */
+  uint32_t NumberOfSources;      /* number of source file records */
+  uint32_t HasPreamble;          /* True if first entry image is @preamble */
+  uint32_t NumberOfStrings;      /* number of @string entry images */
+  uint32_t NumberOfEntries;      /* number of regular entry images */
+  uint64_t FileSize;             /* total size of the snapshot file */
+  uint64_t InitialText;          /* offset of InitialText */
+  uint64_t Sources;              /* offset of source file records */
+  uint64_t Entries;              /* offset of first entry image */
+};
+
+struct SnapshotSource
+{
+  uint64_t Name;                 /* offset of file name */
+  int64_t  Size;                 /* file size when it was read */
+  int64_t  MTimeSeconds;         /* modification time when it was read */
+  int64_t  MTimeNanoseconds;
+};
+
+/* Mappings of loaded snapshots (and texts of files read with --lazy);
+   strings inside them must not be freed. */
+struct SnapshotMapping
+{
+  char   *Base;
+  size_t Size;
+  struct SnapshotMapping *Next;
+} *SnapshotMappings = NULL;
+
+/* KeepMapping(base,size): remember that the size bytes at base hold
+ *                         strings of the database.
+ */
+void KeepMapping(char *base, size_t size)
+{ struct SnapshotMapping *m;
+  m = (struct SnapshotMapping *)mymalloc(sizeof(struct SnapshotMapping));
+  m->Base = base;
+  m->Size = size;
+  m->Next = SnapshotMappings;
+  SnapshotMappings = m;
+}
+
+/* FreeString(s): free a string of the database, unless it lives in
+ *                a loaded snapshot or the text of a file.
+ */
+void FreeString(char *s)
+{ struct SnapshotMapping *m;
+  for (m=SnapshotMappings;m!=NULL;m=m->Next)
+    if (s >= m->Base && s < m->Base + m->Size)
+      return;
+  free(s);
+}
+
+/* SnapshotOffset(s,next): offset that string s will have in the string
+ *                         area, where *next is the offset of the next
+ *                         free byte; 0 if s is NULL.
+ */
+uint64_t SnapshotOffset(char *s, uint64_t *next)
+{ uint64_t offset;
+  if (s == NULL) return(0);
+  offset = *next;
+  *next += strlen(s)+1;
+  return(offset);
+}
+
+/* SnapshotImageSize(e): bytes taken by the image of e and its attributes */
+uint64_t SnapshotImageSize(struct Entry *e)
+{
+  return(sizeof(struct Entry) + (uint64_t)e->EntrySize*sizeof(struct Attribute));
+}
+
+/* Cross-reference targets are found by address when images are made */
+struct SnapshotTarget
+{
+  struct Entry *Entry;
+  uint64_t Offset;               /* offset of its image */
+} *SnapshotTargets;
+
+int SnapshotTargetCompare(const void *a, const void *b)
+{ struct Entry *e1 = ((struct SnapshotTarget *)a)->Entry;
+  struct Entry *e2 = ((struct SnapshotTarget *)b)->Entry;
+  return(e1 < e2 ? -1 : e1 > e2);
+}
+
+/* SnapshotImage(e,offset,f,strings): write the image of entry e, which
+ *                    goes at the given offset, and the images of its
+ *                    attributes to file f.  Its strings start at offset
+ *                    *strings.
+ */
+void SnapshotImage(struct Entry *e, uint64_t offset, FILE *f,
+		   uint64_t *strings)
+{ struct SnapshotTarget key, *t;
+  struct Entry image;
+  struct Attribute a;
+  int i;
+  image = *e;
+#define OFFSET(s) ((char *)(uintptr_t)SnapshotOffset((s),strings))
+  image.InitialComments = OFFSET(e->InitialComments);
+  image.EntryType = OFFSET(e->EntryType);
+  image.StringDef = OFFSET(e->StringDef);
+  image.EntryTag = OFFSET(e->EntryTag);
+  image.NewEntryTag = NULL;
+  image.BaseTag = NULL;
+  image.Formatted = NULL;
+  image.EntryExpansion = NULL;
+  image.Attributes = (struct Attribute *)(uintptr_t)
+    (offset + sizeof(struct Entry));
+  image.CrossRef = NULL;
+  if (e->CrossRef != NULL)
+    { key.Entry = e->CrossRef;
+      t = bsearch(&key,SnapshotTargets,NumberOfEntries,
+		  sizeof(struct SnapshotTarget),SnapshotTargetCompare);
+      if (t != NULL)
+	image.CrossRef = (struct Entry *)(uintptr_t)t->Offset;
+    }
+  fwrite(&image,sizeof(image),1,f);
+  for (i=0;i<e->EntrySize;i++)
+    { a.Name = OFFSET(e->Attributes[i].Name);
+      a.Value = OFFSET(e->Attributes[i].Value);
+      fwrite(&a,sizeof(a),1,f);
+    }
+#undef OFFSET
+}
+
+/* SnapshotStrings(e,f): write the strings of entry e to file f, in the
+ *                       order SnapshotImage assigned their offsets.
+ */
+void SnapshotStrings(struct Entry *e, FILE *f)
+{ int i;
+#define PUT(s) if ((s)!=NULL) fwrite((s),1,strlen(s)+1,f)
+  PUT(e->InitialComments);
+  PUT(e->EntryType);
+  PUT(e->StringDef);
+  PUT(e->EntryTag);
+  for (i=0;i<e->EntrySize;i++)
+    { PUT(e->Attributes[i].Name);
+      PUT(e->Attributes[i].Value);
+    }
+#undef PUT
+}
+
+/* SnapshotEntry(k): k-th entry in snapshot order (preamble, strings,
+ *                   regular entries).
+ */
+struct Entry *SnapshotEntry(int k)
+{
+  if (Preamble != NULL)
+    { if (k == 0) return(Preamble);
+      k--;
+    }
+  if (k < NumberOfStrings) return(StringArray[k]);
+  return(EntryArray[k-NumberOfStrings]);
+}
+
+/* SaveSnapshot(name): write a snapshot of the database read so far.
+ *                     The file is written under a temporary name and
+ *                     then renamed, so readers never see a partial one.
+ */
+void SaveSnapshot(char *name)
+{ struct SnapshotHeader h;
+  struct SnapshotSource src;
+  char   tmpname[STRINGSIZE+10];
+  FILE   *f;
+  uint64_t next, offset;
+  int    i, n;
+  n = (Preamble!=NULL) + NumberOfStrings + NumberOfEntries;
+  memset(&h,0,sizeof(h));
+  memcpy(h.Magic,SNAPSHOTMAGIC,8);
+  h.Version = SNAPSHOTVERSION;
+  h.ByteOrder = SNAPSHOTBYTEORDER;
+  h.EntryImageSize = sizeof(struct Entry);
+  h.AttributeImageSize = sizeof(struct Attribute);
+  h.NumberOfSources = NumberOfSourceFiles;
+  h.HasPreamble = (Preamble != NULL);
+  h.NumberOfStrings = NumberOfStrings;
+  h.NumberOfEntries = NumberOfEntries;
+  h.Sources = sizeof(h);
+  h.Entries = h.Sources + (uint64_t)NumberOfSourceFiles * sizeof(src);
+  h.Entries = (h.Entries + 15) & ~(uint64_t)15;
+  /* Find where every image goes, so cross-refs can point forward */
+  SnapshotTargets = (struct SnapshotTarget *)
+    mymalloc((NumberOfEntries+1) * sizeof(struct SnapshotTarget));
+  offset = h.Entries;
+  for (i=0;i<n;i++)
+    { if (i >= n-NumberOfEntries)
+	{ SnapshotTargets[i-(n-NumberOfEntries)].Entry = SnapshotEntry(i);
+	  SnapshotTargets[i-(n-NumberOfEntries)].Offset = offset;
+	}
+      offset += SnapshotImageSize(SnapshotEntry(i));
+    }
+  qsort(SnapshotTargets,NumberOfEntries,sizeof(struct SnapshotTarget),
+	SnapshotTargetCompare);
+  snprintf(tmpname,sizeof(tmpname),"%s.tmp",name);
+  f = fopen(tmpname,"w");
+  if (f == NULL)
+    { fprintf(MessageFile,"\nBibtag: Snapshot file open error: %s",tmpname);
+      exit(0);
+    }
+  /* Header is rewritten with the file size once everything is out */
+  fwrite(&h,sizeof(h),1,f);
+  next = offset;                 /* strings follow the last image */
+  h.InitialText = SnapshotOffset(InitialText,&next);
+  for (i=0;i<NumberOfSourceFiles;i++)
+    { memset(&src,0,sizeof(src));
+      src.Name = SnapshotOffset(SourceFiles[i].Name,&next);
+      src.Size = SourceFiles[i].Size;
+      src.MTimeSeconds = SourceFiles[i].MTime.tv_sec;
+      src.MTimeNanoseconds = SourceFiles[i].MTime.tv_nsec;
+      fwrite(&src,sizeof(src),1,f);
+    }
+  for (i=ftell(f);(uint64_t)i<h.Entries;i++)
+    putc(0,f);
+  offset = h.Entries;
+  for (i=0;i<n;i++)
+    { SnapshotImage(SnapshotEntry(i),offset,f,&next);
+      offset += SnapshotImageSize(SnapshotEntry(i));
+    }
+  h.FileSize = next;
+  if (InitialText != NULL)
+    fwrite(InitialText,1,strlen(InitialText)+1,f);
+  for (i=0;i<NumberOfSourceFiles;i++)
+    fwrite(SourceFiles[i].Name,1,strlen(SourceFiles[i].Name)+1,f);
+  for (i=0;i<n;i++)
+    SnapshotStrings(SnapshotEntry(i),f);
+  free(SnapshotTargets);
+  if (fseek(f,0,SEEK_SET) != 0 || fwrite(&h,sizeof(h),1,f) != 1 ||
+      fflush(f) != 0 || ferror(f) || fclose(f) != 0 ||
+      rename(tmpname,name) != 0)
+    { fprintf(MessageFile,"\nBibtag: Snapshot write error: %s",name);
+      unlink(tmpname);
+      exit(0);
+    }
+}
+
+/* SnapshotFixUp(p,base,size,ok): turn a stored offset back into a
+ *                   pointer into the mapping; clears *ok if the
+ *                   offset lies outside the file.
+ */
+void *SnapshotFixUp(void *p, char *base, size_t size, int *ok)
+{ uintptr_t offset = (uintptr_t)p;
+  if (offset == 0) return(NULL);
+  if (offset >= size)
+    { *ok = FALSE;
+      return(NULL);
+    }
+  return(base + offset);
+}
+
+/* SnapshotHoldsImage(images,n,p): True if p is one of the n entry images,
+ *                   which lie in the mapping in increasing order.
+ */
+int SnapshotHoldsImage(struct Entry **images, int n, struct Entry *p)
+{ int low = 0, high = n-1, mid;
+  while (low <= high)
+    { mid = low + (high-low)/2;
+      if (images[mid] == p) return(TRUE);
+      if (images[mid] < p)
+	low = mid+1;
+      else
+	high = mid-1;
+    }
+  return(FALSE);
+}
+
+/* LoadSnapshot(name): add the database stored in a snapshot file, in
+ *                     place of reading its source files.  If the snapshot
+ *                     is unusable, or any source file has changed since
+ *                     it was written, it is rejected and the source files
+ *                     it lists are read instead (if they are known).
+ */
+void LoadSnapshot(char *name)
+{ struct SnapshotHeader *h;
+  struct SnapshotSource *src;
+  struct Entry *e, **images;
+  struct stat st;
+  char   *base, *p, *text;
+  int    fd, i, j, n, first, ok;
+  fd = open(name,O_RDONLY);
+  if (fd < 0 || fstat(fd,&st) != 0)
+    { fprintf(MessageFile,"\nBibtag: Snapshot file open error: %s\n",name);
+      exit(0);
+    }
+  base = NULL;
+  if ((size_t)st.st_size >= sizeof(struct SnapshotHeader))
+    base = mmap(NULL,st.st_size,PROT_READ|PROT_WRITE,MAP_PRIVATE,fd,0);
+  close(fd);
+  if (base == NULL || base == MAP_FAILED)
+    { fprintf(MessageFile,"\nBibtag: Snapshot %s is not readable!\n",name);
+      exit(0);
+    }
+  h = (struct SnapshotHeader *)base;
+  if (memcmp(h->Magic,SNAPSHOTMAGIC,8) != 0 ||
+      h->Version != SNAPSHOTVERSION ||
+      h->ByteOrder != SNAPSHOTBYTEORDER ||
+      h->EntryImageSize != sizeof(struct Entry) ||
+      h->AttributeImageSize != sizeof(struct Attribute) ||
+      h->FileSize != (uint64_t)st.st_size ||
+      base[st.st_size-1] != 0 ||
+      h->NumberOfSources > MAXSOURCEFILES ||
+      (uint64_t)h->HasPreamble + h->NumberOfStrings + h->NumberOfEntries >
+	(uint64_t)st.st_size/sizeof(struct Entry) ||
+      h->Sources + (uint64_t)h->NumberOfSources*sizeof(*src) > h->Entries ||
+      h->Entries > (uint64_t)st.st_size)
+    { fprintf(MessageFile,
+	      "\nBibtag: %s is not a snapshot written by this bibtag!\n",name);
+      exit(0);
+    }
+  src = (struct SnapshotSource *)(base + h->Sources);
+  ok = TRUE;
+  for (i=0;i<(int)h->NumberOfSources;i++)
+    { char *file = SnapshotFixUp((void *)(uintptr_t)src[i].Name,
+				 base,st.st_size,&ok);
+      struct stat fst;
+      if (file == NULL || stat(file,&fst) != 0 ||
+	  fst.st_size != src[i].Size ||
+	  fst.st_mtim.tv_sec != src[i].MTimeSeconds ||
+	  fst.st_mtim.tv_nsec != src[i].MTimeNanoseconds)
+	{ fprintf(MessageFile,
+		  "Bibtag: Snapshot %s is out of date (%s has changed)!\n",
+		  name,file ? file : "?");
+	  ok = FALSE;
+	  break;
+	}
+    }
+  if (!ok)
+    { /* Rejected: read the database from its sources instead */
+      char *files[MAXSOURCEFILES];
+      n = 0;
+      for (i=0;i<(int)h->NumberOfSources;i++)
+	if (src[i].Name != 0 && src[i].Name < (uint64_t)st.st_size)
+	  files[n++] = strdup(base + src[i].Name);
+      munmap(base,st.st_size);
+      for (i=0;i<n;i++)
+	{ fprintf(MessageFile,"Bibtag: Reading %s instead.\n",files[i]);
+	  ReadInputFile(files[i]);
+	  free(files[i]);
+	}
+      return;
+    }
+  if (Preamble != NULL && h->HasPreamble)
+    {
+      fprintf(MessageFile,"\nBibtag: More than one @preamble!");
+      fprintf(MessageFile,"\nBibtag: Earlier @preamble will be lost!");
+    }
+  /* Pointer fix-up */
+  n = h->HasPreamble + h->NumberOfStrings + h->NumberOfEntries;
+  images = (struct Entry **)mymalloc((n+1)*sizeof(struct Entry *));
+  p = base + h->Entries;
+  for (i=0;i<n && ok;i++)
+    { 
+      e = (struct Entry *)p;
+      if (p + sizeof(struct Entry) > base + st.st_size ||
+	  e->EntrySize < 0 || e->EntrySize > MAXATTRIBUTES ||
+	  p + SnapshotImageSize(e) > base + st.st_size)
+	{ ok = FALSE;
+	  break;
+	}
+      images[i] = e;
+      p += SnapshotImageSize(e);
+      e->InitialComments = SnapshotFixUp(e->InitialComments,base,st.st_size,&ok);
+      e->EntryType = SnapshotFixUp(e->EntryType,base,st.st_size,&ok);
+      e->StringDef = SnapshotFixUp(e->StringDef,base,st.st_size,&ok);
+      e->EntryTag = SnapshotFixUp(e->EntryTag,base,st.st_size,&ok);
+      e->NewEntryTag = NULL;
+      e->BaseTag = NULL;
+      e->Formatted = NULL;
+      e->Diagnosed = 0;
+      e->EntryExpansion = NULL;
+      e->Attributes = (struct Attribute *)(e+1);
+      for (j=0;j<e->EntrySize && ok;j++)
+	{ e->Attributes[j].Name =
+	    SnapshotFixUp(e->Attributes[j].Name,base,st.st_size,&ok);
+	  e->Attributes[j].Value =
+	    SnapshotFixUp(e->Attributes[j].Value,base,st.st_size,&ok);
+	}
+      e->CrossRef = SnapshotFixUp(e->CrossRef,base,st.st_size,&ok);
+      /* Source indices are relative to this snapshot's source table */
+      if (e->SourceIndex >= 0 &&
+	  NumberOfSourceFiles + e->SourceIndex < MAXSOURCEFILES)
+	e->SourceIndex += NumberOfSourceFiles;
+      else
+	e->SourceIndex = -1;
+      e->Modified = 0;
+      e->Selection = SELECTED;
+    }
+  /* A crossref must lead to one of the entries just fixed up */
+  first = h->HasPreamble + h->NumberOfStrings;
+  for (i=0;i<n && ok;i++)
+    if (images[i]->CrossRef != NULL &&
+	!SnapshotHoldsImage(images+first,n-first,images[i]->CrossRef))
+      ok = FALSE;
+  text = SnapshotFixUp((void *)(uintptr_t)h->InitialText,base,st.st_size,&ok);
+  if (!ok)
+    { fprintf(MessageFile,"\nBibtag: Snapshot %s is corrupt!\n",name);
+      exit(0);
+    }
+  KeepMapping(base,st.st_size);
+  /* Install the entries and remember the sources for later snapshots */
+  if (text != NULL)
+    InitialText = text;
+  i = 0;
+  if (h->HasPreamble)
+    Preamble = images[i++];
+  for (j=0;j<(int)h->NumberOfStrings;j++,i++)
+    { AppendEntry(&StringArray,&NumberOfStrings,&StringArraySize,images[i]);
+      DefineMacro(images[i]);
+    }
+  for (j=0;j<(int)h->NumberOfEntries;j++,i++)
+    AppendEntry(&EntryArray,&NumberOfEntries,&EntryArraySize,images[i]);
+  free(images);
+  for (i=0;i<(int)h->NumberOfSources && NumberOfSourceFiles<MAXSOURCEFILES;i++)
+    { SourceFiles[NumberOfSourceFiles].Name = base + src[i].Name;
+      SourceFiles[NumberOfSourceFiles].Size = src[i].Size;
+      SourceFiles[NumberOfSourceFiles].MTime.tv_sec = src[i].MTimeSeconds;
+      SourceFiles[NumberOfSourceFiles].MTime.tv_nsec = src[i].MTimeNanoseconds;
+      NumberOfSourceFiles++;
+    }
+}
+
+int EntryCompare(struct Entry *e1, struct Entry *e2)
+{ 
+  if (e1->IsCrossRef == 0 && e2->IsCrossRef == 1) return(-1);
+  if (e1->IsCrossRef == 1 && e2->IsCrossRef == 0) return(1);
+  return(strcmp(e1->EntryTag,e2->EntryTag));
+}
+
+int Partition(int p, int r)
+{ struct Entry *x;
+  int i = p-1;
+  int j = r+1;
+  int k = p + (random() % (r-p+1));
+  x = EntryArray[k];
+  EntryArray[k] = EntryArray[p];
+  EntryArray[p] = x;
+  while (TRUE)
+    { struct Entry *e;
+      do j--; while (EntryCompare(EntryArray[j],x)>0);
+      do i++; while (EntryCompare(EntryArray[i],x)<0);
+      if (i<j)
+	{ e = EntryArray[i];
+	  EntryArray[i] = EntryArray[j];
+	  EntryArray[j] = e;
+	}
+      else 
+	return(j);
+    }
+}
+
+void QuickSortEntries(int p, int r)
+{ int q;
   if (p<r)
     { q = Partition(p,r);
       QuickSortEntries(p,q);
       QuickSortEntries(q+1,r);
     }
-}     
+}     
+
+/* *** SORTING BY KEYS *** */
+/* With --sort-by, entries are sorted by a list of keys instead of by
+   tag alone.  The keys of each entry are normalized (case and LaTeX
+   accents folded, years made four digits) and laid end to end in one
+   byte string, so that comparing two entries is comparing two strings:
+   a byte saying whether the entry is a crossref target (those go
+   last), then each key followed by a byte 1, which sorts before any
+   character a key can contain.  The strings are then sorted with a
+   stable most-significant-digit radix sort.
+ */
+#define SORTBYTAG    1
+#define SORTBYYEAR   2
+#define SORTBYAUTHOR 3
+#define SORTBYTYPE   4
+#define SORTBYTITLE  5
+#define RADIXCUTOFF  32          /* ranges this small: insertion sort */
+
+struct SortItem
+{
+  unsigned char *Key;            /* composite key of entry */
+  struct Entry  *Entry;
+};
+
+/* SetSortKeys(list): set the sort keys from --sort-by=list */
+void SetSortKeys(char *list)
+{ static char *names[] = { "tag", "year", "author", "type", "title", NULL };
+  int i, n;
+  NumberOfSortKeys = 0;
+  while (*list)
+    { n = strcspn(list,",");
+      for (i=0;names[i]!=NULL;i++)
+	if (strncasecmp(list,names[i],n) == 0 && names[i][n] == 0)
+	  break;
+      if (names[i] == NULL || NumberOfSortKeys >= MAXSORTKEYS)
+	{ fprintf(MessageFile,"\nBibtag: Bad --sort-by key: %.*s\n",n,list);
+	  exit(0);
+	}
+      SortKeys[NumberOfSortKeys++] = i+1;
+      list += n;
+      if (*list == ',') list++;
+    }
+}
+
+/* PutSortText(b,p): append the text p, case folded, to key buffer b */
+void PutSortText(struct OutputBuffer *b, char *p)
+{ for (;*p;p++)
+    if ((unsigned char)*p > 1)
+      BufferPutc(b,ToLower(*p));
+}
+
+/* PutSortKey(b,e,key): append the normalized key of e to buffer b */
+void PutSortKey(struct OutputBuffer *b, struct Entry *e, int key)
+{ char AuthorName[MAXAUTHORS][STRINGSIZE];
+  char token[STRINGSIZE];
+  char *v;
+  long year;
+  switch (key)
+    { 
+    case SORTBYTAG:
+      PutSortText(b,e->EntryTag);
+      break;
+    case SORTBYTYPE:
+      PutSortText(b,e->EntryType+1);
+      break;
+    case SORTBYYEAR:
+      v = GetExpandedValue(e,"year");
+      while (v != NULL && *v && !IsDigit(*v)) v++;
+      if (v == NULL || *v == 0)
+	BufferPuts(b,"~~~~");    /* no year: after all years */
+      else
+	{ year = atol(v);
+	  if (year > 9999) year = 9999;
+	  sprintf(token,"%04ld",year);
+	  BufferPuts(b,token);
+	}
+      break;
+    case SORTBYAUTHOR:
+      if (GetAuthorNames(e,AuthorName) > 0)
+	PutSortText(b,AuthorName[0]);
+      break;
+    case SORTBYTITLE:
+      v = GetExpandedValue(e,"title");
+      if (v == NULL) break;
+      ScanToken(v+1,token);
+      while (token[0] != 0)
+	{ PutSortText(b,token);
+	  BufferPutc(b,' ');
+	  ScanToken(NULL,token);
+	}
+      break;
+    }
+  BufferPutc(b,1);
+}
+
+/* RadixSortItems(a,aux,n,depth): sort a[0..n-1], whose keys agree
+ *                   before byte depth, stably by their keys; aux is
+ *                   scratch space for n items.
+ */
+void RadixSortItems(struct SortItem *a, struct SortItem *aux, int n, int depth)
+{ int count[257];
+  struct SortItem x;
+  int i, j, c;
+  if (n < RADIXCUTOFF)
+    { for (i=1;i<n;i++)
+	{ x = a[i];
+	  for (j=i;j>0 && strcmp((char *)a[j-1].Key+depth,
+				 (char *)x.Key+depth) > 0;j--)
+	    a[j] = a[j-1];
+	  a[j] = x;
+	}
+      return;
+    }
+  memset(count,0,sizeof(count));
+  for (i=0;i<n;i++)
+    count[a[i].Key[depth]+1]++;
+  for (c=1;c<257;c++)
+    count[c] += count[c-1];
+  for (i=0;i<n;i++)
+    aux[count[a[i].Key[depth]]++] = a[i];
+  memcpy(a,aux,n*sizeof(struct SortItem));
+  /* count[c] is now where bucket c+1 starts; bucket 0 (keys that have
+     ended) is done */
+  for (c=1;c<256;c++)
+    if (count[c]-count[c-1] > 1)
+      RadixSortItems(a+count[c-1],aux,count[c]-count[c-1],depth+1);
+}
+
+/* PutEntrySortKey(b,e): append the composite key of e to buffer b */
+void PutEntrySortKey(struct OutputBuffer *b, struct Entry *e)
+{ int k;
+  BufferPutc(b,e->IsCrossRef ? 2 : 1);
+  for (k=0;k<NumberOfSortKeys;k++)
+    PutSortKey(b,e,SortKeys[k]);
+}
+
+/* SortEntriesByKeys: sort EntryArray by the --sort-by keys */
+void SortEntriesByKeys()
+{ struct OutputBuffer b;
+  struct SortItem *items, *aux;
+  size_t *start;
+  int i;
+  memset(&b,0,sizeof(b));
+  start = (size_t *)mymalloc((NumberOfEntries+1)*sizeof(size_t));
+  for (i=0;i<NumberOfEntries;i++)
+    { start[i] = b.Length;
+      PutEntrySortKey(&b,EntryArray[i]);
+      BufferPutc(&b,0);
+    }
+  items = (struct SortItem *)
+    mymalloc((NumberOfEntries+1)*sizeof(struct SortItem));
+  aux = (struct SortItem *)
+    mymalloc((NumberOfEntries+1)*sizeof(struct SortItem));
+  for (i=0;i<NumberOfEntries;i++)
+    { items[i].Key = (unsigned char *)b.Text + start[i];
+      items[i].Entry = EntryArray[i];
+    }
+  RadixSortItems(items,aux,NumberOfEntries,0);
+  for (i=0;i<NumberOfEntries;i++)
+    EntryArray[i] = items[i].Entry;
+  free(items);
+  free(aux);
+  free(start);
+  free(b.Text);
+}
+
+void SortEntries()
+{ int p,r;
+  if (SortSwitch && NumberOfSortKeys > 0)
+    SortEntriesByKeys();
+  else if (SortSwitch)
+    QuickSortEntries(0,NumberOfEntries-1);
+}
+
+/* OptionArgument(arg,name): If arg is the long option name, followed by
+ *                   "=value", return the value; if it is just the name,
+ *                   return the empty string; otherwise return NULL.
+ */
+char *OptionArgument(char *arg, char *name)
+{ int n = strlen(name);
+  if (strncmp(arg,name,n) != 0) return(NULL);
+  if (arg[n] == '=') return(arg+n+1);
+  if (arg[n] == 0)   return(arg+n);
+  return(NULL);
+}
+
+/* *** EXTERNAL SORTING *** */
+/* With --memory-budget=n, bibtag keeps at most about n bytes of entries
+   in memory.  When more than that has been read, the entries read so
+   far are finished early: the tag options (those after the input files)
+   are carried out on them, their tags replaced, and the entries sorted
+   and printed into a temporary "run" file, as records holding the sort
+   key and the printed text; then they are freed.  At the end the runs
+   are merged into the output.  An entry whose crossref target has not
+   been read yet is held back (and so is kept in memory) until it has,
+   so that its tag can use the target's fields; and the @string
+   definitions and the @preamble are always kept.
+ */
+#define MAXMERGERUNS 128         /* runs merged at once */
+#define RUNBUFFERSIZE (1<<20)    /* stdio buffer for each run file */
+size_t ResidentBytes = 0;        /* estimated size of entries in memory */
+size_t SpillThreshold = 0;       /* write entries out above this size */
+long   EntriesRead = 0;          /* entries read so far */
+int  SpilledEntries = 0;         /* number of entries written to runs */
+int  ChunksSpilled = 0;          /* times entries have been written out */
+FILE **Runs = NULL;              /* the run files, in the order written */
+int  NumberOfRuns = 0;
+int  RunsSize = 0;
+char **ReplayArgv;               /* command line ... */
+int  ReplayArgc;
+int  *ReplayOptions = NULL;      /* ... and indices of its tag options */
+int  NumberOfReplayOptions = 0;
+
+/* The settings of the tag options, which the options replayed on a group
+   of entries must start from, as they did on the command line. */
+PERWORKER struct TagParameters
+{
+  int UseHyphens;
+  int FirstAuthorNameLengthBound, SecondAuthorNameLengthBound, AuthorBound;
+  int FirstTitleWordLengthBound, SecondTitleWordLengthBound;
+  int TitleWordCountBound;
+  int CheckDigitsWanted, YearDigitsWanted;
+  int LegacyCheckDigits;
+} ReplayParameters;              /* as they were when the input was read */
+
+int  ExecuteOption(int argc, char *argv[], int i);
+void ReplaceTags();
+
+/* EntryBytes(e): estimate of the memory taken by entry e */
+size_t EntryBytes(struct Entry *e)
+{ size_t n = sizeof(struct Entry) + e->EntrySize*sizeof(struct Attribute);
+  int i;
+#define STRINGBYTES(s) ((s) != NULL ? strlen(s) + 17 : 0)
+  n += STRINGBYTES(e->InitialComments) + STRINGBYTES(e->EntryType) +
+    STRINGBYTES(e->EntryTag);
+  for (i=0;i<e->EntrySize;i++)
+    n += STRINGBYTES(e->Attributes[i].Name) +
+      STRINGBYTES(e->Attributes[i].Value);
+#undef STRINGBYTES
+  return(n);
+}
+
+/* GetTagParameters(p), SetTagParameters(p): save the settings of the
+ *                   tag options in p, or restore them from p.
+ */
+void GetTagParameters(struct TagParameters *p)
+{
+  p->UseHyphens = UseHyphens;
+  p->FirstAuthorNameLengthBound = FirstAuthorNameLengthBound;
+  p->SecondAuthorNameLengthBound = SecondAuthorNameLengthBound;
+  p->AuthorBound = AuthorBound;
+  p->FirstTitleWordLengthBound = FirstTitleWordLengthBound;
+  p->SecondTitleWordLengthBound = SecondTitleWordLengthBound;
+  p->TitleWordCountBound = TitleWordCountBound;
+  p->CheckDigitsWanted = CheckDigitsWanted;
+  p->YearDigitsWanted = YearDigitsWanted;
+  p->LegacyCheckDigits = LegacyCheckDigits;
+}
+
+void SetTagParameters(struct TagParameters *p)
+{
+  UseHyphens = p->UseHyphens;
+  FirstAuthorNameLengthBound = p->FirstAuthorNameLengthBound;
+  SecondAuthorNameLengthBound = p->SecondAuthorNameLengthBound;
+  AuthorBound = p->AuthorBound;
+  FirstTitleWordLengthBound = p->FirstTitleWordLengthBound;
+  SecondTitleWordLengthBound = p->SecondTitleWordLengthBound;
+  TitleWordCountBound = p->TitleWordCountBound;
+  CheckDigitsWanted = p->CheckDigitsWanted;
+  YearDigitsWanted = p->YearDigitsWanted;
+  LegacyCheckDigits = p->LegacyCheckDigits;
+}
+
+/* CollectReplayOptions(argc,argv,option): check that the command line
+ *                   can be carried out in pieces, as option requires,
+ *                   and note the options after the input files, which
+ *                   are to be carried out on each piece.  Returns the
+ *                   number of input files.
+ */
+int CollectReplayOptions(int argc, char *argv[], char *option)
+{ int  i, first = -1, last = -1, files = 0;
+  for (i=1;i<argc;i++)
+    { if (argv[i][0] != '-')
+	{ if (first < 0) first = i;
+	  last = i;
+	  files++;
+	}
+      else if (tolower(argv[i][1]) == 'o' && argv[i][2] == 0)
+	i++;
+      else if (OptionArgument(argv[i],"--save-snapshot") != NULL ||
+	       OptionArgument(argv[i],"--load-snapshot") != NULL ||
+	       OptionArgument(argv[i],"--patch") != NULL ||
+	       OptionArgument(argv[i],"--shard-by") != NULL ||
+	       OptionArgument(argv[i],"--duplicates") != NULL ||
+	       OptionArgument(argv[i],"--lazy") != NULL)
+	{ fprintf(MessageFile,
+		  "\nBibtag: %s cannot be used with %s\n",argv[i],option);
+	  exit(0);
+	}
+    }
+  for (i=first;i>0 && i<=last;i++)
+    if (argv[i][0] == '-')
+      { fprintf(MessageFile,"\nBibtag: With %s, options must come "
+		"before or after all the input files, not between them\n",
+		option);
+	exit(0);
+      }
+  ReplayArgc = argc;
+  ReplayArgv = argv;
+  ReplayOptions = (int *)mymalloc(argc*sizeof(int));
+  for (i=last+1;i>0 && i<argc;i++)
+    { if (tolower(argv[i][1]) == 'o' && argv[i][2] == 0)
+	i++;
+      else if (tolower(argv[i][1]) != 'o' && tolower(argv[i][1]) != 'j' &&
+	       tolower(argv[i][1]) != 'h' &&
+	       OptionArgument(argv[i],"--memory-budget") == NULL &&
+	       OptionArgument(argv[i],"--watch") == NULL &&
+	       strncmp(argv[i],"--select-",9) != 0)
+	ReplayOptions[NumberOfReplayOptions++] = i;
+    }
+  return(files);
+}
+
+/* IsReplayOption(i): True if argv[i] is one of the replayed options */
+int IsReplayOption(int i)
+{ int k;
+  for (k=0;k<NumberOfReplayOptions;k++)
+    if (ReplayOptions[k] == i) return(TRUE);
+  return(FALSE);
+}
+
+/* SetMemoryBudget(argc,argv): if there is a --memory-budget option,
+ *                   check that the command line can be done within a
+ *                   budget, and note which options are to be carried
+ *                   out on each group of entries written out early.
+ */
+void SetMemoryBudget(int argc, char *argv[])
+{ char *v = NULL, *end;
+  int  i;
+  for (i=1;i<argc;i++)
+    if (OptionArgument(argv[i],"--memory-budget") != NULL)
+      v = OptionArgument(argv[i],"--memory-budget");
+  if (v == NULL)
+    return;
+  MemoryBudget = strtoull(v,&end,10);
+  if (*end == 'k' || *end == 'K') MemoryBudget <<= 10;
+  else if (*end == 'm' || *end == 'M') MemoryBudget <<= 20;
+  else if (*end == 'g' || *end == 'G') MemoryBudget <<= 30;
+  if (MemoryBudget < (1<<20))
+    { fprintf(MessageFile,"\nBibtag: --memory-budget must be at least 1M\n");
+      exit(0);
+    }
+  SpillThreshold = MemoryBudget;
+  CollectReplayOptions(argc,argv,"--memory-budget");
+}
+
+/* NewRunFile: open a new, anonymous, temporary file for a run */
+FILE *NewRunFile()
+{ char *dir = getenv("TMPDIR");
+  char *name;
+  FILE *f = NULL;
+  int  fd;
+  if (dir == NULL || *dir == 0) dir = "/tmp";
+  name = mymalloc(strlen(dir)+24);
+  sprintf(name,"%s/bibtag-run-XXXXXX",dir);
+  fd = mkstemp(name);
+  if (fd >= 0)
+    { unlink(name);
+      f = fdopen(fd,"w+");
+    }
+  if (f == NULL)
+    { fprintf(MessageFile,"\nBibtag: Cannot make a temporary file in %s\n",
+	      dir);
+      exit(0);
+    }
+  free(name);
+  setvbuf(f,NULL,_IOFBF,RUNBUFFERSIZE);
+  return(f);
+}
+
+/* PutRecord(f,key,keylen,text,textlen): write a record to run file f */
+void PutRecord(FILE *f, char *key, uint32_t keylen, char *text,
+	       uint32_t textlen)
+{ uint32_t lengths[2];
+  lengths[0] = keylen;
+  lengths[1] = textlen;
+  if (fwrite(lengths,sizeof(lengths),1,f) != 1 ||
+      fwrite(key,1,keylen,f) != keylen ||
+      fwrite(text,1,textlen,f) != textlen)
+    { fprintf(MessageFile,"\nBibtag: Temporary file write error\n");
+      exit(0);
+    }
+}
+
+/* AddRun(f): add run file f, now complete, to the end of Runs */
+void AddRun(FILE *f)
+{ if (fflush(f) != 0 || ferror(f))
+    { fprintf(MessageFile,"\nBibtag: Temporary file write error\n");
+      exit(0);
+    }
+  rewind(f);
+  if (NumberOfRuns >= RunsSize)
+    { RunsSize = RunsSize ? 2*RunsSize : 64;
+      Runs = (FILE **)realloc(Runs,RunsSize*sizeof(FILE *));
+      if (Runs == NULL)
+	{ fprintf(MessageFile,"\nMemory allocation failure.\n");
+	  exit(0);
+	}
+    }
+  Runs[NumberOfRuns++] = f;
+}
+
+/* FreeEntry(e): free entry e, which has been written to a run (or,
+ *               with --watch, replaced by its file being read again)
+ */
+void FreeEntry(struct Entry *e)
+{ int i;
+  if (e->NewEntryTag != NULL)
+    { /* (it may be the value of the newtag attribute) */
+      for (i=0;i<e->EntrySize && e->Attributes[i].Value!=e->NewEntryTag;i++) ;
+      if (i == e->EntrySize)
+	free(e->NewEntryTag);
+    }
+  if (RewriteCitesDir != NULL && (e->Modified & MODIFIEDTAG))
+    e->EntryTag = NULL;          /* still needed as a new tag in Renames */
+  free(e->BaseTag);
+  if (e->Formatted != NULL)
+    { free(e->Formatted->Tag);
+      free(e->Formatted->OldTag);
+      free(e->Formatted);
+    }
+  FreeEntryStrings(e);
+  free(e->Attributes);
+  free(e);
+}
+
+/* SequenceCompare(a,b): compare entries by position in the input */
+int SequenceCompare(const void *a, const void *b)
+{ long x = (*(struct Entry **)a)->Sequence;
+  long y = (*(struct Entry **)b)->Sequence;
+  return((x > y) - (x < y));
+}
+
+/* SpillEntries(early): write the entries in memory to a new run, and
+ *                   free them.  If early, the tag options are carried
+ *                   out on them first, and entries waiting for their
+ *                   crossref target are kept back.
+ */
+void SpillEntries(int early)
+{ struct Entry **chunk, **all, *e;
+  struct OutputBuffer key, text;
+  int  i, k, n, kept, all_n;
+  FILE *f;
+  if (early)
+    LinkCrossReferences(FALSE);
+  chunk = (struct Entry **)mymalloc((NumberOfEntries+1)*sizeof(struct Entry *));
+  n = kept = 0;
+  for (i=0;i<NumberOfEntries;i++)
+    { e = EntryArray[i];
+      if (early && e->CrossRef == NULL && GetValue(e,"crossref") != NULL)
+	EntryArray[kept++] = e;  /* target still to come */
+      else
+	chunk[n++] = e;
+    }
+  if (n == 0)
+    { free(chunk);
+      return;
+    }
+  /* Work on the chunk as if it were the whole database */
+  all = EntryArray;
+  all_n = kept;
+  EntryArray = chunk;
+  NumberOfEntries = n;
+  if (early)
+    { SetTagParameters(&ReplayParameters);
+      for (i=0;i<NumberOfReplayOptions;i++)
+	ExecuteOption(ReplayArgc,ReplayArgv,ReplayOptions[i]);
+      FinishSelection();
+      ReplaceTags();
+    }
+  if (SortSwitch)
+    SortEntries();
+  else
+    qsort(EntryArray,NumberOfEntries,sizeof(struct Entry *),SequenceCompare);
+  f = NewRunFile();
+  memset(&key,0,sizeof(key));
+  memset(&text,0,sizeof(text));
+  for (i=0;i<NumberOfEntries;i++)
+    { e = EntryArray[i];
+      key.Length = text.Length = 0;
+      if (!SortSwitch)
+	{ /* keep the input order, held entries included */
+	  for (k=56;k>=0;k-=8)
+	    BufferPutc(&key,(e->Sequence >> k) & 0xff);
+	}
+      else if (NumberOfSortKeys > 0)
+	PutEntrySortKey(&key,e);
+      else
+	{ BufferPutc(&key,e->IsCrossRef ? 2 : 1);
+	  BufferPuts(&key,e->EntryTag);
+	}
+      FormatEntry(e,&text);
+      PutRecord(f,key.Text,key.Length,text.Text,text.Length);
+    }
+  AddRun(f);
+  free(key.Text);
+  free(text.Text);
+  SpilledEntries += NumberOfEntries;
+  ChunksSpilled++;
+  for (i=0;i<NumberOfEntries;i++)
+    FreeEntry(EntryArray[i]);
+  free(chunk);
+  EntryArray = all;
+  NumberOfEntries = all_n;
+  ResidentBytes = 0;
+  for (i=0;i<NumberOfEntries;i++)
+    ResidentBytes += EntryBytes(EntryArray[i]);
+  /* If much is held back, wait for more before writing out again */
+  SpillThreshold = MemoryBudget;
+  if (SpillThreshold < 2*ResidentBytes)
+    SpillThreshold = 2*ResidentBytes;
+}
+
+/* A run being merged, and its current record */
+struct RunCursor
+{
+  FILE   *File;
+  int    Run;                    /* position in Runs, to keep merges stable */
+  struct OutputBuffer Key, Text;
+};
+
+/* ReadRecord(c): read the next record of c; False at end of run */
+int ReadRecord(struct RunCursor *c)
+{ uint32_t lengths[2];
+  if (fread(lengths,sizeof(lengths),1,c->File) != 1)
+    return(FALSE);
+  c->Key.Length = c->Text.Length = 0;
+  BufferReserve(&c->Key,lengths[0]);
+  BufferReserve(&c->Text,lengths[1]);
+  if (fread(c->Key.Text,1,lengths[0],c->File) != lengths[0] ||
+      fread(c->Text.Text,1,lengths[1],c->File) != lengths[1])
+    { fprintf(MessageFile,"\nBibtag: Temporary file read error\n");
+      exit(0);
+    }
+  c->Key.Length = lengths[0];
+  c->Text.Length = lengths[1];
+  return(TRUE);
+}
+
+/* CursorBefore(a,b): True if the record of a goes before that of b */
+int CursorBefore(struct RunCursor *a, struct RunCursor *b)
+{ size_t n = a->Key.Length < b->Key.Length ? a->Key.Length : b->Key.Length;
+  int r = memcmp(a->Key.Text,b->Key.Text,n);
+  if (r == 0 && a->Key.Length != b->Key.Length)
+    r = (a->Key.Length < b->Key.Length) ? -1 : 1;
+  return(r < 0 || (r == 0 && a->Run < b->Run));
+}
+
+/* SiftDown(heap,n,i): restore the heap order below heap[i] */
+void SiftDown(struct RunCursor **heap, int n, int i)
+{ struct RunCursor *x = heap[i];
+  int c;
+  while ((c = 2*i+1) < n)
+    { if (c+1 < n && CursorBefore(heap[c+1],heap[c])) c++;
+      if (!CursorBefore(heap[c],x)) break;
+      heap[i] = heap[c];
+      i = c;
+    }
+  heap[i] = x;
+}
+
+/* MergeRuns(runs,n,out,records): merge the n runs into file out, as
+ *                   records if records is True (for a later merge),
+ *                   and as printed text otherwise.  Closes the runs.
+ */
+void MergeRuns(FILE **runs, int n, FILE *out, int records)
+{ struct RunCursor *cursors, **heap;
+  int i, h = 0;
+  cursors = (struct RunCursor *)mymalloc(n*sizeof(struct RunCursor));
+  heap = (struct RunCursor **)mymalloc(n*sizeof(struct RunCursor *));
+  memset(cursors,0,n*sizeof(struct RunCursor));
+  for (i=0;i<n;i++)
+    { cursors[i].File = runs[i];
+      cursors[i].Run = i;
+      if (ReadRecord(&cursors[i]))
+	heap[h++] = &cursors[i];
+    }
+  for (i=h/2-1;i>=0;i--)
+    SiftDown(heap,h,i);
+  while (h > 0)
+    { if (records)
+	PutRecord(out,heap[0]->Key.Text,heap[0]->Key.Length,
+		  heap[0]->Text.Text,heap[0]->Text.Length);
+      else
+	fwrite(heap[0]->Text.Text,1,heap[0]->Text.Length,out);
+      if (!ReadRecord(heap[0]))
+	heap[0] = heap[--h];
+      if (h > 0)
+	SiftDown(heap,h,0);
+    }
+  for (i=0;i<n;i++)
+    { fclose(cursors[i].File);
+      free(cursors[i].Key.Text);
+      free(cursors[i].Text.Text);
+    }
+  free(cursors);
+  free(heap);
+}
+
+/* PrintRuns: print the entries of all the runs, in order */
+void PrintRuns()
+{ FILE *f;
+  while (NumberOfRuns > MAXMERGERUNS)
+    { /* merge the first runs into one, so as not to run out of files */
+      f = NewRunFile();
+      MergeRuns(Runs,MAXMERGERUNS,f,TRUE);
+      AddRun(f);
+      NumberOfRuns--;
+      Runs[0] = Runs[NumberOfRuns];
+      memmove(Runs+1,Runs+MAXMERGERUNS,
+	      (NumberOfRuns-MAXMERGERUNS)*sizeof(FILE *));
+      NumberOfRuns -= MAXMERGERUNS-1;
+    }
+  MergeRuns(Runs,NumberOfRuns,OutputFile,FALSE);
+  NumberOfRuns = 0;
+}
+
+/* ExecuteOption(argc,argv,i): carry out the option argv[i] on the
+ *                   entries read so far.  Returns the index of the
+ *                   last argument used (-o may take the next one).
+ */
+int ExecuteOption(int argc, char *argv[], int i)
+{ int j,k;
+  char c1, c2;
+  struct Entry *e;
+  char *v;
+  if (strncmp(argv[i],"--select-",9) != 0)
+    FinishSelection();
+  c1 = tolower(argv[i][1]);
+  c2 = tolower(argv[i][2]);
+  if (argv[i][1]=='-' && argv[i][2]!=0)
+    { /* long option */
+      if ((v = OptionArgument(argv[i],"--save-snapshot")) != NULL)
+	SaveSnapshot(v);
+      else if ((v = OptionArgument(argv[i],"--load-snapshot")) != NULL)
+	LoadSnapshot(v);
+      else if (OptionArgument(argv[i],"--patch") != NULL)
+	PatchMode = TRUE;
+      else if (OptionArgument(argv[i],"--memory-budget") != NULL)
+	;                        /* see SetMemoryBudget */
+      else if (OptionArgument(argv[i],"--watch") != NULL)
+	;                        /* see SetWatchMode */
+      else if (OptionArgument(argv[i],"--pipeline") != NULL)
+	;                        /* see ParseAndExecuteCommandLine */
+      else if (OptionArgument(argv[i],"--registry") != NULL)
+	;                        /* see ParseAndExecuteCommandLine */
+      else if (OptionArgument(argv[i],"--lazy") != NULL)
+	;                        /* see ParseAndExecuteCommandLine */
+      else if (OptionArgument(argv[i],"--shard-by") != NULL ||
+	       OptionArgument(argv[i],"--shard-index") != NULL)
+	;                        /* see SetShardMode */
+      else if (OptionArgument(argv[i],"--duplicates") != NULL)
+	;                        /* see SetDuplicatePolicy */
+      else if (OptionArgument(argv[i],"--diagnostics") != NULL ||
+	       OptionArgument(argv[i],"--diagnostics-report") != NULL)
+	;                        /* see SetDiagnostics */
+      else if (OptionArgument(argv[i],"--legacy-check-digits") != NULL)
+	LegacyCheckDigits = TRUE;
+      else if (OptionArgument(argv[i],"--quiet") != NULL)
+	{ Quiet = TRUE;
+	  ReportTagChanges = FALSE;
+	}
+      else if ((v = OptionArgument(argv[i],"--tag-map")) != NULL && *v)
+	{ /* (--memory-budget carries it out again for each run) */
+	  if (TagMapFile == NULL)
+	    { TagMapFileName = v;
+	      TagMapFile = OpenOutputFile(v);
+	      if (TagMapFile == NULL)
+		{ fprintf(MessageFile,"\nBibtag: Cannot write tag map %s\n",v);
+		  exit(0);
+		}
+	      setvbuf(TagMapFile,NULL,_IOFBF,1<<16);
+	    }
+	}
+      else if (OptionArgument(argv[i],"--stopwords") != NULL ||
+	       OptionArgument(argv[i],"--name-prefixes") != NULL)
+	;                        /* see SetWordLists */
+      else if (OptionArgument(argv[i],"--batch") != NULL ||
+	       OptionArgument(argv[i],"--batch-out") != NULL)
+	;                        /* see SetBatchMode */
+      else if ((v = OptionArgument(argv[i],"--sort-by")) != NULL)
+	{ SetSortKeys(v);
+	  SortSwitch = TRUE;
+	}
+      else if ((v = OptionArgument(argv[i],"--rewrite-cites")) != NULL &&
+	       *v)
+	RewriteCitesDir = v;
+      else if ((v = OptionArgument(argv[i],"--select-year")) != NULL &&
+	       *v)
+	AddSelection(SELECTYEAR,v);
+      else if ((v = OptionArgument(argv[i],"--select-type")) != NULL &&
+	       *v)
+	AddSelection(SELECTTYPE,v);
+      else if ((v = OptionArgument(argv[i],"--select-author")) != NULL &&
+	       *v)
+	AddSelection(SELECTAUTHOR,v);
+      else if ((v = OptionArgument(argv[i],"--select-tag-prefix")) != NULL &&
+	       *v)
+	AddSelection(SELECTTAGPREFIX,v);
+      else if ((v = OptionArgument(argv[i],"--select-has")) != NULL &&
+	       *v)
+	AddSelection(SELECTHAS,v);
+      else
+	fprintf(MessageFile,"\nBibtag: Illegal option: %s",argv[i]);
+    }
+  else if (c1=='o')
+    { /* Set output file name */
+      if (argv[i][2]!=0)
+	strcpy(OutputFileName,argv[i]+2);
+      else
+	{ 
+	  i++;
+	  if (i<argc)
+	    strcpy(OutputFileName,argv[i]);
+	  else
+	    {
+	      fprintf(MessageFile,
+		      "\nBibtag: No file name given for -o option.");
+	      exit(0);
+	    }
+	}
+      /* Now open the output file (with --watch, each time it is written;
+	 with --shard-by, never) */
+      if (OutputFileName[0] && !WatchMode && !ShardBy)
+	{
+	  OutputFile = OpenOutputFile(OutputFileName);
+	  if (OutputFile == NULL) 
+	    { fprintf(MessageFile,
+		      "\nBibtag: Output file open error: %s",
+		      OutputFileName); 
+	      exit(0); 
+	    }
+	}
+    }
+  else if (c1=='n')
+    {
+      SortSwitch = FALSE;
+    }
+  else if (c1=='j')
+    { /* number of threads used to format the output */
+      if (c2!=0)
+	OutputThreads = atoi(argv[i]+2);
+      else
+	OutputThreads = sysconf(_SC_NPROCESSORS_ONLN);
+      if (OutputThreads<1) OutputThreads = 1;
+      if (OutputThreads>64) OutputThreads = 64;
+    }
+  else if (c1=='s')
+    {
+      SaveOldTags = TRUE;
+    }
+  else if (c1=='i')
+    { /* set indentation level for attributes and values */
+      AttributeIndent=atoi(argv[i]+2);
+      if (AttributeIndent<0) AttributeIndent = 0;
+      if (AttributeIndent>20) AttributeIndent= 20;
+      j = 0;
+      while (argv[i][j] && argv[i][j]!=',') j++;
+      if (argv[i][j]==',')
+	{ /* set indentation level for values */
+	  ValueIndent=atoi(argv[i]+j+1);
+	  if (ValueIndent<0) ValueIndent = 0;
+	  if (ValueIndent>40) ValueIndent= 40;
+	}
+    }
+  else if (c1=='b' || c1 == 'q')
+    { /* Use braces for value delimiters on output */
+      int OldLeftValueDelimiter, OldRightValueDelimiter;
+      if (c1 == 'b')
+	{ LeftValueDelimiter = '{';
+	  RightValueDelimiter = '}';
+	  OldLeftValueDelimiter = '"';
+	  OldRightValueDelimiter = '"';
+	}
+      else if (c1 == 'q')
+	{ LeftValueDelimiter = '"';
+	  RightValueDelimiter = '"';
+	  OldLeftValueDelimiter = '{';
+	  OldRightValueDelimiter = '}';
+	}
+      for (k=0;k<NumberOfEntries;k++)
+	{ e = EntryArray[k];
+	  for (j=1;j<e->EntrySize;j++)
+	    if (e->Attributes[j].Value[0] == OldLeftValueDelimiter &&
+		e->Attributes[j].Value[strlen(e->Attributes[j].Value)-1] ==
+		OldRightValueDelimiter)
+	      { e->Attributes[j].Value[0] = LeftValueDelimiter;
+		e->Attributes[j].Value[strlen(e->Attributes[j].Value)-1] =
+		  RightValueDelimiter;
+		if (LeftValueDelimiter != OldLeftValueDelimiter)
+		  e->Modified |= MODIFIEDFIELDS;
+	      }
+	}
+    }
+  else if (c1=='=')
+    { /* compact equals sign '=' instead of ' = ' on output */
+      CompactEqualsSign = TRUE;
+    }
+  else if (c1=='a') 
+    { /* author portion of tag field */
+      if (argv[i][2]!=0)
+	FirstAuthorNameLengthBound = atoi(argv[i]+2);
+      j = 0;
+      while (argv[i][j]!=0&&argv[i][j]!=',') j++;
+      if (argv[i][j] == ',')
+	{ j++;
+	  SecondAuthorNameLengthBound = atoi(argv[i]+j);
+	  while (argv[i][j]!=0&&argv[i][j]!=',') j++;
+	  if (argv[i][j] == ',')
+	    AuthorBound = atoi(argv[i]+j+1);
+	}
+      for (k=0;k<NumberOfEntries;k++)
+	AppendAuthorInfoToNewEntryTag(EntryArray[k]);
+    }
+  else if (c1=='t') 
+    { /* title portion of tag field */
+      if (argv[i][2]!=0)
+	FirstTitleWordLengthBound = atoi(argv[i]+2);
+      j = 0;
+      while (argv[i][j]!=0&&argv[i][j]!=',') j++;
+      if (argv[i][j] == ',')
+	{ j++;
+	  SecondTitleWordLengthBound = atoi(argv[i]+j);
+	  while (argv[i][j]!=0&&argv[i][j]!=',') j++;
+	  if (argv[i][j] == ',')
+	    TitleWordCountBound = atoi(argv[i]+j+1);
+	}
+      for (k=0;k<NumberOfEntries;k++)
+	AppendTitleToNewEntryTag(EntryArray[k]);
+    }
+  else if (c1=='c')
+    { /* check digits */
+      CheckDigitsWanted = 1; /* default */
+      if (c2!=0)
+	CheckDigitsWanted = atoi(argv[i]+2);
+      for (k=0;k<NumberOfEntries;k++)
+	AppendCheckDigitsToNewEntryTag(EntryArray[k]);
+    }
+  else if (c1=='-')
+    { /* Clear hyphen switch */
+      UseHyphens = FALSE;
+    }
+  else if (c1=='y')
+    { /* year */
+      if (c2!=0)
+	YearDigitsWanted = atoi(argv[i]+2);
+      if (YearDigitsWanted<0) YearDigitsWanted = 0;
+      if (YearDigitsWanted>4) YearDigitsWanted = 4;
+      for (k=0;k<NumberOfEntries;k++)
+	AppendYearToNewEntryTag(EntryArray[k]);
+    }
+  else if (c1=='e')
+    {
+      for (k=0;k<NumberOfEntries;k++)
+	AppendOldExtensionsToNewEntryTag(EntryArray[k]);
+    }
+  else if (c1 == 'l')
+    {
+      for (k=0;k<NumberOfEntries;k++)
+	{ struct Entry *e = EntryArray[k];
+	  if (e->NewEntryTag != NULL)
+	    { strcpy(NewEntryTag,e->NewEntryTag);
+	      free(e->NewEntryTag);
+	    }
+	  else
+	    NewEntryTag[0] = 0;
+	  strcat(NewEntryTag,argv[i]+2);
+	  e->NewEntryTag = strdup(NewEntryTag);
+	}
+    }
+  else if (c1 == 'p')
+    {
+      for (k=0;k<NumberOfEntries;k++)
+	{ struct Entry *e = EntryArray[k];
+	  if (e->NewEntryTag != NULL)
+	    { strcpy(NewEntryTag,e->NewEntryTag);
+	      free(e->NewEntryTag);
+	    }
+	  else
+	    NewEntryTag[0] = 0;
+	  strcat(NewEntryTag,e->EntryTag);
+	  e->NewEntryTag = strdup(NewEntryTag);
+	}
+    }
+  else if (c1 == 'u')
+    { struct UniqueTables *t = NULL;
+      if (MemoryBudget)
+	t = UniqueTablesOf(i);   /* (with the tags of earlier chunks) */
+      else
+	ClearUniqueTags();
+      if (t != NULL)
+	{ HashTable = t->Tags;
+	  UniqueCounters = t->Counters;
+	}
+      LockRegistry();
+      if (!MakeNewEntryTagsUniqueInParallel())
+	for (k=0;k<NumberOfEntries;k++)
+	  AppendExtensionToMakeNewEntryTagUnique(EntryArray[k]);
+      UnlockRegistry();
+      if (t != NULL)
+	{ t->Tags = HashTable;
+	  t->Counters = UniqueCounters;
+	  memset(&HashTable,0,sizeof(HashTable));
+	  memset(&UniqueCounters,0,sizeof(UniqueCounters));
+	}
+    }
+  else
+    { /* Illegal option */
+      fprintf(MessageFile,"\nBibtag: Illegal option: %s",argv[i]);
+    }
+  return(i);
+}
+
+void SetWatchMode(int argc, char *argv[]);
+void SetBatchMode(int argc, char *argv[]);
+void SetShardMode(int argc, char *argv[]);
+int  IsBatchSetting(char *arg);
+
+/* Parse command line arguments */
+void ParseAndExecuteCommandLine(argc,argv)
+int argc;
+char *argv[];
+{ int i;
+  char *v;
+  InitialText = strdup("");
+  Preamble = NULL;
+  NumberOfStrings = 0;
+  NumberOfEntries = 0;
+  SetMemoryBudget(argc,argv);
+  SetWatchMode(argc,argv);
+  SetBatchMode(argc,argv);
+  SetShardMode(argc,argv);
+  SetDuplicatePolicy(argc,argv);
+  for (i=1;i<argc;i++)
+    if (OptionArgument(argv[i],"--pipeline") != NULL)
+      Pipeline = TRUE;           /* (before any file is opened) */
+    else if ((v = OptionArgument(argv[i],"--registry")) != NULL && *v)
+      RegistryFileName = v;
+    else if (OptionArgument(argv[i],"--lazy") != NULL)
+      LazyParsing = TRUE;        /* (before any file is read) */
+  SetWordLists(argc,argv);
+  SetDiagnostics(argc,argv);
+  if (argc==2 && argv[1][0]=='-' && tolower(argv[1][1]=='h'))
+    { /* -h or -help option */
+      PrintUsage(); 
+      exit(0);
+    }
+  if (argc == 1)
+    { /* no input file name given */
+      InputFile = stdin;
+      ReadDataBase();
+      ResolveCrossReferences();
+    }
+  for (i=1;i<argc;i++)
+    {
+      if (BatchMode && (argv[i][0]!='-' || !IsBatchSetting(argv[i])))
+	;                        /* see RunBatch */
+      else if (argv[i][0]!='-')
+	{ 
+	  /* process an input file name */
+	  GetTagParameters(&ReplayParameters);
+	  ReadInputFile(argv[i]);
+	}
+      else if (WatchMode && IsReplayOption(i))
+	;                        /* see WatchInputFiles */
+      else
+	i = ExecuteOption(argc,argv,i);
+    }
+}
+
+/* *** REWRITING CITATIONS *** */
+/* With --rewrite-cites=dir, every tag that is replaced is also replaced
+   in the citations of the .tex and .aux files under directory dir.  All
+   the old tags go into one Aho-Corasick automaton, so each file is
+   scanned once however many tags have changed; only the arguments of
+   \cite-like commands (\cite, \citep, \nocite, \parencite, \citation,
+   \bibcite, ...) are looked at, and only whole keys are replaced.  The
+   files are done by -j threads, each written to a temporary file that
+   is then renamed over the original.
+
+   The automaton's states are the prefixes of the old tags, numbered in
+   breadth-first order, so the edges out of each state can be kept
+   together, sorted, in one array.  Bytes that occur in no tag all map
+   to character class 0, which no edge uses; the others get classes in
+   byte order.
+ */
+struct Rename
+{
+  char *Old;                     /* tag as it was */
+  char *New;                     /* tag as it is now */
+} *Renames = NULL;
+int  NumberOfRenames = 0;
+int  RenamesSize = 0;
+
+struct CiteAutomaton
+{
+  unsigned char Class[256];      /* character class of each byte */
+  int  *FirstEdge;               /* edges out of state s are FirstEdge[s] */
+  int  *EdgeCount;               /*   .. FirstEdge[s]+EdgeCount[s]-1 */
+  unsigned char *EdgeClass;      /* class labelling each edge */
+  int  *EdgeTarget;              /* state each edge goes to */
+  int  *Fail;                    /* longest proper suffix that is a state */
+  int  *Depth;                   /* length of the prefix */
+  int  *Match;                   /* Renames index of tag ending here, or
+				    -1, or -2 if ambiguous */
+  int  NumberOfStates;
+} CiteAutomaton;
+
+/* AddRename(old,new): record that tag old has been replaced by new. */
+void AddRename(char *old, char *new)
+{ if (NumberOfRenames >= RenamesSize)
+    { RenamesSize = RenamesSize ? 2*RenamesSize : 256;
+      Renames = (struct Rename *)realloc(Renames,
+					  RenamesSize*sizeof(struct Rename));
+      if (Renames == NULL)
+	{ fprintf(MessageFile,"\nBibtag: Out of memory!\n");
+	  exit(0);
+	}
+    }
+  Renames[NumberOfRenames].Old = old;
+  Renames[NumberOfRenames].New = new;
+  NumberOfRenames++;
+}
+
+int RenameCompare(const void *a, const void *b)
+{ return(strcmp(((struct Rename *)a)->Old,((struct Rename *)b)->Old));
+}
+
+/* CiteGoto(s,c): state reached from s by an edge of class c, or -1 */
+int CiteGoto(int s, int c)
+{ struct CiteAutomaton *a = &CiteAutomaton;
+  int lo = a->FirstEdge[s], hi = lo + a->EdgeCount[s] - 1, mid;
+  while (lo <= hi)
+    { mid = (lo+hi)/2;
+      if (a->EdgeClass[mid] == c) return(a->EdgeTarget[mid]);
+      if (a->EdgeClass[mid] < c) lo = mid+1;
+      else hi = mid-1;
+    }
+  return(-1);
+}
+
+/* CiteStep(s,ch): the state after state s reads character ch */
+int CiteStep(int s, int ch)
+{ int c = CiteAutomaton.Class[(unsigned char)ch];
+  int t;
+  if (c == 0) return(0);
+  while ((t = CiteGoto(s,c)) < 0 && s != 0)
+    s = CiteAutomaton.Fail[s];
+  return(t < 0 ? 0 : t);
+}
+
+/* BuildCiteAutomaton: build the automaton for the (sorted) Renames. */
+void BuildCiteAutomaton()
+{ struct CiteAutomaton *a = &CiteAutomaton;
+  int *lo, *hi;                  /* Renames range below each state */
+  int i, j, k, n, s, t, f, c, classes, edges;
+  qsort(Renames,NumberOfRenames,sizeof(struct Rename),RenameCompare);
+  memset(a->Class,0,sizeof(a->Class));
+  n = 1;
+  for (i=0;i<NumberOfRenames;i++)
+    for (j=0;Renames[i].Old[j];j++)
+      a->Class[(unsigned char)Renames[i].Old[j]] = 1;
+  for (c=0,classes=0;c<256;c++)
+    if (a->Class[c]) a->Class[c] = ++classes;
+  for (i=0;i<NumberOfRenames;i++)
+    n += strlen(Renames[i].Old);
+  a->FirstEdge = (int *)mymalloc(n*sizeof(int));
+  a->EdgeCount = (int *)mymalloc(n*sizeof(int));
+  a->EdgeClass = (unsigned char *)mymalloc(n);
+  a->EdgeTarget = (int *)mymalloc(n*sizeof(int));
+  a->Fail = (int *)mymalloc(n*sizeof(int));
+  a->Depth = (int *)mymalloc(n*sizeof(int));
+  a->Match = (int *)mymalloc(n*sizeof(int));
+  lo = (int *)mymalloc(n*sizeof(int));
+  hi = (int *)mymalloc(n*sizeof(int));
+  /* The trie: the tags below state s are Renames[lo[s]..hi[s]-1], and
+     its children split that range by the character at Depth[s] */
+  lo[0] = 0;
+  hi[0] = NumberOfRenames;
+  a->Depth[0] = 0;
+  a->NumberOfStates = 1;
+  edges = 0;
+  for (s=0;s<a->NumberOfStates;s++)
+    { a->Match[s] = -1;
+      a->FirstEdge[s] = edges;
+      i = lo[s];
+      while (i < hi[s] && Renames[i].Old[a->Depth[s]] == 0)
+	{ /* a tag ends here */
+	  if (a->Match[s] == -1)
+	    a->Match[s] = i;
+	  else if (a->Match[s] >= 0 &&
+		   strcmp(Renames[a->Match[s]].New,Renames[i].New) != 0)
+	    { fprintf(MessageFile,
+		      "Bibtag: %s has been given several new tags; "
+		      "its citations are left alone!\n",Renames[i].Old);
+	      a->Match[s] = -2;
+	    }
+	  i++;
+	}
+      while (i < hi[s])
+	{ c = (unsigned char)Renames[i].Old[a->Depth[s]];
+	  for (j=i;j<hi[s] && Renames[j].Old[a->Depth[s]]==c;j++) ;
+	  t = a->NumberOfStates++;
+	  lo[t] = i;
+	  hi[t] = j;
+	  a->Depth[t] = a->Depth[s]+1;
+	  a->EdgeClass[edges] = a->Class[c];
+	  a->EdgeTarget[edges] = t;
+	  edges++;
+	  i = j;
+	}
+      a->EdgeCount[s] = edges - a->FirstEdge[s];
+    }
+  free(lo);
+  free(hi);
+  /* Failure links, in breadth-first order */
+  a->Fail[0] = 0;
+  for (s=0;s<a->NumberOfStates;s++)
+    for (k=a->FirstEdge[s];k<a->FirstEdge[s]+a->EdgeCount[s];k++)
+      { t = a->EdgeTarget[k];
+	if (s == 0)
+	  a->Fail[t] = 0;
+	else
+	  { f = a->Fail[s];
+	    while ((i = CiteGoto(f,a->EdgeClass[k])) < 0 && f != 0)
+	      f = a->Fail[f];
+	    a->Fail[t] = (i >= 0) ? i : 0;
+	  }
+      }
+}
+
+/* IsCiteCommand(p,n): True if the n-letter command name at p is one
+ *                     whose arguments are citation keys.
+ */
+int IsCiteCommand(char *p, int n)
+{ int i;
+  if (n == 8 && strncmp(p,"citation",8) == 0)
+    return(TRUE);                /* in .aux files */
+  for (i=0;i+4<=n;i++)
+    if (strncasecmp(p+i,"cite",4) == 0)
+      return(TRUE);
+  return(FALSE);
+}
+
+/* RewriteCitesInText(t,n,b): copy the n characters at t into buffer b,
+ *                   replacing old tags in citations with new ones.
+ *                   Returns the number of keys replaced.
+ */
+int RewriteCitesInText(char *t, size_t n, struct OutputBuffer *b)
+{ struct CiteAutomaton *a = &CiteAutomaton;
+  size_t i, j, k, last = 0, start;
+  int    s, count = 0, more;
+  i = 0;
+  while (i < n)
+    { if (t[i] != '\\')
+	{ i++;
+	  continue;
+	}
+      for (j=i+1;j<n && (IsAlpha(t[j]) || t[j]=='@');j++) ;
+      if (!IsCiteCommand(t+i+1,j-i-1))
+	{ i = (j > i+1) ? j : i+2;
+	  continue;
+	}
+      /* \citexxx*[..][..]{keys}; \cites takes several [..]{keys} */
+      more = (j-i-1 >= 5 && strncasecmp(t+j-5,"cites",5) == 0);
+      k = j;
+      if (k < n && t[k] == '*') k++;
+      do
+	{ while (TRUE)
+	    { while (k < n && IsSpace(t[k])) k++;
+	      if (k >= n || t[k] != '[') break;
+	      while (k < n && t[k] != ']') k++;
+	      k++;
+	    }
+	  if (k >= n || t[k] != '{')
+	    break;
+	  s = 0;
+	  start = ++k;
+	  for (;k<n && t[k]!='{';k++)
+	    if (t[k] == ',' || t[k] == '}' || IsSpace(t[k]))
+	      { if (a->Match[s] >= 0 && (size_t)a->Depth[s] == k-start && k > start)
+		  { /* a whole old tag: replace it */
+		    BufferReserve(b,start-last);
+		    memcpy(b->Text+b->Length,t+last,start-last);
+		    b->Length += start-last;
+		    BufferPuts(b,Renames[a->Match[s]].New);
+		    last = k;
+		    count++;
+		  }
+		s = 0;
+		start = k+1;
+		if (t[k] == '}') break;
+	      }
+	    else
+	      s = CiteStep(s,t[k]);
+	  if (k >= n || t[k] != '}')
+	    break;                 /* not a plain list of keys */
+	  k++;
+	}
+      while (more);
+      i = k;
+    }
+  BufferReserve(b,n-last);
+  memcpy(b->Text+b->Length,t+last,n-last);
+  b->Length += n-last;
+  return(count);
+}
+
+/* RewriteCitesInFile(name): rewrite the citations in file name.
+ *                   Returns the number of keys replaced, or -1 if the
+ *                   file could not be rewritten.
+ */
+int RewriteCitesInFile(char *name)
+{ struct OutputBuffer b;
+  struct stat st;
+  char   *text, *tmpname;
+  int    fd, out, count, ok;
+  fd = open(name,O_RDONLY);
+  if (fd < 0 || fstat(fd,&st) != 0)
+    { if (fd >= 0) close(fd);
+      return(-1);
+    }
+  if (st.st_size == 0)
+    { close(fd);
+      return(0);
+    }
+  text = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+  close(fd);
+  if (text == MAP_FAILED)
+    return(-1);
+  memset(&b,0,sizeof(b));
+  count = RewriteCitesInText(text,st.st_size,&b);
+  munmap(text,st.st_size);
+  if (count > 0)
+    { tmpname = mymalloc(strlen(name)+16);
+      sprintf(tmpname,"%s.bibtag-XXXXXX",name);
+      out = mkstemp(tmpname);
+      ok = (out >= 0);
+      if (ok) ok = (write(out,b.Text,b.Length) == (ssize_t)b.Length);
+      if (ok) ok = (fchmod(out,st.st_mode & 07777) == 0);
+      if (ok) ok = (fsync(out) == 0);
+      if (out >= 0 && close(out) != 0) ok = FALSE;
+      if (ok) ok = (rename(tmpname,name) == 0);
+      if (!ok)
+	{ if (out >= 0) unlink(tmpname);
+	  count = -1;
+	}
+      free(tmpname);
+    }
+  free(b.Text);
+  return(count);
+}
+
+/* The files to do, found by CollectCiteFile, and what became of each */
+char **CiteFiles = NULL;
+int  *CiteCounts = NULL;
+int  NumberOfCiteFiles = 0;
+int  CiteFilesSize = 0;
+int  NextCiteFile = 0;           /* next one for a thread to take */
+
+int CollectCiteFile(const char *name, const struct stat *st, int type,
+		    struct FTW *ftw)
+{ int n = strlen(name);
+  (void)ftw;                     /* (nftw's, not needed here) */
+  if (type != FTW_F || !S_ISREG(st->st_mode) || n < 4 ||
+      (strcmp(name+n-4,".tex") != 0 && strcmp(name+n-4,".aux") != 0))
+    return(0);
+  if (NumberOfCiteFiles >= CiteFilesSize)
+    { CiteFilesSize = CiteFilesSize ? 2*CiteFilesSize : 64;
+      CiteFiles = (char **)realloc(CiteFiles,CiteFilesSize*sizeof(char *));
+      if (CiteFiles == NULL)
+	{ fprintf(MessageFile,"\nBibtag: Out of memory!\n");
+	  exit(0);
+	}
+    }
+  CiteFiles[NumberOfCiteFiles++] = strdup(name);
+  return(0);
+}
+
+void *RewriteCitesThread(void *arg)
+{ int i;
+  (void)arg;
+  while ((i = __sync_fetch_and_add(&NextCiteFile,1)) < NumberOfCiteFiles)
+    CiteCounts[i] = RewriteCitesInFile(CiteFiles[i]);
+  return(NULL);
+}
+
+/* RewriteCitations(dir): replace the old tags recorded in Renames by
+ *                        the new ones in the .tex and .aux files under
+ *                        directory dir.
+ */
+void RewriteCitations(char *dir)
+{ pthread_t threads[64];
+  int i, n, total = 0;
+  if (nftw(dir,CollectCiteFile,32,FTW_PHYS) != 0)
+    { fprintf(MessageFile,"\nBibtag: Cannot read directory %s\n",dir);
+      exit(0);
+    }
+  if (NumberOfRenames == 0 || NumberOfCiteFiles == 0)
+    return;
+  BuildCiteAutomaton();
+  CiteCounts = (int *)mymalloc(NumberOfCiteFiles*sizeof(int));
+  n = (OutputThreads > 1) ? OutputThreads : sysconf(_SC_NPROCESSORS_ONLN);
+  if (n > NumberOfCiteFiles) n = NumberOfCiteFiles;
+  if (n > 64) n = 64;
+  if (n < 1) n = 1;
+  for (i=1;i<n;i++)
+    if (pthread_create(&threads[i],NULL,RewriteCitesThread,NULL) != 0)
+      break;
+  n = i;
+  RewriteCitesThread(NULL);
+  for (i=1;i<n;i++)
+    pthread_join(threads[i],NULL);
+  for (i=0;i<NumberOfCiteFiles;i++)
+    { if (CiteCounts[i] < 0)
+	fprintf(MessageFile,"Bibtag: %s could not be rewritten!\n",
+		CiteFiles[i]);
+      else if (CiteCounts[i] > 0)
+	{ fprintf(MessageFile,"Bibtag: %s: %d citations rewritten\n",
+		  CiteFiles[i],CiteCounts[i]);
+	  total += CiteCounts[i];
+	}
+      free(CiteFiles[i]);
+    }
+  fprintf(MessageFile,"Bibtag: %d citations rewritten in %d files\n",
+	  total,NumberOfCiteFiles);
+  free(CiteFiles);
+  free(CiteCounts);
+}
+
+
+void ReplaceTags()
+{
+  struct Entry *e;
+  int k;
+  char *v;
+  { /* Replace tags in output file with newly computed ones */
+    if (SaveOldTags)
+      { /* save old tag in attribute "oldtag" 
+	   when new tag is different 
+	   */
+	for (k=0;k<NumberOfEntries;k++)
+	  { e = EntryArray[k];
+	    MakeDefaultNewEntryTag(e);
+	    if (strcmp(e->NewEntryTag,e->EntryTag)!=0)
+	      { 
+		if (e->Attributes[0].Name != NULL) 
+		  FreeString(e->Attributes[0].Name);
+		e->Attributes[0].Name = strdup("oldtag");
+		if (e->Attributes[0].Value != NULL) 
+		  FreeString(e->Attributes[0].Value);
+		e->Attributes[0].Value = mymalloc(strlen(e->EntryTag)+3);
+		e->Attributes[0].Value[0]=LeftValueDelimiter;
+		e->Attributes[0].Value[1]=0;
+		strcat(e->Attributes[0].Value,e->EntryTag);
+		e->Attributes[0].Value[strlen(e->EntryTag)+1]=
+		  RightValueDelimiter;
+		e->Attributes[0].Value[strlen(e->EntryTag)+2]=0;
+		e->Modified |= MODIFIEDFIELDS;
+	      }
+	  }
+      }
+    /* Now actually replace the old tag with the new one */
+    /* Don't change tags of cross-ref targets */
+    /* newtag overrides computed tag */
+    for (k=0;k<NumberOfEntries;k++)
+      { e = EntryArray[k];
+	v = GetValue(e,"newtag");
+	if (v != NULL)
+	  {
+	    if (e->NewEntryTag != NULL) 
+	      free(e->NewEntryTag);
+	    e->NewEntryTag = v;
+	    if (v[0] == '"' || v[0] == '{' )
+	      { /* strip off surrounding braces or quotes */
+		memmove(v,v+1,strlen(v));   /* (they overlap) */
+		if (strlen(v)>0)
+		  v[strlen(v)-1]=0;
+	      }
+	  }
+	if (e->IsCrossRef == 0 && 
+	    e->NewEntryTag != NULL &&
+	    strcmp(e->EntryTag,e->NewEntryTag) != 0)
+	  { /* print old and new tags out if they are different */
+	    if (ReportTagChanges)
+	      fprintf(MessageFile,
+		      "Bibtag: %s ==> %s\n",
+		      e->EntryTag,
+		      e->NewEntryTag);
+	    if (TagMapFile != NULL)
+	      fprintf(TagMapFile,"%s\t%s\n",e->EntryTag,e->NewEntryTag);
+	    /* now actually do replacement */
+	    v = e->EntryTag;
+	    e->EntryTag = strdup(e->NewEntryTag);
+	    if (RewriteCitesDir != NULL)
+	      AddRename(v,e->EntryTag);    /* keeps the old tag */
+	    else if (!WatchMode)
+	      FreeString(v);               /* (--watch puts it back) */
+	    e->Modified |= MODIFIEDTAG;
+	  }
+      }
+  }
+}
+
+/* *** PATCHING INPUT FILES *** */
+/* With --patch the database is not printed.  Instead each input file is
+   rewritten in place, touching only the entries that have changed: the
+   text between them and the unchanged entries are copied byte for byte
+   (by the kernel, with copy_file_range, where the file system allows),
+   an entry whose only change is its tag gets the new tag spliced into
+   its original text, and other changed entries are printed as usual.
+   The new file is written under a temporary name and renamed over the
+   old one, so a reader sees either the old file or the new one.
+ */
+/* CopyRange(in,out,from,to): append bytes from..to-1 of file in to file
+ *                            out.  Returns FALSE on error.
+ */
+int CopyRange(int in, int out, off_t from, off_t to)
+{ char buffer[65536];
+  ssize_t n;
+  while (from < to)
+    { n = copy_file_range(in,&from,out,NULL,to-from,0);
+      if (n > 0) continue;
+      if (n == 0) return(FALSE);
+      if (errno != EXDEV && errno != ENOSYS && errno != EOPNOTSUPP &&
+	  errno != EINVAL)
+	return(FALSE);
+      /* No kernel copy between these two files; do it by hand */
+      while (from < to)
+	{ n = (to-from < (off_t)sizeof(buffer)) ? to-from : (off_t)sizeof(buffer);
+	  n = pread(in,buffer,n,from);
+	  if (n <= 0 || write(out,buffer,n) != n)
+	    return(FALSE);
+	  from += n;
+	}
+    }
+  return(TRUE);
+}
+
+int SourceStartCompare(const void *a, const void *b)
+{ off_t s1 = (*(struct Entry **)a)->SourceStart;
+  off_t s2 = (*(struct Entry **)b)->SourceStart;
+  return((s1 > s2) - (s1 < s2));
+}
+
+/* OldTagLength(in,e): length of the tag as written in the source text of
+ *                     e, or -1 if the text there is not a plain tag
+ *                     followed by a comma.
+ */
+int OldTagLength(int in, struct Entry *e)
+{ char text[STRINGSIZE];
+  int n, k, m;
+  n = pread(in,text,sizeof(text),e->TagStart);
+  for (k=0;k<n;k++)
+    if (IsSpace(text[k]) || text[k]==',' || text[k]=='{' || text[k]=='}')
+      break;
+  if (k == 0 || k == n) return(-1);
+  for (m=k;m<n && IsSpace(text[m]);m++) ;
+  if (m == n || text[m] != ',') return(-1);
+  return(k);
+}
+
+/* PatchSourceFile(f,changed,n): rewrite source file f, whose changed
+ *                   entries are changed[0..n-1].  Returns FALSE, leaving
+ *                   the file as it was, on any problem.
+ */
+int PatchSourceFile(int f, struct Entry **changed, int n)
+{ struct SourceFile *src = &SourceFiles[f];
+  static struct OutputBuffer b;
+  struct stat st;
+  char   *tmpname;
+  off_t  pos;
+  int    in, out, k, ok, len;
+  struct Entry *e;
+  unsigned char magic[4];
+  in = open(src->Name,O_RDONLY);
+  if (in < 0) return(FALSE);
+  if (Compression(magic,pread(in,magic,sizeof(magic),0)) != NOTCOMPRESSED)
+    { fprintf(MessageFile,
+	      "Bibtag: %s is compressed; only plain files can be patched!\n",
+	      src->Name);
+      close(in);
+      return(FALSE);
+    }
+  if (fstat(in,&st) != 0 || st.st_size != src->Size ||
+      st.st_mtim.tv_sec != src->MTime.tv_sec ||
+      st.st_mtim.tv_nsec != src->MTime.tv_nsec)
+    { fprintf(MessageFile,"Bibtag: %s has changed since it was read!\n",
+	      src->Name);
+      close(in);
+      return(FALSE);
+    }
+  tmpname = mymalloc(strlen(src->Name)+16);
+  sprintf(tmpname,"%s.bibtag-XXXXXX",src->Name);
+  out = mkstemp(tmpname);
+  if (out < 0)
+    { free(tmpname);
+      close(in);
+      return(FALSE);
+    }
+  qsort(changed,n,sizeof(struct Entry *),SourceStartCompare);
+  ok = TRUE;
+  pos = 0;
+  for (k=0;k<n && ok;k++)
+    { e = changed[k];
+      if (e->SourceStart < pos || e->SourceEnd < e->SourceStart ||
+	  e->SourceEnd > st.st_size)
+	{ ok = FALSE;
+	  break;
+	}
+      ok = CopyRange(in,out,pos,e->SourceStart);
+      len = -1;
+      if (ok && e->Modified == MODIFIEDTAG && e->TagStart > e->SourceStart)
+	len = OldTagLength(in,e);
+      if (!ok)
+	;
+      else if (len > 0)
+	{ /* splice the new tag into the old text */
+	  b.Length = 0;
+	  BufferPuts(&b,e->EntryTag);
+	  ok = CopyRange(in,out,e->SourceStart,e->TagStart) &&
+	    write(out,b.Text,b.Length) == (ssize_t)b.Length &&
+	    CopyRange(in,out,e->TagStart+len,e->SourceEnd);
+	}
+      else
+	{ /* print the entry, less the text before it, which was copied */
+	  b.Length = 0;
+	  FormatEntry(e,&b);
+	  len = strlen(e->InitialComments);
+	  ok = write(out,b.Text+len,b.Length-len) == (ssize_t)(b.Length-len);
+	}
+      pos = e->SourceEnd;
+    }
+  if (ok) ok = CopyRange(in,out,pos,st.st_size);
+  close(in);
+  if (ok) ok = (fchmod(out,st.st_mode & 07777) == 0);
+  if (ok) ok = (fsync(out) == 0);
+  if (close(out) != 0) ok = FALSE;
+  if (ok) ok = (rename(tmpname,src->Name) == 0);
+  if (!ok) unlink(tmpname);
+  free(tmpname);
+  return(ok);
+}
+
+/* PatchDataBase: rewrite the input files that have changed entries. */
+void PatchDataBase()
+{ struct Entry **changed;
+  int f, k, n;
+  for (k=0;k<NumberOfEntries;k++)
+    if (EntryArray[k]->Modified && EntryArray[k]->SourceIndex < 0)
+      { fprintf(MessageFile,
+		"\nBibtag: --patch can only rewrite input files given by name!\n");
+	exit(0);
+      }
+  changed = (struct Entry **)mymalloc((NumberOfEntries+1)*sizeof(struct Entry *));
+  for (f=0;f<NumberOfSourceFiles;f++)
+    { n = 0;
+      for (k=0;k<NumberOfEntries;k++)
+	if (EntryArray[k]->SourceIndex == f && EntryArray[k]->Modified)
+	  changed[n++] = EntryArray[k];
+      if (n == 0)
+	continue;
+      if (PatchSourceFile(f,changed,n))
+	fprintf(MessageFile,"Bibtag: patched %s (%d entries rewritten)\n",
+		SourceFiles[f].Name,n);
+      else
+	fprintf(MessageFile,"Bibtag: %s could not be patched and is unchanged!\n",
+		SourceFiles[f].Name);
+    }
+  free(changed);
+}
+
+/* *** PARALLEL OUTPUT *** */
+/* With -j, the sorted entries are formatted in rounds: each of the
+   OutputThreads threads formats a batch of consecutive entries into
+   its own buffer, and the buffers of a round are written out in order
+   by one writev while the threads are already formatting the next
+   round.  The output is the same as when entries are printed one by one.
+ */
+#define FORMATBATCH 256          /* entries formatted by a thread at once */
+
+struct FormatJob
+{
+  struct Entry **Entries;        /* first entry of the batch */
+  int    Count;                  /* number of entries in the batch */
+  struct OutputBuffer Buffer;    /* their formatted text */
+  pthread_t Thread;
+  int    Running;                /* True while Thread has to be joined */
+};
+
+void *FormatJobThread(void *arg)
+{ struct FormatJob *job = (struct FormatJob *)arg;
+  int i;
+  job->Buffer.Length = 0;
+  for (i=0;i<job->Count;i++)
+    FormatEntry(job->Entries[i],&job->Buffer);
+  return(NULL);
+}
+
+/* StartFormatRound(jobs,first,n): start formatting entries first..n-1
+ *                    of EntryArray, at most one batch per job; returns
+ *                    the index of the first entry not covered.
+ */
+int StartFormatRound(struct FormatJob *jobs, int first, int n)
+{ int t;
+  for (t=0;t<OutputThreads;t++)
+    { jobs[t].Entries = EntryArray + first;
+      jobs[t].Count = (n-first < FORMATBATCH) ? n-first : FORMATBATCH;
+      first += jobs[t].Count;
+      jobs[t].Running = FALSE;
+      if (jobs[t].Count > 0)
+	{ if (pthread_create(&jobs[t].Thread,NULL,FormatJobThread,&jobs[t])==0)
+	    jobs[t].Running = TRUE;
+	  else
+	    FormatJobThread(&jobs[t]);  /* no thread; do it right here */
+	}
+    }
+  return(first);
+}
+
+/* PrintEntriesInParallel: print all regular entries, formatted by
+ *                         OutputThreads threads.
+ */
+void PrintEntriesInParallel()
+{ struct FormatJob *jobs[2];
+  struct OutputBuffer **bufs;
+  int    next, round, t, n;
+  jobs[0] = (struct FormatJob *)mymalloc(2*OutputThreads*sizeof(struct FormatJob));
+  jobs[1] = jobs[0] + OutputThreads;
+  memset(jobs[0],0,2*OutputThreads*sizeof(struct FormatJob));
+  bufs = (struct OutputBuffer **)mymalloc(OutputThreads*sizeof(struct OutputBuffer *));
+  round = 0;
+  next = StartFormatRound(jobs[0],0,NumberOfEntries);
+  while (TRUE)
+    { struct FormatJob *job = jobs[round];
+      for (t=0;t<OutputThreads;t++)
+	if (job[t].Running)
+	  { pthread_join(job[t].Thread,NULL);
+	    job[t].Running = FALSE;
+	  }
+      /* Format the next round while this one is being written */
+      if (next < NumberOfEntries)
+	next = StartFormatRound(jobs[1-round],next,NumberOfEntries);
+      for (n=0,t=0;t<OutputThreads;t++)
+	if (job[t].Count > 0)
+	  bufs[n++] = &job[t].Buffer;
+      if (n == 0) break;
+      WriteBuffers(bufs,n);
+      for (t=0;t<OutputThreads;t++)
+	job[t].Count = 0;
+      round = 1-round;
+    }
+  for (t=0;t<2*OutputThreads;t++)
+    free(jobs[0][t].Buffer.Text);
+  free(jobs[0]);
+  free(bufs);
+}
+
+/* *** SHARDED OUTPUT *** */
+/* With --shard-by, the sorted database is written into one file per
+   first letter of the tag, year, or entry type, instead of the output
+   file; each file is named after the output file, with "-" and its key
+   put in before the extension, and is written by a thread of its own.
+   The initial text, @preamble and @string entries are formatted once
+   and copied into every shard, so that each one can be used by itself.
+   With --shard-index, each shard also gets an index file, named after
+   it with ".idx" added, with a line "tag<TAB>offset<TAB>length" for each
+   of its entries, giving where the entry's text is in the shard (before
+   any compression).
+ */
+#define SHARDBUFFERSIZE (1<<20)  /* formatted text written at once */
+
+struct Shard
+{
+  char   *Key;                   /* eg "a", "1995" or "article" */
+  char   *Name;                  /* its output file */
+  struct Entry **Entries;        /* its entries, in sorted order */
+  int    Count;
+  int    Size;                   /* room in Entries */
+  pthread_t Thread;
+  int    Running;                /* True while Thread has to be joined */
+  int    Ok;                     /* False if it could not be written */
+};
+
+struct OutputBuffer ShardHeader; /* text that starts every shard */
+
+/* SetShardMode(argc,argv): take note of any --shard-by and
+ *                   --shard-index options, and check that the command
+ *                   line can be followed with them.
+ */
+void SetShardMode(int argc, char *argv[])
+{ char *v = NULL;
+  int  i, output = FALSE;
+  for (i=1;i<argc;i++)
+    if (OptionArgument(argv[i],"--shard-by") != NULL)
+      v = OptionArgument(argv[i],"--shard-by");
+    else if (OptionArgument(argv[i],"--shard-index") != NULL)
+      ShardIndex = TRUE;
+  if (v == NULL)
+    { if (ShardIndex)
+	{ fprintf(MessageFile,"\nBibtag: --shard-index needs --shard-by\n");
+	  exit(0);
+	}
+      return;
+    }
+  if (strcasecmp(v,"tag") == 0) ShardBy = SORTBYTAG;
+  else if (strcasecmp(v,"year") == 0) ShardBy = SORTBYYEAR;
+  else if (strcasecmp(v,"type") == 0) ShardBy = SORTBYTYPE;
+  else
+    { fprintf(MessageFile,"\nBibtag: Bad --shard-by key: %s\n",v);
+      exit(0);
+    }
+  for (i=1;i<argc;i++)
+    if (argv[i][0] == '-' && tolower(argv[i][1]) == 'o')
+      output = TRUE;
+    else if (OptionArgument(argv[i],"--patch") != NULL)
+      { fprintf(MessageFile,
+		"\nBibtag: %s cannot be used with --shard-by\n",argv[i]);
+	exit(0);
+      }
+  if (!output)
+    { fprintf(MessageFile,"\nBibtag: --shard-by needs an output file (-o)\n");
+      exit(0);
+    }
+}
+
+/* GetShardKey(e,key): put the shard key of entry e into key, which has
+ *                     room for STRINGSIZE characters.
+ */
+void GetShardKey(struct Entry *e, char *key)
+{ char *v = NULL;
+  int  n = 0;
+  switch (ShardBy)
+    { 
+    case SORTBYTAG:
+      v = e->EntryTag;
+      if (v != NULL && IsAlnum(*v))
+	key[n++] = ToLower(*v);
+      v = NULL;
+      break;
+    case SORTBYYEAR:
+      v = GetExpandedValue(e,"year");
+      while (v != NULL && *v && !IsDigit(*v)) v++;
+      break;
+    case SORTBYTYPE:
+      v = e->EntryType+1;
+      break;
+    }
+  /* (only letters and digits, which are safe in any file name) */
+  while (v != NULL && n < STRINGSIZE-1 &&
+	 (ShardBy == SORTBYYEAR ? IsDigit(*v) : IsAlnum(*v)))
+    { key[n++] = ToLower(*v);  /* (ToLower uses its argument twice) */
+      v++;
+    }
+  key[n] = 0;
+  if (n == 0)
+    strcpy(key,"other");
+}
+
+/* ShardFileName(key): the output file name, with "-key" put in before
+ *                     its extension.
+ */
+char *ShardFileName(char *key)
+{ char *name, *base, *dot;
+  size_t n;
+  base = strrchr(OutputFileName,'/');
+  base = (base != NULL) ? base+1 : OutputFileName;
+  dot = strchr(base,'.');
+  n = (dot != NULL) ? (size_t)(dot-OutputFileName) : strlen(OutputFileName);
+  name = mymalloc(strlen(OutputFileName)+strlen(key)+2);
+  sprintf(name,"%.*s-%s%s",(int)n,OutputFileName,key,OutputFileName+n);
+  return(name);
+}
+
+/* IndexFileName(name): the name of the index of shard file name: name
+ *                      with ".idx" added, before any .gz or .zst, so
+ *                      that the index is compressed as the shard is.
+ */
+char *IndexFileName(char *name)
+{ char *index;
+  int  n = strlen(name), k = n;
+  if (n > 3 && strcmp(name+n-3,".gz") == 0)
+    k = n-3;
+  else if (n > 4 && strcmp(name+n-4,".zst") == 0)
+    k = n-4;
+  index = mymalloc(n+5);
+  sprintf(index,"%.*s.idx%s",k,name,name+k);
+  return(index);
+}
+
+/* WriteShard(arg): thread writing a shard, and its index */
+void *WriteShard(void *arg)
+{ struct Shard *s = (struct Shard *)arg;
+  struct OutputBuffer b;
+  FILE   *f, *index = NULL;
+  char   *indexname;
+  size_t offset, start;
+  int    i;
+  s->Ok = FALSE;
+  if ((f = OpenOutputFile(s->Name)) == NULL)
+    return(NULL);
+  if (ShardIndex)
+    { indexname = IndexFileName(s->Name);
+      index = OpenOutputFile(indexname);
+      free(indexname);
+      if (index == NULL)
+	{ fclose(f);
+	  return(NULL);
+	}
+    }
+  memset(&b,0,sizeof(b));
+  BufferReserve(&b,SHARDBUFFERSIZE);
+  memcpy(b.Text,ShardHeader.Text,ShardHeader.Length);
+  b.Length = ShardHeader.Length;
+  offset = 0;                    /* of the start of b in the shard */
+  s->Ok = TRUE;
+  for (i=0;i<s->Count;i++)
+    { start = b.Length;
+      FormatEntry(s->Entries[i],&b);
+      if (index != NULL)
+	fprintf(index,"%s\t%lu\t%lu\n",s->Entries[i]->EntryTag,
+		(unsigned long)(offset+start),
+		(unsigned long)(b.Length-start));
+      if (b.Length >= SHARDBUFFERSIZE)
+	{ if (fwrite(b.Text,1,b.Length,f) != b.Length) s->Ok = FALSE;
+	  offset += b.Length;
+	  b.Length = 0;
+	}
+    }
+  BufferPutc(&b,'\n');
+  if (fwrite(b.Text,1,b.Length,f) != b.Length) s->Ok = FALSE;
+  free(b.Text);
+  if (fclose(f) != 0) s->Ok = FALSE;
+  if (index != NULL && fclose(index) != 0) s->Ok = FALSE;
+  return(NULL);
+}
+
+/* PrintShards: print the sorted database into its shards */
+void PrintShards()
+{ struct StringMap keys = { NULL, 0, 0, FALSE };
+  struct Shard *shards = NULL;
+  char   key[STRINGSIZE];
+  void   **v;
+  int    i, n = 0, size = 0;
+  ShardHeader.Length = 0;
+  if (InitialText != NULL)
+    BufferPuts(&ShardHeader,InitialText);
+  if (Preamble != NULL)
+    FormatEntry(Preamble,&ShardHeader);
+  for (i=0;i<NumberOfStrings;i++)
+    FormatEntry(StringArray[i],&ShardHeader);
+  for (i=0;i<NumberOfEntries;i++)
+    { GetShardKey(EntryArray[i],key);
+      if (StringMapLookup(&keys,key) == NULL)
+	{ if (n >= size)
+	    { size = size ? 2*size : 64;
+	      shards = (struct Shard *)realloc(shards,size*sizeof(struct Shard));
+	      if (shards == NULL)
+		{ fprintf(MessageFile,"\nMemory allocation failure.\n");
+		  exit(0);
+		}
+	    }
+	  memset(&shards[n],0,sizeof(struct Shard));
+	  shards[n].Key = strdup(key);
+	  shards[n].Name = ShardFileName(key);
+	  *StringMapInsert(&keys,shards[n].Key) = (void *)(intptr_t)(n+1);
+	  n++;
+	}
+      v = (void **)StringMapLookup(&keys,key);
+      AppendEntry(&shards[(intptr_t)v-1].Entries,
+		  &shards[(intptr_t)v-1].Count,
+		  &shards[(intptr_t)v-1].Size,EntryArray[i]);
+    }
+  for (i=0;i<n;i++)
+    if (pthread_create(&shards[i].Thread,NULL,WriteShard,&shards[i]) == 0)
+      shards[i].Running = TRUE;
+    else
+      WriteShard(&shards[i]);    /* no thread; do it right here */
+  for (i=0;i<n;i++)
+    { if (shards[i].Running)
+	pthread_join(shards[i].Thread,NULL);
+      if (!shards[i].Ok)
+	{ fprintf(MessageFile,"\nBibtag: Output write error: %s\n",
+		  shards[i].Name);
+	  exit(0);
+	}
+    }
+  if (!Quiet)
+    fprintf(MessageFile,"Bibtag: wrote %d shards\n",n);
+  for (i=0;i<n;i++)
+    { free(shards[i].Key);
+      free(shards[i].Name);
+      free(shards[i].Entries);
+    }
+  free(shards);
+  free(keys.Slots);
+}
+
+void PrintDataBase()
+{ int i;
+  FinishSelection();
+  ReplaceTags();
+  if (RewriteCitesDir != NULL)
+    RewriteCitations(RewriteCitesDir);
+  if (PatchMode)
+    { PatchDataBase();
+      return;
+    }
+  if (NumberOfRuns > 0)
+    SpillEntries(FALSE);       /* the last of them */
+  else
+    SortEntries();
+  if (ShardBy)
+    { PrintShards();
+      return;
+    }
+  if (InitialText != NULL)
+    fprintf(OutputFile,"%s",InitialText);
+  if (Preamble != NULL)
+    PrintEntry(Preamble);
+  for (i=0;i<NumberOfStrings;i++)
+    PrintEntry(StringArray[i]);
+  if (NumberOfRuns > 0)
+    PrintRuns();
+  else if (OutputThreads > 1 && !BatchMode)
+    PrintEntriesInParallel();    /* (with --batch, -j counts workers) */
+  else
+    for (i=0;i<NumberOfEntries;i++)
+      PrintEntry(EntryArray[i]);
+  fprintf(OutputFile,"\n");
+}
+
+/* *** WATCHING INPUT FILES *** */
+/* With --watch, bibtag writes the output file and then keeps running,
+   with the database in memory, waiting (by inotify) for the input files
+   to be written.  A file that changes is read again, and its entries
+   replace its old ones.  The tag options before the first -u are then
+   carried out on just the new entries and those whose crossref target
+   changed, since an entry's tag up to there depends on nothing else;
+   the result is kept as the entry's BaseTag.  The -u option and those
+   after it depend on all the entries, so they are carried out on the
+   whole database each time, starting from the base tags.  Then the tags
+   are replaced and the output written under a temporary name, which is
+   renamed over the output file, and finally the entries are put back as
+   they were read, ready for the next change.  A change that cannot be
+   followed this way (with --select, whose choices depend on all the
+   files, or when the @preamble goes away) makes bibtag start over.
+ */
+#define WATCHQUIET 20            /* milliseconds without events to wait
+				    for before reading changed files */
+#define WATCHBUFFERSIZE (1<<20)  /* stdio buffer for the output file */
+struct WatchedFile
+{
+  char *Base;                    /* last part of its name */
+  int  Directory;                /* inotify watch of its directory */
+  int  Changed;                  /* True if written since it was read */
+} WatchedFiles[MAXSOURCEFILES];  /* same index as in SourceFiles */
+int  NumberOfWatchedFiles = 0;
+char **WatchArgv;                /* command line, to start over with */
+int  FirstUniqueOption;          /* ReplayOptions index of the first -u */
+struct TagParameters BaseParameters;
+				 /* settings of the tag options at that -u */
+
+/* SetWatchMode(argc,argv): if there is a --watch option, check that
+ *                   the command line can be followed by watching.
+ */
+void SetWatchMode(int argc, char *argv[])
+{ int i, output = FALSE;
+  for (i=1;i<argc && OptionArgument(argv[i],"--watch") == NULL;i++) ;
+  if (i == argc)
+    return;
+#ifndef HAVE_SYS_INOTIFY_H
+  fprintf(MessageFile,"\nBibtag: --watch is not supported here\n");
+  exit(0);
+#endif
+  for (i=1;i<argc;i++)
+    if (argv[i][0] == '-' && tolower(argv[i][1]) == 'o')
+      output = TRUE;
+    else if (OptionArgument(argv[i],"--memory-budget") != NULL ||
+	     OptionArgument(argv[i],"--rewrite-cites") != NULL ||
+	     OptionArgument(argv[i],"--tag-map") != NULL ||
+	     OptionArgument(argv[i],"--registry") != NULL)
+      { fprintf(MessageFile,
+		"\nBibtag: %s cannot be used with --watch\n",argv[i]);
+	exit(0);
+      }
+  if (!output)
+    { fprintf(MessageFile,"\nBibtag: --watch needs an output file (-o)\n");
+      exit(0);
+    }
+  NumberOfWatchedFiles = CollectReplayOptions(argc,argv,"--watch");
+  if (NumberOfWatchedFiles == 0 || NumberOfWatchedFiles > MAXSOURCEFILES)
+    { fprintf(MessageFile,"\nBibtag: --watch needs from 1 to %d input files\n",
+	      MAXSOURCEFILES);
+      exit(0);
+    }
+  for (FirstUniqueOption=0;FirstUniqueOption<NumberOfReplayOptions;
+       FirstUniqueOption++)
+    if (tolower(argv[ReplayOptions[FirstUniqueOption]][1]) == 'u')
+      break;
+  WatchArgv = argv;
+  WatchMode = TRUE;
+}
 
-void SortEntries()
-{ int p,r;
-  if (SortSwitch)
-    QuickSortEntries(0,NumberOfEntries-1);
+/* StartOver(name,why): input file name has changed in a way that the
+ *                   database cannot follow, for the reason why; run
+ *                   bibtag again from the beginning.
+ */
+void StartOver(char *name, char *why)
+{
+  fprintf(MessageFile,"Bibtag: %s changed, and %s; starting over.\n",
+	  name,why);
+  execv("/proc/self/exe",WatchArgv);
+  fprintf(MessageFile,"\nBibtag: Cannot start over: %s\n",strerror(errno));
+  exit(0);
 }
 
-/* Parse command line arguments */
-void ParseAndExecuteCommandLine(argc,argv)
-int argc;
-char *argv[];
-{ int i,j,k;
-  char c1, c2;
+/* ComputeBaseTags(a,n): carry out the tag options before the first -u
+ *                   on the n entries of a, setting their BaseTags.
+ */
+void ComputeBaseTags(struct Entry **a, int n)
+{ struct Entry **all = EntryArray;
+  int all_n = NumberOfEntries, i;
+  for (i=0;i<n;i++)
+    { free(a[i]->NewEntryTag);
+      a[i]->NewEntryTag = NULL;
+    }
+  EntryArray = a;
+  NumberOfEntries = n;
+  SetTagParameters(&ReplayParameters);
+  for (i=0;i<FirstUniqueOption;i++)
+    ExecuteOption(ReplayArgc,ReplayArgv,ReplayOptions[i]);
+  GetTagParameters(&BaseParameters);
+  for (i=0;i<n;i++)
+    { free(a[i]->BaseTag);
+      a[i]->BaseTag = a[i]->NewEntryTag;
+      a[i]->NewEntryTag = NULL;
+    }
+  EntryArray = all;
+  NumberOfEntries = all_n;
+}
+
+/* SpliceEntries(a,n,size,source,fresh,nfresh,old): in the array *a of
+ *                   *n entries, in input order, with room for *size,
+ *                   replace the entries read from SourceFiles[source] by
+ *                   the nfresh entries of fresh.  The entries taken out
+ *                   are returned in a new array *old; returns their number.
+ */
+int SpliceEntries(struct Entry ***a, int *n, int *size, int source,
+		  struct Entry **fresh, int nfresh, struct Entry ***old)
+{ int f, l, m;
+  for (f=0;f<*n && (*a)[f]->SourceIndex < source;f++) ;
+  for (l=f;l<*n && (*a)[l]->SourceIndex == source;l++) ;
+  *old = (struct Entry **)mymalloc((l-f)*sizeof(struct Entry *));
+  memcpy(*old,*a+f,(l-f)*sizeof(struct Entry *));
+  m = *n - (l-f) + nfresh;
+  if (m > *size)
+    { *size = m;
+      *a = (struct Entry **)realloc(*a,m*sizeof(struct Entry *));
+      if (*a == NULL)
+	{ fprintf(MessageFile,"\nMemory allocation failure.\n");
+	  exit(0);
+	}
+    }
+  memmove(*a+f+nfresh,*a+l,(*n-l)*sizeof(struct Entry *));
+  memcpy(*a+f,fresh,nfresh*sizeof(struct Entry *));
+  *n = m;
+  return(l-f);
+}
+
+/* SameStrings(a,b,n): True if the @string entries a[0..n) and b[0..n)
+ *                     make the same definitions.
+ */
+int SameStrings(struct Entry **a, struct Entry **b, int n)
+{ int i;
+  for (i=0;i<n;i++)
+    if (a[i]->StringDef == NULL || b[i]->StringDef == NULL ?
+	a[i]->StringDef != b[i]->StringDef :
+	strcmp(a[i]->StringDef,b[i]->StringDef) != 0)
+      return(FALSE);
+  return(TRUE);
+}
+
+/* SameEntry(e,f): True if entries e and f were read the same (apart
+ *                 from the case of attribute names, which printing
+ *                 changes).
+ */
+int SameEntry(struct Entry *e, struct Entry *f)
+{ int i;
+  if (e->EntrySize != f->EntrySize ||
+      !SameString(e->EntryTag,f->EntryTag) ||
+      !SameString(e->EntryType,f->EntryType) ||
+      !SameString(e->InitialComments,f->InitialComments))
+    return(FALSE);
+  for (i=1;i<e->EntrySize;i++)
+    if (strcasecmp(e->Attributes[i].Name,f->Attributes[i].Name) != 0 ||
+	!SameString(e->Attributes[i].Value,f->Attributes[i].Value))
+      return(FALSE);
+  return(TRUE);
+}
+
+/* KeepUnchangedEntries(fresh,n,k): for each of the n entries of fresh,
+ *                   just read from SourceFiles[k], that is the same as
+ *                   an old one, keep the old one (with its tag and text)
+ *                   instead; the two change places.
+ */
+void KeepUnchangedEntries(struct Entry **fresh, int n, int k)
+{ static struct StringMap old = { NULL, 0, 0, FALSE };
   struct Entry *e;
-  char *v;
-  InitialText = strdup("");
+  void **slot;
+  int  i, j;
+  for (i=0;i<NumberOfEntries;i++)
+    { e = EntryArray[i];
+      if (e->SourceIndex == k && e->EntryTag != NULL)
+	{ slot = StringMapInsert(&old,e->EntryTag);
+	  if (*slot == NULL)
+	    *slot = (void *)(intptr_t)(i+1);
+	}
+    }
+  for (i=0;i<n;i++)
+    { if (fresh[i]->EntryTag == NULL ||
+	  (j = (intptr_t)StringMapLookup(&old,fresh[i]->EntryTag)-1) < 0 ||
+	  !SameEntry(EntryArray[j],fresh[i]))
+	continue;
+      *StringMapInsert(&old,fresh[i]->EntryTag) = NULL;
+      e = EntryArray[j];
+      e->SourceStart = fresh[i]->SourceStart;
+      e->SourceEnd = fresh[i]->SourceEnd;
+      e->TagStart = fresh[i]->TagStart;
+      EntryArray[j] = fresh[i];
+      fresh[i] = e;
+    }
+  StringMapClear(&old,FALSE);
+}
+
+/* ReadWatchedFile(k): read SourceFiles[k] again, and put its entries in
+ *                     place of those read from it before.
+ */
+void ReadWatchedFile(int k)
+{ struct Entry **all = EntryArray, **fresh, **old, **redo, *preamble, *e;
+  int  all_n = NumberOfEntries, all_size = EntryArraySize;
+  int  nstrings = NumberOfStrings, nfresh, nold, n, i, j, changed;
+  char *text = InitialText;
+  struct stat st;
+  FILE *f;
+  f = OpenInputFile(SourceFiles[k].Name);
+  if (f == NULL)
+    { fprintf(MessageFile,"Bibtag: Cannot read %s; keeping its old entries\n",
+	      SourceFiles[k].Name);
+      return;
+    }
+  if (stat(SourceFiles[k].Name,&st) == 0)
+    { SourceFiles[k].Size = st.st_size;
+      SourceFiles[k].MTime = st.st_mtim;
+    }
+  InputFile = f;
+  strcpy(InputFileName,SourceFiles[k].Name);
+  InputSourceIndex = k;
+  preamble = Preamble;
   Preamble = NULL;
-  NumberOfStrings = 0;
-  NumberOfEntries = 0;
-  if (argc==2 && argv[1][0]=='-' && tolower(argv[1][1]=='h'))
-    { /* -h or -help option */
-      PrintUsage(); 
-      exit(0);
+  EntryArray = NULL;
+  NumberOfEntries = EntryArraySize = 0;
+  ReadDataBase();
+  InputSourceIndex = -1;
+  fresh = EntryArray;
+  nfresh = NumberOfEntries;
+  EntryArray = all;
+  NumberOfEntries = all_n;
+  EntryArraySize = all_size;
+  /* The text before the first entry is that of the last file */
+  if (k == NumberOfWatchedFiles-1)
+    free(text);
+  else
+    { free(InitialText);
+      InitialText = text;
     }
-  if (argc == 1)
-    { /* no input file name given */
-      InputFile = stdin;
-      ReadDataBase();
-      ResolveCrossReferences();
+  /* The last @preamble read is the one kept */
+  if (Preamble == NULL && preamble != NULL && preamble->SourceIndex == k)
+    StartOver(SourceFiles[k].Name,"its @preamble has gone");
+  if (Preamble == NULL)
+    Preamble = preamble;
+  else if (preamble != NULL && preamble->SourceIndex > k)
+    { FreeEntry(Preamble);
+      Preamble = preamble;
     }
-  for (i=1;i<argc;i++)
-    {
-      if (argv[i][0]!='-')
-	{ 
-	  /* process an input file name */
-	  strcpy(InputFileName,argv[i]);
-	  if (InputFileName[0])
-	    { 
-	      InputFile = fopen(InputFileName,"r");
-	      if (InputFile == NULL) 
-		{ fprintf(MessageFile,
-			  "\nBibtag: Input file open error: %s\n",
-			  InputFileName); 
-		  exit(0); 
-		}
-	    }
-	  /* Input the entire database into memory */
-	  ReadDataBase();
-	  ResolveCrossReferences();
+  else if (preamble != NULL)
+    FreeEntry(preamble);
+  /* Its @string definitions replace its old ones; since later ones win,
+     the macros are all defined again */
+  n = NumberOfStrings - nstrings;
+  redo = (struct Entry **)mymalloc(n*sizeof(struct Entry *));
+  memcpy(redo,StringArray+nstrings,n*sizeof(struct Entry *));
+  NumberOfStrings = nstrings;
+  nold = SpliceEntries(&StringArray,&NumberOfStrings,&StringArraySize,k,
+		       redo,n,&old);
+  changed = (nold != n || !SameStrings(old,redo,n));
+  if (nold > 0 || n > 0)
+    { ClearMacros();
+      for (i=0;i<NumberOfStrings;i++)
+	DefineMacro(StringArray[i]);
+    }
+  for (i=0;i<nold;i++)
+    FreeEntry(old[i]);
+  free(old);
+  free(redo);
+  /* Its entries replace its old ones; link the crossrefs again */
+  KeepUnchangedEntries(fresh,nfresh,k);
+  nold = SpliceEntries(&EntryArray,&NumberOfEntries,&EntryArraySize,k,
+		       fresh,nfresh,&old);
+  free(fresh);
+  redo = (struct Entry **)mymalloc(NumberOfEntries*sizeof(struct Entry *));
+  for (i=0;i<NumberOfEntries;i++)
+    { e = EntryArray[i];
+      redo[i] = e->CrossRef;
+      e->CrossRef = NULL;
+      e->IsCrossRef = FALSE;
+      for (j=1;j<e->EntrySize;j++)
+	if (strcasecmp(e->Attributes[j].Name,"crossrefonly") == 0)
+	  e->IsCrossRef = TRUE;
+    }
+  LinkCrossReferences(TRUE);
+  /* Compute the base tags of its new entries (which have none yet), of
+     those whose crossref target changed, and, if the macros changed, of
+     all of them */
+  for (i=0,n=0;i<NumberOfEntries;i++)
+    { e = EntryArray[i];
+      if (changed && e->EntryExpansion != NULL)
+	{ for (j=0;j<e->EntrySize;j++)
+	    free(e->EntryExpansion[j]);
+	  free(e->EntryExpansion);
+	  e->EntryExpansion = NULL;
 	}
-      else
-	{ /* process option */
-	  c1 = tolower(argv[i][1]);
-	  c2 = tolower(argv[i][2]);
-	  if (c1=='o')
-	    { /* Set output file name */
-	      if (argv[i][2]!=0)
-		strcpy(OutputFileName,argv[i]+2);
-	      else
-		{ 
-		  i++;
-		  if (i<argc)
-		    strcpy(OutputFileName,argv[i]);
-		  else
-		    {
-		      fprintf(MessageFile,
-			      "\nBibtag: No file name given for -o option.");
-		      exit(0);
-		    }
-		}
-	      /* Now open the output file */
-	      if (OutputFileName[0])
-		{
-		  OutputFile = fopen(OutputFileName,"w");
-		  if (OutputFile == NULL) 
-		    { fprintf(MessageFile,
-			      "\nBibtag: Output file open error: %s",
-			      OutputFileName); 
-		      exit(0); 
-		    }
-		}
-	    }
-	  else if (c1=='n')
-	    {
-	      SortSwitch = FALSE;
-	    }
-	  else if (c1=='s')
-	    {
-	      SaveOldTags = TRUE;
-	    }
-	  else if (c1=='i')
-	    { /* set indentation level for attributes and values */
-	      AttributeIndent=atoi(argv[i]+2);
-	      if (AttributeIndent<0) AttributeIndent = 0;
-	      if (AttributeIndent>20) AttributeIndent= 20;
-	      j = 0;
-	      while (argv[i][j] && argv[i][j]!=',') j++;
-	      if (argv[i][j]==',')
-		{ /* set indentation level for values */
-		  ValueIndent=atoi(argv[i]+j+1);
-		  if (ValueIndent<0) ValueIndent = 0;
-		  if (ValueIndent>40) ValueIndent= 40;
-		}
-	    }
-	  else if (c1=='b' || c1 == 'q')
-	    { /* Use braces for value delimiters on output */
-	      int OldLeftValueDelimiter, OldRightValueDelimiter;
-	      if (c1 == 'b')
-		{ LeftValueDelimiter = '{';
-		  RightValueDelimiter = '}';
-		  OldLeftValueDelimiter = '"';
-		  OldRightValueDelimiter = '"';
-		}
-	      else if (c1 == 'q')
-		{ LeftValueDelimiter = '"';
-		  RightValueDelimiter = '"';
-		  OldLeftValueDelimiter = '{';
-		  OldRightValueDelimiter = '}';
-		}
-	      for (k=0;k<NumberOfEntries;k++)
-		{ e = EntryArray[k];
-		  for (j=1;j<e->EntrySize;j++)
-		    if (e->EntryValue[j][0] == OldLeftValueDelimiter &&
-			e->EntryValue[j][strlen(e->EntryValue[j])-1] ==
-			OldRightValueDelimiter)
-		      { e->EntryValue[j][0] = LeftValueDelimiter;
-			e->EntryValue[j][strlen(e->EntryValue[j])-1] =
-			  RightValueDelimiter;
-		      }
-		}
-	    }
-	  else if (c1=='=')
-	    { /* compact equals sign '=' instead of ' = ' on output */
-	      CompactEqualsSign = TRUE;
-	    }
-	  else if (c1=='a') 
-	    { /* author portion of tag field */
-	      if (argv[i][2]!=0)
-		FirstAuthorNameLengthBound = atoi(argv[i]+2);
-	      j = 0;
-	      while (argv[i][j]!=0&&argv[i][j]!=',') j++;
-	      if (argv[i][j] == ',')
-		{ j++;
-		  SecondAuthorNameLengthBound = atoi(argv[i]+j);
-		  while (argv[i][j]!=0&&argv[i][j]!=',') j++;
-		  if (argv[i][j] == ',')
-		    AuthorBound = atoi(argv[i]+j+1);
-		}
-	      for (k=0;k<NumberOfEntries;k++)
-		AppendAuthorInfoToNewEntryTag(EntryArray[k]);
-	    }
-	  else if (c1=='t') 
-	    { /* title portion of tag field */
-	      if (argv[i][2]!=0)
-		FirstTitleWordLengthBound = atoi(argv[i]+2);
-	      j = 0;
-	      while (argv[i][j]!=0&&argv[i][j]!=',') j++;
-	      if (argv[i][j] == ',')
-		{ j++;
-		  SecondTitleWordLengthBound = atoi(argv[i]+j);
-		  while (argv[i][j]!=0&&argv[i][j]!=',') j++;
-		  if (argv[i][j] == ',')
-		    TitleWordCountBound = atoi(argv[i]+j+1);
-		}
-	      for (k=0;k<NumberOfEntries;k++)
-		AppendTitleToNewEntryTag(EntryArray[k]);
-	    }
-	  else if (c1=='c')
-	    { /* check digits */
-	      CheckDigitsWanted = 1; /* default */
-	      if (c2!=0)
-		CheckDigitsWanted = atoi(argv[i]+2);
-	      for (k=0;k<NumberOfEntries;k++)
-		AppendCheckDigitsToNewEntryTag(EntryArray[k]);
-	    }
-	  else if (c1=='-')
-	    { /* Clear hyphen switch */
-	      UseHyphens = FALSE;
-	    }
-	  else if (c1=='y')
-	    { /* year */
-	      if (c2!=0)
-		YearDigitsWanted = atoi(argv[i]+2);
-	      if (YearDigitsWanted<0) YearDigitsWanted = 0;
-	      if (YearDigitsWanted>4) YearDigitsWanted = 4;
-	      for (k=0;k<NumberOfEntries;k++)
-		AppendYearToNewEntryTag(EntryArray[k]);
-	    }
-	  else if (c1=='e')
-	    {
-	      for (k=0;k<NumberOfEntries;k++)
-		AppendOldExtensionsToNewEntryTag(EntryArray[k]);
-	    }
-	  else if (c1 == 'l')
-	    {
-	      for (k=0;k<NumberOfEntries;k++)
-		{ struct Entry *e = EntryArray[k];
-		  if (e->NewEntryTag != NULL)
-		    { strcpy(NewEntryTag,e->NewEntryTag);
-		      free(e->NewEntryTag);
-		    }
-		  else
-		    NewEntryTag[0] = 0;
-		  strcat(NewEntryTag,argv[i]+2);
-		  e->NewEntryTag = strdup(NewEntryTag);
-		}
-	    }
-	  else if (c1 == 'p')
-	    {
-	      for (k=0;k<NumberOfEntries;k++)
-		{ struct Entry *e = EntryArray[k];
-		  if (e->NewEntryTag != NULL)
-		    { strcpy(NewEntryTag,e->NewEntryTag);
-		      free(e->NewEntryTag);
-		    }
-		  else
-		    NewEntryTag[0] = 0;
-		  strcat(NewEntryTag,e->EntryTag);
-		  e->NewEntryTag = strdup(NewEntryTag);
-		}
-	    }
-	  else if (c1 == 'u')
-	    {
-	      for (k=0;k<HASHTABLESIZE;k++) 
-		HashTable[k] = 0;
-	      for (k=0;k<NumberOfEntries;k++)
-		AppendExtensionToMakeNewEntryTagUnique(EntryArray[k]);
-	    }
-	  else
-	    { /* Illegal option */
-	      fprintf(MessageFile,"\nBibtag: Illegal option: %s",argv[i]);
-	    }
-        }
+      if (changed || (e->SourceIndex == k && e->BaseTag == NULL) ||
+	  e->CrossRef != redo[i])
+	redo[n++] = e;
     }
+  ComputeBaseTags(redo,n);
+  free(redo);
+  for (i=0;i<nold;i++)
+    FreeEntry(old[i]);
+  free(old);
 }
 
-
-void ReplaceTags()
+/* WriteWatchedOutput: finish the tags, write the output file, and put
+ *                     the entries back as they were read.
+ */
+struct SavedTag
+{
+  struct Entry *Entry;
+  char *Tag;
+};
+struct SavedValue
 {
+  char **Place;
+  char *Value;
+};
+
+void WriteWatchedOutput()
+{ struct SavedTag *tags;
+  struct SavedValue *values = NULL;
   struct Entry *e;
-  int k;
-  char *v;
-  { /* Replace tags in output file with newly computed ones */
-    if (SaveOldTags)
-      { /* save old tag in attribute "oldtag" 
-	   when new tag is different 
-	   */
-	for (k=0;k<NumberOfEntries;k++)
-	  { e = EntryArray[k];
-	    MakeDefaultNewEntryTag(e);
-	    if (strcmp(e->NewEntryTag,e->EntryTag)!=0)
-	      { 
-		if (e->EntryAttribute[0] != NULL) 
-		  free(e->EntryAttribute[0]);
-		e->EntryAttribute[0] = strdup("oldtag");
-		if (e->EntryValue[0] != NULL) 
-		  free(e->EntryValue[0]);
-		e->EntryValue[0] = mymalloc(strlen(e->EntryTag)+3);
-		e->EntryValue[0][0]=LeftValueDelimiter;
-		e->EntryValue[0][1]=0;
-		strcat(e->EntryValue[0],e->EntryTag);
-		e->EntryValue[0][strlen(e->EntryTag)+1]=
-		  RightValueDelimiter;
-		e->EntryValue[0][strlen(e->EntryTag)+2]=0;
+  int  i, j, n = NumberOfEntries, nvalues = 0, size = 0;
+  char *tmpname, *slash;
+  /* -u and the options after it start again from the base tags */
+  ClearUniqueTags();
+  for (i=0;i<n;i++)
+    { e = EntryArray[i];
+      e->NewEntryTag = (e->BaseTag != NULL) ? strdup(e->BaseTag) : NULL;
+    }
+  SetTagParameters(&BaseParameters);
+  for (i=FirstUniqueOption;i<NumberOfReplayOptions;i++)
+    ExecuteOption(ReplayArgc,ReplayArgv,ReplayOptions[i]);
+  /* Note what replacing the tags changes: the tags, the order, and the
+     newtag values, whose braces are stripped off in place */
+  tags = (struct SavedTag *)mymalloc(n*sizeof(struct SavedTag));
+  for (i=0;i<n;i++)
+    { e = EntryArray[i];
+      tags[i].Entry = e;
+      tags[i].Tag = e->EntryTag;
+      for (j=1;j<e->EntrySize;j++)
+	if (strcasecmp(e->Attributes[j].Name,"newtag") == 0)
+	  { if (nvalues >= size)
+	      { size = size ? 2*size : 64;
+		values = (struct SavedValue *)
+		  realloc(values,size*sizeof(struct SavedValue));
+		if (values == NULL)
+		  { fprintf(MessageFile,"\nMemory allocation failure.\n");
+		    exit(0);
+		  }
 	      }
+	    values[nvalues].Place = &e->Attributes[j].Value;
+	    values[nvalues++].Value = e->Attributes[j].Value;
+	    e->Attributes[j].Value = strdup(e->Attributes[j].Value);
 	  }
+    }
+  slash = strrchr(OutputFileName,'/');
+  j = (slash != NULL) ? slash+1-OutputFileName : 0;
+  tmpname = mymalloc(strlen(OutputFileName)+10);
+  sprintf(tmpname,"%.*s.bibtag-%s",j,OutputFileName,OutputFileName+j);
+  OutputFile = OpenOutputFile(tmpname);
+  if (OutputFile == NULL)
+    fprintf(MessageFile,"\nBibtag: Output file open error: %s\n",tmpname);
+  else
+    { setvbuf(OutputFile,NULL,_IOFBF,WATCHBUFFERSIZE);
+      PrintDataBase();
+      if (fclose(OutputFile) != 0 || rename(tmpname,OutputFileName) != 0)
+	{ fprintf(MessageFile,"\nBibtag: Output write error: %s\n",
+		  OutputFileName);
+	  unlink(tmpname);
+	}
+    }
+  OutputFile = stdout;
+  free(tmpname);
+  /* Put the entries back */
+  for (i=0;i<n;i++)
+    { e = tags[i].Entry;
+      EntryArray[i] = e;
+      if (e->EntryTag != tags[i].Tag)
+	{ free(e->EntryTag);
+	  e->EntryTag = tags[i].Tag;
+	}
+      if (e->Attributes[0].Name != NULL)
+	{ free(e->Attributes[0].Name);
+	  free(e->Attributes[0].Value);
+	  e->Attributes[0].Name = e->Attributes[0].Value = NULL;
+	}
+      if (e->NewEntryTag != GetValue(e,"newtag"))
+	free(e->NewEntryTag);    /* (else it is that value, freed below) */
+      e->NewEntryTag = NULL;
+      e->Modified = 0;
+    }
+  for (i=0;i<nvalues;i++)
+    { free(*values[i].Place);
+      *values[i].Place = values[i].Value;
+    }
+  free(values);
+  free(tags);
+}
+
+/* WatchInputFiles: write the output, and then write it again each time
+ *                  an input file changes.  Does not return.
+ */
+void WatchInputFiles()
+{
+#ifdef HAVE_SYS_INOTIFY_H
+  char buf[8192] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  struct inotify_event *ev;
+  struct pollfd pfd;
+  struct timespec t0, t1;
+  struct stat st, out;
+  char *dir, *slash;
+  int  fd, k, changed;
+  ssize_t n, i;
+  fd = inotify_init1(IN_CLOEXEC);
+  if (fd < 0)
+    { fprintf(MessageFile,"\nBibtag: Cannot watch files: %s\n",
+	      strerror(errno));
+      exit(0);
+    }
+  for (k=0;k<NumberOfWatchedFiles;k++)
+    { /* (watching the directory sees files saved by renaming too) */
+      slash = strrchr(SourceFiles[k].Name,'/');
+      WatchedFiles[k].Base = slash ? slash+1 : SourceFiles[k].Name;
+      if (slash == NULL)
+	dir = strdup(".");
+      else
+	dir = strndup(SourceFiles[k].Name,
+		      slash > SourceFiles[k].Name ? slash-SourceFiles[k].Name : 1);
+      WatchedFiles[k].Directory =
+	inotify_add_watch(fd,dir,IN_CLOSE_WRITE|IN_MOVED_TO);
+      if (WatchedFiles[k].Directory < 0)
+	{ fprintf(MessageFile,"\nBibtag: Cannot watch %s: %s\n",dir,
+		  strerror(errno));
+	  exit(0);
+	}
+      free(dir);
+    }
+  for (k=0;k<NumberOfWatchedFiles;k++)
+    if (stat(SourceFiles[k].Name,&st) == 0 && stat(OutputFileName,&out) == 0 &&
+	st.st_dev == out.st_dev && st.st_ino == out.st_ino)
+      { fprintf(MessageFile,"\nBibtag: With --watch, the output file cannot "
+		"be an input file\n");
+	exit(0);
       }
-    /* Now actually replace the old tag with the new one */
-    /* Don't change tags of cross-ref targets */
-    /* newtag overrides computed tag */
-    for (k=0;k<NumberOfEntries;k++)
-      { e = EntryArray[k];
-	v = GetValue(e,"newtag");
-	if (v != NULL)
-	  {
-	    if (e->NewEntryTag != NULL) 
-	      free(e->NewEntryTag);
-	    e->NewEntryTag = v;
-	    if (v[0] == '"' || v[0] == '{' )
-	      { /* strip off surrounding braces or quotes */
-		strcpy(v,v+1);
-		if (strlen(v)>0)
-		  v[strlen(v)-1]=0;
-	      }
+  FinishSelection();
+  ComputeBaseTags(EntryArray,NumberOfEntries);
+  WriteWatchedOutput();
+  ReportDiagnostics();
+  ReportTagChanges = FALSE;
+  fprintf(MessageFile,"\nBibtag: done (%d strings, %d entries); "
+	  "watching the input files.\n",NumberOfStrings,NumberOfEntries);
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  while (TRUE)
+    { /* Wait for an input file to be written, and then for things to
+	 quieten down, so that a burst of writes is followed only once */
+      changed = FALSE;
+      do
+	{ n = read(fd,buf,sizeof(buf));
+	  if (n < 0 && errno != EINTR)
+	    { fprintf(MessageFile,"\nBibtag: Cannot watch files: %s\n",
+		      strerror(errno));
+	      exit(0);
+	    }
+	  for (i=0;i<n;i+=sizeof(struct inotify_event)+ev->len)
+	    { ev = (struct inotify_event *)(buf+i);
+	      for (k=0;k<NumberOfWatchedFiles;k++)
+		if (ev->len > 0 && ev->wd == WatchedFiles[k].Directory &&
+		    strcmp(ev->name,WatchedFiles[k].Base) == 0)
+		  changed = WatchedFiles[k].Changed = TRUE;
+	    }
+	}
+      while (!changed || poll(&pfd,1,WATCHQUIET) > 0);
+      clock_gettime(CLOCK_MONOTONIC,&t0);
+      for (k=0;k<NumberOfWatchedFiles;k++)
+	if (WatchedFiles[k].Changed)
+	  { WatchedFiles[k].Changed = FALSE;
+	    if (NumberOfSelections > 0)
+	      StartOver(SourceFiles[k].Name,
+			"--select depends on all the input files");
+	    ReadWatchedFile(k);
 	  }
-	if (e->IsCrossRef == 0 && 
-	    e->NewEntryTag != NULL &&
-	    strcmp(e->EntryTag,e->NewEntryTag) != 0)
-	  { /* print old and new tags out if they are different */
-	    fprintf(MessageFile,
-		    "Bibtag: %s ==> %s\n",
-		    e->EntryTag,
-		    e->NewEntryTag);
-	    /* now actually do replacement */
-	    free(e->EntryTag);
-	    e->EntryTag = strdup(e->NewEntryTag);
+      WriteWatchedOutput();
+      ReportDiagnostics();
+      clock_gettime(CLOCK_MONOTONIC,&t1);
+      fprintf(MessageFile,"Bibtag: %s written again (%d entries, %.0f ms).\n",
+	      OutputFileName,NumberOfEntries,
+	      (t1.tv_sec-t0.tv_sec)*1e3 + (t1.tv_nsec-t0.tv_nsec)/1e6);
+    }
+#endif
+}
+
+/* *** BATCH MODE *** */
+/* With --batch-out=dir, or --batch=list, each input file is a database of
+   its own: it is read, retagged (with a -u namespace of its own), sorted
+   and printed to its own output file, just as if bibtag had been run on
+   it alone.  The files are shared out among -j worker threads, each
+   taking the next file to do when it has finished one.  All the globals
+   that describe a database, or that the tag options change as they are
+   carried out, are PERWORKER, so each worker has its own.  The options
+   that only say how the output is printed are carried out once, before
+   the workers start; each worker carries out all the others, in order,
+   on each of its files.
+ */
+struct BatchFile
+{
+  char *In;                      /* input file name */
+  char *Out;                     /* output file name */
+} *BatchFiles = NULL;
+int  NumberOfBatchFiles = 0;
+int  BatchFilesSize = 0;
+int  NextBatchFile = 0;          /* next one for a worker to take */
+char **BatchArgv;                /* command line, for the workers */
+int  BatchArgc;
+int  BatchInputIndex = 0;        /* argv index at which the input file is
+				    read, or 0 if none is given there */
+int  BatchStrings = 0;           /* totals over all the files done */
+int  BatchEntries = 0;
+
+/* IsBatchSetting(arg): True if option arg only says how the output is
+ *                      printed, and is carried out once with --batch.
+ */
+int IsBatchSetting(char *arg)
+{ char c = tolower(arg[1]);
+  if (arg[1] == '-' && arg[2] != 0)
+    return(OptionArgument(arg,"--sort-by") != NULL ||
+	   OptionArgument(arg,"--quiet") != NULL ||
+	   OptionArgument(arg,"--batch") != NULL ||
+	   OptionArgument(arg,"--batch-out") != NULL);
+  return(c == 'n' || c == 's' || c == 'i' || c == '=' || c == 'j' ||
+	 c == 'h');
+}
+
+/* AddBatchFile(in,out,dir): add input file in, to be printed to file out,
+ *                   or if out is NULL to the file of the same name in
+ *                   directory dir.
+ */
+void AddBatchFile(char *in, char *out, char *dir)
+{ struct stat s1, s2;
+  char *base;
+  if (out == NULL)
+    { if (dir == NULL)
+	{ fprintf(MessageFile,"\nBibtag: No output file for %s; "
+		  "--batch-out=dir is needed\n",in);
+	  exit(0);
+	}
+      base = strrchr(in,'/');
+      base = (base != NULL) ? base+1 : in;
+      out = mymalloc(strlen(dir)+strlen(base)+2);
+      sprintf(out,"%s/%s",dir,base);
+    }
+  if (strcmp(in,out) == 0 ||
+      (stat(in,&s1) == 0 && stat(out,&s2) == 0 &&
+       s1.st_dev == s2.st_dev && s1.st_ino == s2.st_ino))
+    { fprintf(MessageFile,"\nBibtag: %s would be written over itself\n",in);
+      exit(0);
+    }
+  if (NumberOfBatchFiles >= BatchFilesSize)
+    { BatchFilesSize = BatchFilesSize ? 2*BatchFilesSize : 1024;
+      BatchFiles = (struct BatchFile *)
+	realloc(BatchFiles,BatchFilesSize*sizeof(struct BatchFile));
+      if (BatchFiles == NULL)
+	{ fprintf(MessageFile,"\nBibtag: Out of memory!\n");
+	  exit(0);
+	}
+    }
+  BatchFiles[NumberOfBatchFiles].In = in;
+  BatchFiles[NumberOfBatchFiles].Out = out;
+  NumberOfBatchFiles++;
+}
+
+/* ReadBatchList(name,dir): add the files listed in file name.  Each line
+ *                   holds an input file name and, after a tab (or, if
+ *                   there is no tab, after white space), its output file
+ *                   name; with no output file name, the output goes to
+ *                   directory dir.
+ */
+void ReadBatchList(char *name, char *dir)
+{ FILE *f;
+  char *line = NULL, *in, *out;
+  size_t size = 0;
+  ssize_t n;
+  f = fopen(name,"r");
+  if (f == NULL)
+    { fprintf(MessageFile,"\nBibtag: Cannot read batch list %s\n",name);
+      exit(0);
+    }
+  while ((n = getline(&line,&size,f)) >= 0)
+    { while (n > 0 && (line[n-1] == '\n' || line[n-1] == '\r'))
+	line[--n] = 0;
+      for (in=line;IsSpace(*in);in++) ;
+      if (*in == 0) continue;
+      out = strchr(in,'\t');
+      if (out == NULL)
+	for (out=in;*out && !IsSpace(*out);out++) ;
+      if (*out)
+	{ *out++ = 0;
+	  while (IsSpace(*out)) out++;
+	}
+      AddBatchFile(strdup(in),*out ? strdup(out) : NULL,dir);
+    }
+  free(line);
+  fclose(f);
+}
+
+/* SetBatchMode(argc,argv): if there is a --batch or --batch-out option,
+ *                   check that the command line can be carried out on
+ *                   each file on its own, and make the list of files.
+ */
+void SetBatchMode(int argc, char *argv[])
+{ char *list = NULL, *dir = NULL, *v;
+  int  i, last = 0;
+  for (i=1;i<argc;i++)
+    if ((v = OptionArgument(argv[i],"--batch")) != NULL && *v)
+      list = v;
+    else if ((v = OptionArgument(argv[i],"--batch-out")) != NULL && *v)
+      dir = v;
+  if (list == NULL && dir == NULL)
+    return;
+  for (i=1;i<argc;i++)
+    if (argv[i][0] != '-')
+      { if (BatchInputIndex == 0) BatchInputIndex = i;
+	else if (last != i-1)
+	  { fprintf(MessageFile,"\nBibtag: With --batch, options must come "
+		    "before or after all the input files, not between them\n");
+	    exit(0);
 	  }
+	last = i;
       }
-  }
+    else if (tolower(argv[i][1]) == 'o' ||
+	     OptionArgument(argv[i],"--memory-budget") != NULL ||
+	     OptionArgument(argv[i],"--watch") != NULL ||
+	     OptionArgument(argv[i],"--patch") != NULL ||
+	     OptionArgument(argv[i],"--rewrite-cites") != NULL ||
+	     OptionArgument(argv[i],"--tag-map") != NULL ||
+	     OptionArgument(argv[i],"--shard-by") != NULL ||
+	     OptionArgument(argv[i],"--lazy") != NULL ||
+	     OptionArgument(argv[i],"--save-snapshot") != NULL ||
+	     OptionArgument(argv[i],"--load-snapshot") != NULL)
+      { fprintf(MessageFile,
+		"\nBibtag: %s cannot be used with --batch\n",argv[i]);
+	exit(0);
+      }
+  for (i=BatchInputIndex;i>0 && i<=last;i++)
+    AddBatchFile(argv[i],NULL,dir);
+  if (list != NULL)
+    ReadBatchList(list,dir);
+  BatchArgc = argc;
+  BatchArgv = argv;
+  BatchMode = TRUE;
+  ReportTagChanges = FALSE;      /* (the lines of all files would mix) */
 }
 
-void PrintDataBase()
+/* FreeDataBase: free the database of the file just done, leaving the
+ *               worker ready for the next one.
+ */
+void FreeDataBase()
 { int i;
-  ReplaceTags();
-  SortEntries();
-  if (InitialText != NULL)
-    fprintf(OutputFile,"%s",InitialText);
-  if (Preamble != NULL)
-    PrintEntry(Preamble);
-  for (i=0;i<NumberOfStrings;i++)
-    PrintEntry(StringArray[i]);
   for (i=0;i<NumberOfEntries;i++)
-    PrintEntry(EntryArray[i]);
-  fprintf(OutputFile,"\n");
+    FreeEntry(EntryArray[i]);
+  for (i=0;i<NumberOfStrings;i++)
+    FreeEntry(StringArray[i]);
+  if (Preamble != NULL)
+    FreeEntry(Preamble);
+  for (i=0;i<NumberOfSourceFiles;i++)
+    free(SourceFiles[i].Name);
+  free(InitialText);
+  InitialText = NULL;
+  Preamble = NULL;
+  NumberOfEntries = NumberOfStrings = NumberOfSourceFiles = 0;
+  ClearMacros();
+  ClearUniqueTags();
+  StringMapClear(&WantedTargets,TRUE);
+  StringMapClear(&EntryTags,TRUE);
+  NumberOfSelections = 0;
+  SelectionPending = FALSE;
+}
+
+/* DoBatchFile(f): read, retag and print batch file f */
+void DoBatchFile(struct BatchFile *f)
+{ int i;
+  if (BatchInputIndex == 0)
+    { /* the --select options apply to the file, so come before it */
+      for (i=1;i<BatchArgc;i++)
+	if (strncmp(BatchArgv[i],"--select-",9) == 0)
+	  ExecuteOption(BatchArgc,BatchArgv,i);
+      ReadInputFile(f->In);
+    }
+  for (i=1;i<BatchArgc;i++)
+    if (i == BatchInputIndex)
+      ReadInputFile(f->In);
+    else if (BatchArgv[i][0] != '-' || IsBatchSetting(BatchArgv[i]) ||
+	     (BatchInputIndex == 0 && strncmp(BatchArgv[i],"--select-",9) == 0))
+      ;
+    else
+      ExecuteOption(BatchArgc,BatchArgv,i);
+  strcpy(OutputFileName,f->Out);
+  OutputFile = OpenOutputFile(OutputFileName);
+  if (OutputFile == NULL)
+    { fprintf(MessageFile,"\nBibtag: Output file open error: %s\n",
+	      OutputFileName);
+      exit(0);
+    }
+  PrintDataBase();
+  if (fclose(OutputFile) != 0)
+    { fprintf(MessageFile,"\nBibtag: Output write error: %s\n",
+	      OutputFileName);
+      exit(0);
+    }
+  __sync_fetch_and_add(&BatchStrings,NumberOfStrings);
+  __sync_fetch_and_add(&BatchEntries,NumberOfEntries);
+  FreeDataBase();
+}
+
+void *BatchWorker(void *arg)
+{ struct TagParameters defaults;
+  int k;
+  (void)arg;
+  GetTagParameters(&defaults);
+  while ((k = __sync_fetch_and_add(&NextBatchFile,1)) < NumberOfBatchFiles)
+    { SetTagParameters(&defaults);
+      LeftValueDelimiter = '{';
+      RightValueDelimiter = '}';
+      DoBatchFile(&BatchFiles[k]);
+    }
+  return(NULL);
+}
+
+/* RunBatch: do all the batch files, with -j worker threads */
+void RunBatch()
+{ pthread_t threads[64];
+  int i, n;
+  n = OutputThreads;
+  if (n > NumberOfBatchFiles) n = NumberOfBatchFiles;
+  for (i=1;i<n;i++)
+    if (pthread_create(&threads[i],NULL,BatchWorker,NULL) != 0)
+      break;
+  n = i;
+  BatchWorker(NULL);
+  for (i=1;i<n;i++)
+    pthread_join(threads[i],NULL);
+  ReportDiagnostics();
+  fprintf(MessageFile,"\nBibtag: done (%d files, %d strings, %d entries).\n",
+	  NumberOfBatchFiles,BatchStrings,BatchEntries);
 }
 
 /* main: parse options and do main processing loop.
@@ -1238,8 +6667,27 @@ char **argv;
   OutputFileName[0] = 0;
   OutputFile = stdout;
   ParseAndExecuteCommandLine(argc,argv);
+  if (WatchMode)
+    WatchInputFiles();           /* does not return */
+  if (BatchMode)
+    { RunBatch();
+      return 0;
+    }
+  if (Pipeline && OutputFile == stdout)
+    OutputFile = WriteBehindStream(stdout);
   PrintDataBase();
+  if (OutputFile != stdout && fclose(OutputFile) != 0)
+    { fprintf(MessageFile,"\nBibtag: Output write error: %s\n",
+	      OutputFileName);
+      exit(0);
+    }
+  if (TagMapFile != NULL && fclose(TagMapFile) != 0)
+    { fprintf(MessageFile,"\nBibtag: Tag map write error: %s\n",
+	      TagMapFileName);
+      exit(0);
+    }
+  ReportDiagnostics();
   fprintf(MessageFile,"\nBibtag: done (%d strings, %d entries).\n",
-	  NumberOfStrings,NumberOfEntries);
+	  NumberOfStrings,NumberOfEntries+SpilledEntries);
   return 0;
 }
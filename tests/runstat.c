@@ -0,0 +1,49 @@
+/* runstat file command ...: run the command, then write to the file the
+ *          seconds it took and the most memory it used (its peak resident
+ *          set size, in kilobytes), for tests/scaling.sh.  Exits as the
+ *          command did.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+int main(int argc, char *argv[])
+{ struct timeval start, end;
+  struct rusage usage;
+  pid_t pid;
+  int   status;
+  FILE *f;
+  if (argc < 3)
+    { fprintf(stderr,"usage: runstat file command [argument ...]\n");
+      return(2);
+    }
+  gettimeofday(&start,NULL);
+  pid = fork();
+  if (pid < 0)
+    { perror("runstat: fork");
+      return(2);
+    }
+  if (pid == 0)
+    { execvp(argv[2],argv+2);
+      perror(argv[2]);
+      _exit(127);
+    }
+  if (wait4(pid,&status,0,&usage) < 0)
+    { perror("runstat: wait4");
+      return(2);
+    }
+  gettimeofday(&end,NULL);
+  if ((f = fopen(argv[1],"w")) == NULL)
+    { perror(argv[1]);
+      return(2);
+    }
+  fprintf(f,"%.3f %ld\n",
+	  (end.tv_sec-start.tv_sec) + (end.tv_usec-start.tv_usec)/1e6,
+	  usage.ru_maxrss);
+  fclose(f);
+  return(WIFEXITED(status) ? WEXITSTATUS(status) : 1);
+}
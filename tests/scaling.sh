@@ -0,0 +1,95 @@
+#!/bin/sh
+# Run bibtag on generated pathological inputs of growing size (10k,
+# 100k and 1M entries; SCALING_SIZES overrides them) and fail if its
+# running time grows faster than n log n, or its memory faster than n.
+# The inputs are: entries that all have the same tag, for -u; entries
+# that all have the same crossref target; fields with no comma between
+# them; values with deeply nested braces; and one value as long as the
+# whole file.  Times under TIMEFLOOR seconds and memory under RSSFLOOR
+# kilobytes count as that much, so that start-up costs and timer noise
+# do not look like growth; SLACK allows for the rest of the noise.
+
+BIBTAG=${BIBTAG:-./bibtag}
+RUNSTAT=${RUNSTAT:-tests/runstat}
+SIZES=${SCALING_SIZES:-"10000 100000 1000000"}
+TIMEFLOOR=0.05
+RSSFLOOR=4096
+SLACK=2
+dir=`mktemp -d` || exit 1
+trap 'rm -rf "$dir"' 0
+
+fail() { echo "scaling: $*"; exit 1; }
+
+# generate family n: write the input of that family with n entries
+generate() {
+  awk -v family="$1" -v n="$2" 'BEGIN {
+    if (family == "same")
+      for (i = 0; i < n; i++)
+        printf("@article{X%d,\nauthor = {A. Smith},\ntitle = {Same},\nyear = 1990}\n\n", i);
+    else if (family == "xref") {
+      for (i = 0; i < n; i++)
+        printf("@inproceedings{p%d,\nauthor = {B. Jones},\ntitle = {T %d},\ncrossref = {conf}}\n\n", i, i);
+      printf("@proceedings{conf,\ntitle = {Conference},\nyear = 2001}\n");
+    }
+    else if (family == "comma")
+      for (i = 0; i < n; i++)
+        printf("@article{m%d,\nauthor = {C. Brown}\ntitle = {Missing %d}\nyear = 1995}\n\n", i, i);
+    else if (family == "nested") {
+      left = ""; right = "";
+      for (j = 0; j < 50; j++) { left = left "{"; right = right "}" }
+      for (i = 0; i < n; i++)
+        printf("@article{d%d,\ntitle = %sDeep %d%s,\nyear = 1980}\n\n", i, left, i, right);
+    }
+    else if (family == "long") {
+      printf("@misc{long,\nnote = {");
+      for (i = 0; i < n; i++)
+        printf("word%d ", i);
+      printf("}}\n");
+    }
+  }'
+}
+
+# options family: the options the family is run with
+options() {
+  case $1 in
+    same) echo "-u" ;;
+    *) echo "" ;;
+  esac
+}
+
+# within ratio limit: whether ratio <= limit
+within() {
+  awk -v r="$1" -v l="$2" 'BEGIN { exit !(r <= l) }'
+}
+
+for family in same xref comma nested long; do
+  opts=`options $family`
+  prevn= ; prevtime= ; prevrss=
+  for n in $SIZES; do
+    generate $family $n > "$dir/in.bib" || fail "cannot generate $family"
+    "$RUNSTAT" "$dir/stats" "$BIBTAG" "$dir/in.bib" $opts \
+      > "$dir/out.bib" 2> "$dir/err" ||
+      fail "bibtag failed on $family with $n entries"
+    test -s "$dir/out.bib" || fail "bibtag wrote nothing for $family"
+    stats=`cat "$dir/stats"`
+    set -- $stats
+    time=$1 rss=$2
+    test -n "$rss" || fail "no time and memory for $family"
+    echo "scaling: $family $n: ${time}s ${rss}kB"
+    if test -n "$prevn"; then
+      ratio=`awk -v t="$time" -v p="$prevtime" -v f=$TIMEFLOOR 'BEGIN {
+	       if (t < f) t = f; if (p < f) p = f; print t/p }'`
+      limit=`awk -v n=$n -v p=$prevn -v s=$SLACK 'BEGIN {
+	       print s*(n*log(n))/(p*log(p)) }'`
+      within $ratio $limit ||
+	fail "$family: time grew ${ratio}x from $prevn to $n entries (limit ${limit}x)"
+      ratio=`awk -v r="$rss" -v p="$prevrss" -v f=$RSSFLOOR 'BEGIN {
+	       if (r < f) r = f; if (p < f) p = f; print r/p }'`
+      limit=`awk -v n=$n -v p=$prevn -v s=$SLACK 'BEGIN { print s*n/p }'`
+      within $ratio $limit ||
+	fail "$family: memory grew ${ratio}x from $prevn to $n entries (limit ${limit}x)"
+    fi
+    prevn=$n prevtime=$time prevrss=$rss
+  done
+done
+exit 0
@@ -0,0 +1,51 @@
+#!/bin/sh
+# An entry kept by --select must keep its crossref target, and that
+# target's own target, even when the target does not match itself:
+# here e1 matches, t1 gets no year from its target u1, and u1 has the
+# wrong year.  The same must hold with --batch-out, which frees the
+# entries it drops.
+
+BIBTAG=${BIBTAG:-./bibtag}
+dir=`mktemp -d` || exit 1
+trap 'rm -rf "$dir"' 0
+
+cat > "$dir/in.bib" <<'END'
+@article{e1,
+  title = {Referring},
+  year = 2000,
+  crossref = {t1}
+}
+
+@book{t1,
+  title = {Target},
+  crossref = {u1}
+}
+
+@book{u1,
+  title = {Target of the target},
+  year = 1950
+}
+
+@article{x1,
+  title = {Not selected},
+  year = 1960
+}
+END
+
+fail() { echo "select-crossref: $*"; exit 1; }
+
+# check file: the file holds e1, t1 and u1, in that order, and not x1
+check() {
+  test "`grep '^@' "$1" | tr '\n' ' '`" = "@article{e1, @book{t1, @book{u1, " ||
+    fail "$2 kept `grep '^@' "$1" | tr '\n' ' '`"
+}
+
+"$BIBTAG" --select-year=1999-2001 "$dir/in.bib" > "$dir/out.bib" \
+  2> /dev/null || fail "--select-year failed"
+check "$dir/out.bib" "--select-year"
+
+mkdir "$dir/batch"
+"$BIBTAG" --select-year=1999-2001 --batch-out="$dir/batch" "$dir/in.bib" \
+  2> /dev/null || fail "--batch-out failed"
+check "$dir/batch/in.bib" "--batch-out"
+exit 0
@@ -0,0 +1,41 @@
+#!/bin/sh
+# --shard-by=year and --shard-by=type must name each shard after the
+# whole year or entry type of its entries (bibtag-1995.bib,
+# bibtag-article.bib), and --quiet must keep the shard count quiet.
+
+BIBTAG=${BIBTAG:-./bibtag}
+dir=`mktemp -d` || exit 1
+trap 'rm -rf "$dir"' 0
+
+awk 'BEGIN {
+  split("2020 2015 2001 1990 1995 1999", years, " ");
+  split("article proceedings inproceedings book", types, " ");
+  for (i = 0; i < 500; i++)
+    printf("@%s{k%d,\n  author = {Author%d, A.},\n  title = {Title %d},\n  year = {%s}\n}\n\n",
+           types[i%4+1], i, i, i, years[i%6+1]);
+}' > "$dir/in.bib"
+
+fail() { echo "shard-keys: $*"; exit 1; }
+
+"$BIBTAG" "$dir/in.bib" --quiet --shard-by=year -o "$dir/out.bib" \
+  2> "$dir/err" || fail "--shard-by=year failed"
+for y in 2020 2015 2001 1990 1995 1999; do
+  test -f "$dir/out-$y.bib" || fail "no out-$y.bib"
+  n=`grep -c "year = *{$y}" "$dir/out-$y.bib"`
+  m=`grep -c '^@' "$dir/out-$y.bib"`
+  test "$n" -gt 0 && test "$n" = "$m" || fail "out-$y.bib has other years"
+done
+test `ls "$dir" | grep -c '^out-'` = 6 || fail "extra year shards"
+grep shards "$dir/err" && fail "--quiet printed the shard count"
+
+rm -f "$dir"/out-*
+"$BIBTAG" "$dir/in.bib" --quiet --shard-by=type --shard-index \
+  -o "$dir/out.bib" || fail "--shard-by=type failed"
+for t in article proceedings inproceedings book; do
+  test -f "$dir/out-$t.bib" || fail "no out-$t.bib"
+  test -f "$dir/out-$t.bib.idx" || fail "no out-$t.bib.idx"
+  n=`grep -c "^@$t{" "$dir/out-$t.bib"`
+  test "$n" = 125 || fail "out-$t.bib has $n entries, not 125"
+done
+test `ls "$dir" | grep -c '^out-.*\.bib$'` = 4 || fail "extra type shards"
+exit 0